@@ -0,0 +1,1128 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bus.h"
+#include "image.h"
+
+/*
+ * PDP-17 assembler
+ *
+ * Source syntax, as in example.s17:
+ *
+ *   LABEL,  MNEMONIC operands   / comment
+ *
+ * @addr sets the location counter, #expr assembles a word, $expr sets the
+ * start address. Operands are separated by spaces or commas. Numbers are hex
+ * and must start with a digit, except straight after @, #, $ or X; expressions
+ * are numbers, symbols and . (the current location) joined by + and -.
+ *
+ * Memory reference instructions take an optional accumulator and a target,
+ * with I and Z modifiers anywhere: "TAD A1 Z I6", "DCA A0 I Z A1", "JMS A6
+ * GETPKC", "DCA A3, *I0". A register target (A0-A7, I0-I6, PC) implies Z,
+ * *target sets I, and Xexpr assembles an immediate operand (I Z PC followed
+ * by the word). Other targets must be on the page of the instruction or on
+ * page 0, which is reached through Z.
+ *
+ * OPR microinstructions combine as on the PDP-8 and take an accumulator;
+ * register operations take "Ad, As" or "Ad, n"; IOTs take an accumulator, and
+ * the field IOTs that set a field take either an accumulator or a number from
+ * 0 to 7.
+ *
+ * Pass 1 tokenizes every line in place, defines labels and sizes statements;
+ * pass 2 encodes from the tokens without looking at the text again.
+ */
+
+#define MAX_ADDR (1 << 24)
+
+#define K_MRI 0 // memory reference
+#define K_OPR 1 // OPR microinstruction, see group below
+#define K_REG 2 // register operation, Ad, As
+#define K_REGI 3 // register operation, Ad, n
+#define K_IOT 4 // IOT with optional accumulator
+#define K_FIELD 5 // field IOT taking an accumulator or immediate
+#define K_IOTX 6 // IOT [Ax] device function
+#define K_FIXED 7 // no operands at all
+
+#define G_ANY 0 // CLA and NOP fit either OPR group
+#define G_1 1
+#define G_2 2 // OPR group 2, neither skip sense
+#define G_2OR 3
+#define G_2AND 4
+
+#define NEED_ACC 1 // STA and LDA are ISZ and JMP with an accumulator
+#define IS_MOV 2
+
+struct mnemonic {
+    const char *name;
+    int kind;
+    data_width_t bits;
+    int extra; // OPR group, or NEED_ACC/IS_MOV for MRIs
+};
+
+static const struct mnemonic mnemonics[] = {
+    {"AND", K_MRI, 0x0000, 0},
+    {"TAD", K_MRI, 0x2000, 0},
+    {"ADD", K_MRI, 0x2000, 0},
+    {"ISZ", K_MRI, 0x4000, 0},
+    {"STA", K_MRI, 0x4000, NEED_ACC},
+    {"DCA", K_MRI, 0x6000, 0},
+    {"JMS", K_MRI, 0x8000, 0},
+    {"JMP", K_MRI, 0xA000, 0},
+    {"LDA", K_MRI, 0xA000, NEED_ACC},
+    {"MOV", K_MRI, 0xA000, IS_MOV},
+
+    {"NOP", K_OPR, 0x00, G_ANY},
+    {"CLA", K_OPR, 0x80, G_ANY},
+    {"CLL", K_OPR, 0x40, G_1},
+    {"CMA", K_OPR, 0x20, G_1},
+    {"CML", K_OPR, 0x10, G_1},
+    {"IAC", K_OPR, 0x01, G_1},
+    {"BSW", K_OPR, 0x02, G_1},
+    {"RAL", K_OPR, 0x04, G_1},
+    {"RTL", K_OPR, 0x06, G_1},
+    {"RAR", K_OPR, 0x08, G_1},
+    {"RTR", K_OPR, 0x0A, G_1},
+    {"HSW", K_OPR, 0x0E, G_1},
+    {"SMA", K_OPR, 0x40, G_2OR},
+    {"SZA", K_OPR, 0x20, G_2OR},
+    {"SNL", K_OPR, 0x10, G_2OR},
+    {"SPA", K_OPR, 0x48, G_2AND},
+    {"SNA", K_OPR, 0x28, G_2AND},
+    {"SZL", K_OPR, 0x18, G_2AND},
+    {"SKP", K_OPR, 0x08, G_2AND},
+    {"OSR", K_OPR, 0x04, G_2},
+    {"HLT", K_OPR, 0x02, G_2},
+
+    {"SIR", K_REG, 0xE300, 0},
+    {"SWP", K_REG, 0xE310, 0},
+    {"IOR", K_REG, 0xE320, 0},
+    {"XOR", K_REG, 0xE330, 0},
+    {"SHL", K_REG, 0xE340, 0},
+    {"SLI", K_REGI, 0xE350, 0},
+    {"SHR", K_REG, 0xE360, 0},
+    {"SRI", K_REGI, 0xE370, 0},
+    {"ASR", K_REG, 0xE380, 0},
+    {"ASI", K_REGI, 0xE390, 0},
+
+    {"WAI", K_IOT, 0xC000, 0},
+    {"ION", K_IOT, 0xC001, 0},
+    {"IOF", K_IOT, 0xC002, 0},
+    {"SRQ", K_IOT, 0xC003, 0},
+    {"RPR", K_IOT, 0xC004, 0},
+    {"RTI", K_IOT, 0xC005, 0},
+    {"ACK", K_IOT, 0xC006, 0},
+    {"SMK", K_IOT, 0xC007, 0},
+    {"TSF", K_IOT, 0xC021, 0},
+    {"TPC", K_IOT, 0xC024, 0},
+    {"KSF", K_IOT, 0xC031, 0},
+    {"KRB", K_IOT, 0xC036, 0},
+    {"DSF", K_IOT, 0xC041, 0},
+    {"DCL", K_IOT, 0xC042, 0},
+    {"DRS", K_IOT, 0xC043, 0},
+    {"DRD", K_IOT, 0xC044, 0},
+    {"DWR", K_IOT, 0xC045, 0},
+    {"CSF", K_IOT, 0xC051, 0},
+    {"CCF", K_IOT, 0xC052, 0},
+    {"CMO", K_IOT, 0xC053, 0},
+    {"CST", K_IOT, 0xC054, 0},
+    {"CSP", K_IOT, 0xC055, 0},
+    {"CRD", K_IOT, 0xC056, 0},
+    {"SZP", K_FIELD, 0xC100, 0},
+    {"SDF", K_FIELD, 0xC101, 0},
+    {"SIB", K_FIELD, 0xC102, 0},
+    {"SDI", K_FIELD, 0xC103, 0},
+    {"LZP", K_IOT, 0xC104, 0},
+    {"LDF", K_IOT, 0xC105, 0},
+    {"LIF", K_IOT, 0xC106, 0},
+    {"LDI", K_IOT, 0xC107, 0},
+    {"IOT", K_IOTX, 0xC000, 0},
+
+    {"RET", K_FIXED, 0xA306, 0}, // JMP I Z A6
+};
+
+#define N_MNEMONICS (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+/*
+ * Hashed symbol table, open addressing with linear probing. Names point into
+ * the source buffer, which outlives the table.
+ */
+
+struct symbol {
+    const char *name;
+    uint32_t value;
+    int line;
+};
+
+struct symtab {
+    struct symbol *slots;
+    size_t size; // THIS MUST BE A POWER OF TWO
+    size_t used;
+};
+
+uint32_t hash(const char *name) {
+    uint32_t h = 2166136261u; // FNV-1a
+
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+int symtab_init(struct symtab *tab, size_t size) {
+    tab->slots = calloc(size, sizeof(struct symbol));
+    tab->size = size;
+    tab->used = 0;
+
+    return tab->slots == NULL ? ENOMEM : 0;
+}
+
+struct symbol *symtab_slot(struct symtab *tab, const char *name) {
+    size_t x = hash(name) & (tab->size - 1);
+
+    while (tab->slots[x].name != NULL && strcmp(tab->slots[x].name, name))
+        x = (x + 1) & (tab->size - 1);
+
+    return &tab->slots[x];
+}
+
+struct symbol *symtab_find(struct symtab *tab, const char *name) {
+    struct symbol *sym = symtab_slot(tab, name);
+
+    return sym->name == NULL ? NULL : sym;
+}
+
+/*
+ * Define a symbol. Returns EEXIST if it already is, ENOMEM if the table
+ * couldn't grow, 0 otherwise.
+ */
+
+int symtab_define(struct symtab *tab, const char *name, uint32_t value,
+    int line) {
+
+    if (tab->used * 2 >= tab->size) { // keep it at most half full
+        struct symtab grown;
+        if (symtab_init(&grown, tab->size * 2)) return ENOMEM;
+
+        for (size_t x = 0; x < tab->size; x++)
+            if (tab->slots[x].name != NULL)
+                *symtab_slot(&grown, tab->slots[x].name) = tab->slots[x];
+
+        grown.used = tab->used;
+        free(tab->slots);
+        *tab = grown;
+    }
+
+    struct symbol *sym = symtab_slot(tab, name);
+    if (sym->name != NULL) return EEXIST;
+
+    sym->name = name;
+    sym->value = value;
+    sym->line = line;
+    tab->used++;
+
+    return 0;
+}
+
+/*
+ * Assembler state
+ */
+
+struct stmt {
+    int line;
+    uint32_t loc;
+    size_t first; // first token
+    size_t count; // number of tokens
+};
+
+struct page {
+    data_width_t word[PAGE_SIZE];
+    uint8_t used[PAGE_SIZE];
+};
+
+struct as {
+    const char *file;
+    char *text;
+
+    char **tokens;
+    size_t n_tokens;
+    size_t tokens_size;
+
+    struct stmt *stmts;
+    size_t n_stmts;
+    size_t stmts_size;
+
+    struct symtab symbols;
+    struct symtab ops;
+
+    struct page *pages[MAX_ADDR / PAGE_SIZE];
+    uint32_t lowest;
+    uint32_t highest;
+    size_t words;
+
+    uint32_t start;
+    int start_set;
+    int lines;
+    int errors;
+};
+
+void error(struct as *as, int line, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "%s:%d: ", as->file, line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+
+    as->errors++;
+}
+
+int push_token(struct as *as, char *token) {
+    if (as->n_tokens == as->tokens_size) {
+        size_t size = as->tokens_size ? as->tokens_size * 2 : 4096;
+        char **grown = realloc(as->tokens, size * sizeof(char *));
+        if (grown == NULL) return ENOMEM;
+
+        as->tokens = grown;
+        as->tokens_size = size;
+    }
+
+    as->tokens[as->n_tokens++] = token;
+
+    return 0;
+}
+
+int push_stmt(struct as *as, int line, uint32_t loc, size_t first) {
+    if (as->n_stmts == as->stmts_size) {
+        size_t size = as->stmts_size ? as->stmts_size * 2 : 1024;
+        struct stmt *grown = realloc(as->stmts, size * sizeof(struct stmt));
+        if (grown == NULL) return ENOMEM;
+
+        as->stmts = grown;
+        as->stmts_size = size;
+    }
+
+    struct stmt *s = &as->stmts[as->n_stmts++];
+    s->line = line;
+    s->loc = loc;
+    s->first = first;
+    s->count = as->n_tokens - first;
+
+    return 0;
+}
+
+/*
+ * Operand parsing helpers
+ */
+
+int is_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == ',';
+}
+
+/*
+ * Returns the register number of A0-A7, I0-I6 or PC, -1 if name isn't one
+ */
+
+int reg_number(const char *name) {
+    if (name[0] == 'A' && name[1] >= '0' && name[1] <= '7' && !name[2])
+        return name[1] - '0';
+    if (name[0] == 'I' && name[1] >= '0' && name[1] <= '6' && !name[2])
+        return 010 + name[1] - '0';
+    if (!strcmp(name, "PC")) return 017;
+
+    return -1;
+}
+
+int is_immediate(const char *token) {
+    if (token[0] != 'X' || !token[1]) return 0;
+
+    for (const char *c = token + 1; *c; c++)
+        if (!isxdigit((unsigned char) *c)) return 0;
+
+    return 1;
+}
+
+/*
+ * Evaluate an expression at location loc. Symbols must already be defined,
+ * which in pass 1 means defined further up.
+ *
+ * return int: 0 on success, nonzero if an error was reported
+ */
+
+int eval(struct as *as, int line, uint32_t loc, const char *expr,
+    uint32_t *value) {
+
+    uint32_t result = 0;
+    int sign = 1;
+    const char *c = expr;
+
+    if (!*c) {
+        error(as, line, "missing expression");
+        return 1;
+    }
+
+    while (*c) {
+        uint32_t term;
+
+        if (*c == '.') {
+            term = loc;
+            c++;
+        }
+
+        else if (isdigit((unsigned char) *c)) {
+            char *end;
+            term = strtoul(c, &end, 16);
+            c = end;
+        }
+
+        else {
+            char name[256];
+            size_t len = 0;
+
+            while (*c && *c != '+' && *c != '-' && len < sizeof(name) - 1)
+                name[len++] = *c++;
+            name[len] = '\0';
+
+            struct symbol *sym = symtab_find(&as->symbols, name);
+            if (sym == NULL) {
+                error(as, line, "undefined symbol %s", name);
+                return 1;
+            }
+
+            term = sym->value;
+        }
+
+        result += sign * term;
+
+        if (*c == '+') sign = 1;
+        else if (*c == '-') sign = -1;
+        else if (*c) {
+            error(as, line, "bad expression %s", expr);
+            return 1;
+        }
+
+        if (*c && !*++c) {
+            error(as, line, "bad expression %s", expr);
+            return 1;
+        }
+    }
+
+    *value = result;
+
+    return 0;
+}
+
+/*
+ * After @, #, $ and X a plain run of hex digits is a number even if it starts
+ * with a letter, as in X000A or @A00
+ */
+
+int eval_prefixed(struct as *as, int line, uint32_t loc, const char *expr,
+    uint32_t *value) {
+
+    const char *c = expr;
+    while (isxdigit((unsigned char) *c)) c++;
+
+    if (*expr && !*c) {
+        *value = strtoul(expr, NULL, 16);
+        return 0;
+    }
+
+    return eval(as, line, loc, expr, value);
+}
+
+const struct mnemonic *find_op(struct as *as, const char *token) {
+    char name[8];
+    size_t len = strlen(token);
+
+    if (len >= sizeof(name)) return NULL;
+    for (size_t x = 0; x <= len; x++) name[x] = toupper((unsigned char) token[x]);
+
+    struct symbol *sym = symtab_find(&as->ops, name);
+
+    return sym == NULL ? NULL : &mnemonics[sym->value];
+}
+
+/*
+ * Pass 1: split the source into lines and tokens in place, define labels and
+ * assign locations. Returns nonzero if out of memory.
+ */
+
+int pass1(struct as *as) {
+    uint32_t loc = 0;
+    char *c = as->text;
+    int line = 0;
+
+    while (*c) {
+        char *eol = strchr(c, '\n');
+        if (eol != NULL) *eol = '\0';
+
+        line++;
+
+        char *comment = strchr(c, '/');
+        if (comment != NULL) *comment = '\0';
+
+        size_t first = as->n_tokens;
+        int first_token = 1;
+
+        while (1) {
+            while (*c && is_ws(*c)) c++;
+            if (!*c) break;
+
+            char *token = c;
+            while (*c && !is_ws(*c)) c++;
+
+            int label = first_token && *c == ',';
+            first_token = 0;
+
+            if (*c) *c++ = '\0';
+
+            if (label) {
+                int result = symtab_define(&as->symbols, token, loc, line);
+                if (result == ENOMEM) return ENOMEM;
+                if (result == EEXIST) {
+                    error(as, line, "%s already defined", token);
+                }
+                continue;
+            }
+
+            if (push_token(as, token)) return ENOMEM;
+        }
+
+        if (as->n_tokens > first) {
+            char *token = as->tokens[first];
+
+            if (push_stmt(as, line, loc, first)) return ENOMEM;
+
+            if (token[0] == '@') {
+                uint32_t origin;
+                if (!eval_prefixed(as, line, loc, token + 1, &origin)) loc = origin;
+            }
+
+            else if (token[0] == '#') loc += as->n_tokens - first;
+
+            else if (token[0] != '$') {
+                loc++;
+
+                for (size_t x = first + 1; x < as->n_tokens; x++)
+                    if (is_immediate(as->tokens[x])) loc++;
+            }
+        }
+
+        if (eol == NULL) break;
+        c = eol + 1;
+    }
+
+    as->lines = line;
+
+    return 0;
+}
+
+/*
+ * Store a word. Returns nonzero if out of memory.
+ */
+
+int emit(struct as *as, int line, uint32_t loc, data_width_t word) {
+    if (loc >= MAX_ADDR) {
+        error(as, line, "location beyond 16 MW");
+        return 0;
+    }
+
+    struct page **page = &as->pages[loc / PAGE_SIZE];
+
+    if (*page == NULL) {
+        *page = calloc(1, sizeof(struct page));
+        if (*page == NULL) return ENOMEM;
+    }
+
+    if (!(*page)->used[loc % PAGE_SIZE]) {
+        as->words++;
+        if (as->words == 1 || loc < as->lowest) as->lowest = loc;
+        if (as->words == 1 || loc > as->highest) as->highest = loc;
+    }
+
+    (*page)->word[loc % PAGE_SIZE] = word;
+    (*page)->used[loc % PAGE_SIZE] = 1;
+
+    return 0;
+}
+
+/*
+ * Encode a memory reference instruction. Returns the number of words
+ * written to words.
+ */
+
+int encode_mri(struct as *as, struct stmt *s, const struct mnemonic *op,
+    data_width_t *words) {
+
+    char **tok = &as->tokens[s->first + 1];
+    size_t n = s->count - 1;
+
+    int acc = -1, i = 0, z = 0, target = -1;
+
+    for (size_t x = 0; x < n; x++) {
+        if (!strcmp(tok[x], "I")) i = 1;
+        else if (!strcmp(tok[x], "Z")) z = 1;
+        else if (target >= 0) {
+            if (acc >= 0 || reg_number(tok[target]) < 0
+                || reg_number(tok[target]) > 7) {
+                error(as, s->line, "too many operands for %s", op->name);
+                return 0;
+            }
+
+            acc = reg_number(tok[target]);
+            target = x;
+        }
+        else target = x;
+    }
+
+    if (target < 0) {
+        error(as, s->line, "%s needs a target", op->name);
+        return 0;
+    }
+
+    if (acc < 0) acc = 0;
+
+    if (op->extra == NEED_ACC && !acc) {
+        error(as, s->line, "%s needs an accumulator other than A0", op->name);
+        return 0;
+    }
+
+    const char *t = tok[target];
+    uint32_t offset;
+    int count = 1;
+
+    if (*t == '*') {
+        i = 1;
+        t++;
+    }
+
+    if (reg_number(t) >= 0) {
+        z = 1;
+        offset = reg_number(t);
+    }
+
+    else if (is_immediate(t)) {
+        uint32_t value;
+        if (eval_prefixed(as, s->line, s->loc, t + 1, &value)) return 0;
+
+        i = z = 1;
+        offset = 017;
+        words[count++] = value & 0xFFFF;
+    }
+
+    else {
+        uint32_t value;
+        if (eval(as, s->line, s->loc, t, &value)) return 0;
+
+        uint32_t page = (value & 0xFFFF) & ~(PAGE_SIZE - 1);
+
+        if (!z && page != ((s->loc + 1) & 0xFFFF & ~(PAGE_SIZE - 1))) {
+            if (page) {
+                error(as, s->line, "%s is off page", t);
+                return 0;
+            }
+            z = 1; // reach page 0 through Z
+        }
+
+        offset = value & (PAGE_SIZE - 1);
+    }
+
+    if (op->extra == IS_MOV && (!z || i || offset > 017 || !acc)) {
+        error(as, s->line, "MOV needs A1-A7 and a register");
+        return 0;
+    }
+
+    words[0] = op->bits | acc << 10 | i << 9 | z << 8 | offset;
+
+    return count;
+}
+
+/*
+ * Combine OPR groups. Returns the group of the combination, -1 if the
+ * microinstructions can't go together.
+ */
+
+int merge_group(int group, int g) {
+    if (g == G_ANY) return group;
+    if (group == G_ANY) return g;
+    if (group == G_1 || g == G_1) return group == g ? group : -1;
+
+    if (group == G_2) return g; // skip sense from whichever has one
+    if (g == G_2 || g == group) return group;
+
+    return -1; // OR and AND group skips
+}
+
+/*
+ * Encode anything but a memory reference instruction. Returns nonzero on
+ * success.
+ */
+
+int encode_other(struct as *as, struct stmt *s, const struct mnemonic *op,
+    data_width_t *word) {
+
+    char **tok = &as->tokens[s->first + 1];
+    size_t n = s->count - 1;
+    int acc = 0;
+    int reg;
+
+    switch (op->kind) {
+        case K_OPR: {
+            int group = op->extra;
+            int ucode = op->bits;
+            int acc_set = 0;
+
+            for (size_t x = 0; x < n; x++) {
+                const struct mnemonic *more = find_op(as, tok[x]);
+
+                if ((reg = reg_number(tok[x])) >= 0 && reg <= 7 && !acc_set) {
+                    acc = reg;
+                    acc_set = 1;
+                    continue;
+                }
+
+                if (more == NULL || more->kind != K_OPR) {
+                    error(as, s->line, "bad microinstruction %s", tok[x]);
+                    return 0;
+                }
+
+                if ((group = merge_group(group, more->extra)) < 0) {
+                    error(as, s->line, "can't combine %s", tok[x]);
+                    return 0;
+                }
+
+                if (group == G_1 && (ucode & 0xE) && (more->bits & 0xE)) {
+                    error(as, s->line, "only one rotate allowed, %s", tok[x]);
+                    return 0;
+                }
+
+                ucode |= more->bits;
+            }
+
+            *word = 0xE000 | acc << 10 | ucode;
+            if (group >= G_2) *word |= 0x100;
+
+            return 1;
+        }
+
+        case K_REG:
+        case K_REGI: {
+            if (n != 2) {
+                error(as, s->line, "%s takes two operands", op->name);
+                return 0;
+            }
+
+            int dst = reg_number(tok[0]);
+            if (dst >= 010 && dst < 017 && op->bits == 0xE300) dst -= 010;
+            if (dst < 0 || dst > 7) {
+                error(as, s->line, "bad destination %s", tok[0]);
+                return 0;
+            }
+
+            uint32_t src = reg_number(tok[1]);
+
+            if (op->kind == K_REGI) {
+                if (eval(as, s->line, s->loc, tok[1], &src)) return 0;
+                if (src < 1 || src > 16) {
+                    error(as, s->line, "shift count %s out of range", tok[1]);
+                    return 0;
+                }
+                src--;
+            }
+
+            else if (src > 7) {
+                error(as, s->line, "bad source %s", tok[1]);
+                return 0;
+            }
+
+            *word = op->bits | dst << 10 | src;
+
+            return 1;
+        }
+
+        case K_IOT:
+        case K_FIELD:
+        case K_IOTX: {
+            size_t x = 0;
+            *word = op->bits;
+
+            if (x < n && (reg = reg_number(tok[x])) >= 0 && reg <= 7) {
+                *word |= reg << 10;
+                x++;
+            }
+
+            if (op->kind == K_FIELD && x == 0 && n == 1) {
+                uint32_t field;
+                if (eval(as, s->line, s->loc, tok[0], &field)) return 0;
+                if (field > 7) {
+                    error(as, s->line, "immediate field %s too big", tok[0]);
+                    return 0;
+                }
+
+                *word |= field << 10 | 0x8;
+                x++;
+            }
+
+            if (op->kind == K_IOTX) {
+                uint32_t dev, func;
+
+                if (n - x != 2) {
+                    error(as, s->line, "IOT takes a device and function");
+                    return 0;
+                }
+
+                if (eval(as, s->line, s->loc, tok[x], &dev)
+                    || eval(as, s->line, s->loc, tok[x + 1], &func)) return 0;
+
+                if (dev > 077 || func > 7) {
+                    error(as, s->line, "bad device or function");
+                    return 0;
+                }
+
+                *word |= dev << 4 | func;
+                x += 2;
+            }
+
+            if (x != n) {
+                error(as, s->line, "too many operands for %s", op->name);
+                return 0;
+            }
+
+            return 1;
+        }
+
+        case K_FIXED:
+            if (n) {
+                error(as, s->line, "%s takes no operands", op->name);
+                return 0;
+            }
+
+            *word = op->bits;
+
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Pass 2: encode every statement. Returns nonzero if out of memory.
+ */
+
+int pass2(struct as *as) {
+    for (size_t x = 0; x < as->n_stmts; x++) {
+        struct stmt *s = &as->stmts[x];
+        char *token = as->tokens[s->first];
+        uint32_t value;
+
+        if (token[0] == '@') continue; // done in pass 1
+
+        if (token[0] == '$') {
+            if (!eval_prefixed(as, s->line, s->loc, token + 1, &value)) {
+                as->start = value;
+                as->start_set = 1;
+            }
+            continue;
+        }
+
+        if (token[0] == '#') {
+            for (size_t y = 0; y < s->count; y++) {
+                char *data = as->tokens[s->first + y];
+
+                if (data[0] != '#') error(as, s->line, "bad data %s", data);
+                else if (!eval_prefixed(as, s->line, s->loc, data + 1, &value)
+                    && emit(as, s->line, s->loc + y, value & 0xFFFF))
+                    return ENOMEM;
+            }
+            continue;
+        }
+
+        const struct mnemonic *op = find_op(as, token);
+        data_width_t words[2];
+        int count;
+
+        if (op == NULL) {
+            error(as, s->line, "unknown mnemonic %s", token);
+            continue;
+        }
+
+        if (op->kind == K_MRI) count = encode_mri(as, s, op, words);
+        else count = encode_other(as, s, op, words);
+
+        for (int y = 0; y < count; y++)
+            if (emit(as, s->line, s->loc + y, words[y])) return ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Output
+ */
+
+data_width_t word_at(struct as *as, uint32_t addr) {
+    struct page *page = as->pages[addr / PAGE_SIZE];
+
+    return page == NULL ? 0 : page->word[addr % PAGE_SIZE];
+}
+
+int write_image(struct as *as, FILE *f, data_width_t switches) {
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+
+    uint32_t base = as->lowest & ~(PAGE_SIZE - 1);
+    uint32_t end = (as->highest + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+    uint32_t start = as->start_set ? as->start : as->lowest;
+
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.start = start & 0xFFFF;
+    header.df = start >> 16;
+    header.if_ = start >> 16;
+    header.switches = switches;
+    header.base = as->words ? base : 0;
+    header.words = as->words ? end - base : 0;
+
+    uint8_t pad[IMAGE_DATA] = {0};
+    memcpy(pad, &header, sizeof(header));
+    if (fwrite(pad, 1, IMAGE_DATA, f) != IMAGE_DATA) return errno;
+
+    for (uint32_t addr = base; addr < base + header.words; addr += PAGE_SIZE) {
+        struct page *page = as->pages[addr / PAGE_SIZE];
+        data_width_t zero[PAGE_SIZE] = {0};
+
+        if (fwrite(page == NULL ? zero : page->word, sizeof(data_width_t),
+            PAGE_SIZE, f) != PAGE_SIZE) return errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Monitor script output, loadable with the monitor or a batch job list
+ */
+
+int write_script(struct as *as, FILE *f) {
+    uint32_t next = MAX_ADDR;
+
+    for (uint32_t addr = as->lowest; as->words && addr <= as->highest; addr++) {
+        struct page *page = as->pages[addr / PAGE_SIZE];
+
+        if (page == NULL) {
+            addr |= PAGE_SIZE - 1;
+            continue;
+        }
+
+        if (!page->used[addr % PAGE_SIZE]) continue;
+
+        if (addr != next) fprintf(f, "a%X\n", addr);
+        fprintf(f, "d%04X\n", page->word[addr % PAGE_SIZE]);
+        next = addr + 1;
+    }
+
+    if (as->start_set) fprintf(f, "a%X\n", as->start);
+
+    return ferror(f) ? EIO : 0;
+}
+
+/*
+ * Symbol file, one "address name" line per label in address order, for the
+ * emulator's profiler
+ */
+
+int compare_symbols(const void *a, const void *b) {
+    const struct symbol *x = *(const struct symbol **) a;
+    const struct symbol *y = *(const struct symbol **) b;
+
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+int write_symbols(struct as *as, FILE *f) {
+    struct symbol **sorted = malloc(as->symbols.used * sizeof(struct symbol *));
+    if (sorted == NULL && as->symbols.used) return ENOMEM;
+
+    size_t count = 0;
+
+    for (size_t x = 0; x < as->symbols.size; x++)
+        if (as->symbols.slots[x].name != NULL)
+            sorted[count++] = &as->symbols.slots[x];
+
+    qsort(sorted, count, sizeof(struct symbol *), compare_symbols);
+
+    for (size_t x = 0; x < count; x++)
+        fprintf(f, "%06X %s\n", sorted[x]->value, sorted[x]->name);
+
+    free(sorted);
+
+    return ferror(f) ? EIO : 0;
+}
+
+double ms_since(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double ms = (now.tv_sec - t->tv_sec) * 1e3
+        + (now.tv_nsec - t->tv_nsec) / 1e6;
+    *t = now;
+
+    return ms;
+}
+
+void usage(char *name) {
+    fprintf(stderr, "usage: %s [-o output] [-m] [-w switches] [-s symbols] "
+        "[-t] source\n", name);
+}
+
+int main(int argc, char **argv) {
+    static struct as as;
+    char *out = NULL;
+    char *syms = NULL;
+    int script = 0;
+    int timings = 0;
+    data_width_t switches = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:mw:s:t")) != -1) {
+        switch (opt) {
+            case 'o': // output file
+                out = optarg;
+                break;
+            case 'm': // monitor script rather than image
+                script = 1;
+                break;
+            case 'w': // switches in the image header
+                switches = strtoul(optarg, NULL, 16);
+                break;
+            case 's': // symbol file for the profiler
+                syms = optarg;
+                break;
+            case 't': // per-phase timings
+                timings = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    as.file = argv[optind];
+
+    struct timespec t;
+    double t_read, t_pass1, t_pass2, t_write;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    FILE *f = fopen(as.file, "rb");
+    if (f == NULL) {
+        perror(as.file);
+        return 1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    as.text = malloc(len + 1);
+    if (as.text == NULL || fread(as.text, 1, len, f) != (size_t) len) {
+        perror(as.file);
+        return 1;
+    }
+
+    as.text[len] = '\0';
+    fclose(f);
+
+    if (symtab_init(&as.symbols, 1024) || symtab_init(&as.ops, 256)) {
+        perror("as17");
+        return 1;
+    }
+
+    for (size_t x = 0; x < N_MNEMONICS; x++)
+        symtab_define(&as.ops, mnemonics[x].name, x, 0);
+
+    t_read = ms_since(&t);
+
+    if (pass1(&as)) {
+        perror("as17");
+        return 1;
+    }
+
+    t_pass1 = ms_since(&t);
+
+    if (pass2(&as)) {
+        perror("as17");
+        return 1;
+    }
+
+    t_pass2 = ms_since(&t);
+
+    if (as.errors) {
+        fprintf(stderr, "%d errors\n", as.errors);
+        return 1;
+    }
+
+    char *name = out;
+
+    if (name == NULL && !script) {
+        size_t base = strlen(as.file);
+        if (base > 4 && !strcmp(as.file + base - 4, ".s17")) base -= 4;
+
+        name = malloc(base + 5);
+        memcpy(name, as.file, base);
+        strcpy(name + base, ".p17");
+    }
+
+    f = name == NULL ? stdout : fopen(name, script ? "w" : "wb");
+    if (f == NULL) {
+        perror(name);
+        return 1;
+    }
+
+    int result = script ? write_script(&as, f) : write_image(&as, f, switches);
+    if (f != stdout) result |= fclose(f) ? errno : 0;
+
+    if (result) {
+        fprintf(stderr, "%s: %s\n", name, strerror(result));
+        return 1;
+    }
+
+    if (syms != NULL) {
+        if ((f = fopen(syms, "w")) == NULL) result = errno;
+        else {
+            result = write_symbols(&as, f);
+            result |= fclose(f) ? errno : 0;
+        }
+
+        if (result) {
+            fprintf(stderr, "%s: %s\n", syms, strerror(result));
+            return 1;
+        }
+    }
+
+    t_write = ms_since(&t);
+
+    if (timings) {
+        fprintf(stderr, "read   %9.3f ms\n", t_read);
+        fprintf(stderr, "pass 1 %9.3f ms\n", t_pass1);
+        fprintf(stderr, "pass 2 %9.3f ms\n", t_pass2);
+        fprintf(stderr, "write  %9.3f ms\n", t_write);
+        fprintf(stderr, "%d lines, %zu symbols, %zu words\n",
+            as.lines, as.symbols.used, as.words);
+    }
+
+    return 0;
+}
@@ -0,0 +1,577 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "console.h"
+#include "batch.h"
+#include "image.h"
+#include "snapshot.h"
+#include "perf.h"
+#include "machine.h"
+
+/*
+ * Headless batch runner
+ *
+ * Runs a list of jobs, each on a fresh machine, on a pool of worker threads.
+ * A job list has one job per line:
+ *
+ *   image [start [switches [budget]]]
+ *
+ * where image is an image from as17, a snapshot or a monitor script (see
+ * load_script), start and switches are hex as in the monitor and override those from the
+ * image, and budget is a decimal cycle limit overriding the default; # starts
+ * a comment. Jobs are dealt out round robin to per-worker
+ * deques; workers take their own jobs from the bottom and steal from the top
+ * of the others' once they run out. Console output goes to a buffer per job
+ * and no TTY or console threads are started.
+ *
+ * Each distinct image is loaded once, into a template machine, before the
+ * workers start; every job then runs on a copy-on-write fork of its template,
+ * so jobs sharing an image share its memory until they write to it.
+ */
+
+#define JOB_HALT 0 // ran to HLT
+#define JOB_BUDGET 1 // ran out of cycles
+#define JOB_WAIT 2 // stopped on an IOT nothing will ever complete
+#define JOB_ERROR 3 // couldn't be loaded
+
+struct job {
+    char *image;
+    addr_width_t start;
+    int set_start;
+    data_width_t switches;
+    int set_switches; // otherwise the script's own w, if any, is kept
+    unsigned int budget;
+    machine *template; // shared with the other jobs for the same image
+    int owner; // this job frees the template
+
+    int status;
+    unsigned int cycles;
+    long long wall_ns;
+    data_width_t regs[16];
+    data_width_t flag;
+    size_t resident; // private pages at the end
+    uint8_t *output;
+    size_t output_len;
+    char *perf; // performance counters, see perf_dump
+    size_t perf_len;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t top;
+    size_t bottom;
+};
+
+struct pool {
+    struct job *jobs;
+    struct deque *deques;
+    int threads;
+    int show_perf;
+};
+
+struct worker {
+    struct pool *pool;
+    int id;
+};
+
+/*
+ * Load a monitor script: a sets the address, d deposits (repeating the last
+ * value if none is given) and w sets the switches, which are returned through
+ * switches if it isn't NULL. Anything else, such as g or q, is ignored.
+ *
+ * return int: 0 on success, errno value if the file can't be read, EINVAL on
+ * a malformed line, or the bus error from a bad deposit
+ */
+
+int load_script(machine *m, const char *path, data_width_t *switches) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return errno;
+
+    data_width_t addr = 0;
+    data_width_t data = 0;
+    char *line = NULL;
+    size_t len = 0;
+    int result = 0;
+
+    while (!result && getline(&line, &len, f) != -1) {
+        char command = '\0';
+        data_width_t value = 0;
+        int valid = sscanf(line, " %c%4hX", &command, &value);
+
+        if (valid < 1) continue;
+
+        switch (tolower(command)) {
+            case 'a':
+                if (valid == 2) addr = value;
+                else result = EINVAL;
+                break;
+            case 'd':
+                if (valid == 2) data = value;
+                result = bus_write(m, addr++, data);
+                break;
+            case 'w':
+                if (valid == 2 && switches != NULL) *switches = value;
+                break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    return result;
+}
+
+/*
+ * Load an image, snapshot or script into a new machine ready to be forked.
+ *
+ * return machine *: the machine, NULL if it can't be loaded
+ */
+
+machine *load_template(const char *path) {
+    machine *m = new_machine(-1, -1);
+    if (m == NULL) return NULL;
+
+    // jobs are forked with these; on host time a headless WAI would find
+    // nothing queued and stop as WAIT, and a snapshot's count would start a
+    // timer thread per job
+    m->timer.scheduled = 1;
+    m->disk.scheduled = 1;
+
+    int result = load_image(m, path);
+
+    if (result == ENOEXEC && (result = load_snapshot(m, path)) == ENOEXEC)
+        result = load_script(m, path, &m->switches);
+
+    if (!result) result = share_machine(m);
+
+    if (result) {
+        free_machine(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+void run_job(struct job *job, int show_perf) {
+    struct timespec before, after;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+
+    machine *m = NULL;
+
+    if (job->template != NULL) m = fork_machine(job->template, -1, -1);
+
+    if (m == NULL || console_capture(m)) {
+        job->status = JOB_ERROR;
+        if (m != NULL) free_machine(m);
+        return;
+    }
+
+    volatile int running = 1;
+
+    if (job->set_switches) m->switches = job->switches;
+    if (job->set_start) m->zpage[PC] = job->start;
+    m->options &= ~OPT_IDLE; // no device will ever wake it
+    m->budget = job->budget;
+    m->headless = 1;
+
+    job->cycles = run(m, &running);
+
+    int cycle = (m->zpage[FLAG] & 0x1E0) >> 5;
+    if (cycle == 0xF) job->status = JOB_HALT;
+    else if (m->budget && job->cycles >= m->budget) job->status = JOB_BUDGET;
+    else if (cycle == 4) job->status = JOB_WAIT;
+    else job->status = JOB_BUDGET;
+
+    memcpy(job->regs, m->zpage, sizeof(job->regs));
+    job->flag = m->zpage[FLAG];
+
+    struct mem_stats stats;
+    mem_stats(m, &stats);
+    job->resident = stats.resident;
+
+    if (show_perf) {
+        FILE *f = open_memstream(&job->perf, &job->perf_len);
+
+        if (f != NULL) {
+            perf_dump(m, f, job->image);
+            fclose(f);
+        }
+    }
+
+    job->output = m->console.capture;
+    job->output_len = m->console.capture_len;
+    m->console.capture = NULL;
+
+    free_machine(m);
+
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    job->wall_ns = (after.tv_sec - before.tv_sec) * 1000000000LL
+        + (after.tv_nsec - before.tv_nsec);
+}
+
+/*
+ * Take a job from the bottom of our own deque, or failing that from the top of
+ * someone else's. Jobs are never added once the pool is running, so once every
+ * deque is empty we're done.
+ *
+ * return struct job *: the job, NULL if there are none left
+ */
+
+struct job *next_job(struct pool *pool, int id) {
+    for (int x = 0; x < pool->threads; x++) {
+        struct deque *d = &pool->deques[(id + x) % pool->threads];
+        struct job *job = NULL;
+
+        pthread_mutex_lock(&d->lock);
+
+        if (d->top != d->bottom) {
+            if (x == 0) job = &pool->jobs[d->jobs[--d->bottom]];
+            else job = &pool->jobs[d->jobs[d->top++]];
+        }
+
+        pthread_mutex_unlock(&d->lock);
+
+        if (job != NULL) return job;
+    }
+
+    return NULL;
+}
+
+void *worker(void *vargp) {
+    struct worker *w = (struct worker *) vargp;
+    struct job *job;
+
+    while ((job = next_job(w->pool, w->id)) != NULL)
+        run_job(job, w->pool->show_perf);
+
+    return NULL;
+}
+
+/*
+ * Read a job list. Returns the number of jobs, or -1 with errno set.
+ */
+
+ssize_t read_list(const char *list, unsigned int budget, struct job **jobs) {
+    FILE *f = fopen(list, "r");
+    if (f == NULL) return -1;
+
+    size_t count = 0;
+    size_t size = 16;
+    char *line = NULL;
+    size_t len = 0;
+
+    *jobs = malloc(size * sizeof(struct job));
+
+    while (*jobs != NULL && getline(&line, &len, f) != -1) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        char image[4096];
+        unsigned int start = 0, switches = 0, job_budget = budget;
+        int valid = sscanf(line, " %4095s %x %x %u",
+            image, &start, &switches, &job_budget);
+
+        if (valid < 1) continue;
+
+        if (count == size) {
+            struct job *grown = realloc(*jobs, size * 2 * sizeof(struct job));
+            if (grown == NULL) {
+                free(*jobs);
+                *jobs = NULL;
+                break;
+            }
+
+            *jobs = grown;
+            size *= 2;
+        }
+
+        struct job *job = &(*jobs)[count++];
+        memset(job, 0, sizeof(struct job));
+        job->image = strdup(image);
+        job->start = start & 0xFFFF;
+        job->set_start = valid >= 2;
+        job->switches = switches;
+        job->set_switches = valid >= 3;
+        job->budget = job_budget;
+    }
+
+    free(line);
+    fclose(f);
+
+    if (*jobs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return count;
+}
+
+/*
+ * Load each distinct image in the list once, as the template for every job
+ * that uses it. An image that fails to load isn't tried again, and every job
+ * using it fails.
+ */
+
+void load_templates(struct job *jobs, ssize_t count) {
+    for (ssize_t x = 0; x < count; x++) {
+        ssize_t y;
+
+        for (y = 0; y < x; y++)
+            if (jobs[y].owner && !strcmp(jobs[x].image, jobs[y].image)) break;
+
+        if (y < x) jobs[x].template = jobs[y].template;
+        else {
+            jobs[x].template = load_template(jobs[x].image);
+            jobs[x].owner = 1;
+        }
+    }
+}
+
+/*
+ * Run every job on a pool of the given number of threads, at most one per job
+ *
+ * return long long: wall time in ns
+ */
+
+long long run_pool(struct job *jobs, ssize_t count, int threads,
+    int show_perf) {
+
+    if (threads < 1) threads = 1;
+    if (threads > count && count > 0) threads = count;
+
+    struct pool pool;
+    pool.jobs = jobs;
+    pool.threads = threads;
+    pool.show_perf = show_perf;
+    pool.deques = calloc(threads, sizeof(struct deque));
+
+    for (int x = 0; x < threads; x++) {
+        pthread_mutex_init(&pool.deques[x].lock, NULL);
+        pool.deques[x].jobs = malloc((count / threads + 1) * sizeof(size_t));
+    }
+
+    for (ssize_t x = count - 1; x >= 0; x--) { // so job 0 runs first
+        struct deque *d = &pool.deques[x % threads];
+        d->jobs[d->bottom++] = x;
+    }
+
+    struct timespec before, after;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    struct worker *workers = malloc(threads * sizeof(struct worker));
+
+    for (int x = 0; x < threads; x++) {
+        workers[x].pool = &pool;
+        workers[x].id = x;
+        pthread_create(&tids[x], NULL, worker, (void *) &workers[x]);
+    }
+
+    for (int x = 0; x < threads; x++) pthread_join(tids[x], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &after);
+
+    for (int x = 0; x < threads; x++) {
+        pthread_mutex_destroy(&pool.deques[x].lock);
+        free(pool.deques[x].jobs);
+    }
+
+    free(pool.deques);
+    free(workers);
+    free(tids);
+
+    return (after.tv_sec - before.tv_sec) * 1000000000LL
+        + (after.tv_nsec - before.tv_nsec);
+}
+
+/*
+ * Run every job in the list on the given number of threads, then print a
+ * summary table and, if show_output is set, each job's console output, and if
+ * show_perf is set, each job's performance counters as "image counter value"
+ * lines (see perf_dump). budget is the default cycle limit per job, 0 for
+ * none.
+ *
+ * return int: 0 if every job could be run, nonzero otherwise
+ */
+
+int batch(const char *list, int threads, unsigned int budget,
+    int show_output, int show_perf) {
+
+    static const char *status_names[] = {"HLT", "BUDGET", "WAIT", "ERROR"};
+
+    struct job *jobs;
+    ssize_t count = read_list(list, budget, &jobs);
+
+    if (count < 0) {
+        perror(list);
+        return 1;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > count && count > 0) threads = count;
+
+    load_templates(jobs, count);
+    long long wall_ns = run_pool(jobs, count, threads, show_perf);
+
+    int failed = 0;
+    unsigned long long total_cycles = 0;
+    size_t total_resident = 0;
+
+    printf("%-24s %-6s %12s %10s "
+        "%-4s %-4s %-4s %-4s %-4s %-4s %-4s %-4s %s\n",
+        "JOB", "STATUS", "CYCLES", "WALL MS",
+        "PC", "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7");
+
+    for (ssize_t x = 0; x < count; x++) {
+        struct job *job = &jobs[x];
+
+        if (job->status == JOB_ERROR) failed = 1;
+        total_cycles += job->cycles;
+        total_resident += job->resident;
+
+        printf("%-24s %-6s %12u %10.3f "
+            "%04hX %04hX %04hX %04hX %04hX %04hX %04hX %04hX %04hX\n",
+            job->image, status_names[job->status], job->cycles,
+            job->wall_ns / 1e6, job->regs[PC],
+            job->regs[0], job->regs[1], job->regs[2], job->regs[3],
+            job->regs[4], job->regs[5], job->regs[6], job->regs[7]);
+    }
+
+    printf("%zd jobs, %d threads, %llu cycles in %.3f s, "
+        "%zu pages resident\n",
+        count, threads, total_cycles, wall_ns / 1e9, total_resident);
+
+    for (ssize_t x = 0; x < count; x++) {
+        struct job *job = &jobs[x];
+
+        if (show_output && job->output_len) {
+            printf("\n%s:\n", job->image);
+            fwrite(job->output, 1, job->output_len, stdout);
+            printf("\n");
+        }
+
+        if (job->owner && job->template != NULL) free_machine(job->template);
+        free(job->output);
+    }
+
+    if (show_perf) printf("\n");
+
+    for (ssize_t x = 0; x < count; x++) {
+        struct job *job = &jobs[x];
+
+        if (show_perf) fwrite(job->perf, 1, job->perf_len, stdout);
+
+        free(job->perf);
+        free(job->image);
+    }
+
+    free(jobs);
+
+    return failed;
+}
+
+/*
+ * Scaling sweep: run every job in the list on 1, 2, 4 and so on up to the
+ * given number of threads, and print a line per pass with its wall time,
+ * jobs and millions of cycles per second, and its speedup and efficiency
+ * (speedup per thread) over one thread. Every pass must leave each job with
+ * the same status, cycles and registers as the first, or it is marked
+ * MISMATCH. The list is run once untimed first, so that the first pass doesn't
+ * pay for warming up. The jobs should be many more than the threads, and long
+ * enough for the run to outweigh forking them.
+ *
+ * return int: 0 if every job could be run and every pass matched, nonzero
+ * otherwise
+ */
+
+int sweep(const char *list, int threads, unsigned int budget) {
+    struct job *jobs;
+    ssize_t count = read_list(list, budget, &jobs);
+
+    if (count < 0) {
+        perror(list);
+        return 1;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > count && count > 0) threads = count;
+
+    struct job *first = malloc(count * sizeof(struct job));
+    if (first == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    load_templates(jobs, count);
+    run_pool(jobs, count, threads, 0);
+
+    for (ssize_t x = 0; x < count; x++) {
+        free(jobs[x].output);
+        jobs[x].output = NULL;
+    }
+
+    printf("%7s %10s %10s %10s %8s %6s %s\n", "THREADS", "WALL MS", "JOBS/S",
+        "MCYC/S", "SPEEDUP", "EFF", "CHECK");
+
+    int failed = 0;
+    double base_ns = 0;
+
+    for (int t = 1; ; t = t * 2 < threads ? t * 2 : threads) {
+        long long wall_ns = run_pool(jobs, count, t, 0);
+        double wall = wall_ns > 0 ? wall_ns : 1;
+        unsigned long long total_cycles = 0;
+        int mismatch = 0;
+
+        if (t == 1) {
+            memcpy(first, jobs, count * sizeof(struct job));
+            base_ns = wall;
+        }
+
+        for (ssize_t x = 0; x < count; x++) {
+            struct job *job = &jobs[x];
+
+            if (job->status == JOB_ERROR) failed = 1;
+            if (job->status != first[x].status
+                || job->cycles != first[x].cycles
+                || memcmp(job->regs, first[x].regs, sizeof(job->regs)))
+                mismatch = 1;
+
+            total_cycles += job->cycles;
+            free(job->output);
+            job->output = NULL;
+        }
+
+        if (mismatch) failed = 1;
+
+        printf("%7d %10.3f %10.1f %10.2f %7.2fx %5.0f%% %s\n",
+            t, wall / 1e6, count * 1e9 / wall, total_cycles * 1e3 / wall,
+            base_ns / wall, base_ns / wall / t * 100,
+            mismatch ? "MISMATCH" : "ok");
+
+        if (t == threads) break;
+    }
+
+    printf("%zd jobs\n", count);
+
+    for (ssize_t x = 0; x < count; x++) {
+        struct job *job = &jobs[x];
+
+        if (job->owner && job->template != NULL) free_machine(job->template);
+        free(job->image);
+    }
+
+    free(first);
+    free(jobs);
+
+    return failed;
+}
@@ -0,0 +1,11 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "bus.h"
+
+extern int load_script(machine *m, const char *path, data_width_t *switches);
+extern int batch(const char *list, int threads, unsigned int budget,
+    int show_output, int show_perf);
+extern int sweep(const char *list, int threads, unsigned int budget);
+
+#endif
@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "console.h"
+#include "disk.h"
+#include "bench.h"
+#include "machine.h"
+
+/*
+ * Benchmark suite
+ *
+ * A fixed set of guest kernels, each run headless on a fresh machine. Every
+ * kernel is first single-stepped once to count the instructions it retires
+ * and record its final registers, then run with run() the given number of
+ * times. Each timed run must halt with the same registers, so the suite also
+ * checks that the fast paths agree with step(). Rates are from the best run,
+ * which is the most repeatable; the median is shown alongside.
+ *
+ * The timed runs are repeated with OPT_BLOCKS flipped, and the table gives
+ * how many times faster the runs with threaded-code blocks (see xlat.c) are
+ * than those without, whichever way the options have it.
+ *
+ * The single-stepped run is made on two machines in lockstep, one with the
+ * predecoded store and one decoding every instruction afresh, whose registers,
+ * FLAG, MAR and MBR must agree after every micro-cycle. Their disks are
+ * scheduled (see disk.c), so that both see the same timing; headless TTYs
+ * complete at once anyway. Every machine's timer is scheduled, so the timed
+ * runs of kernels that don't use the disk must also take exactly as many
+ * micro-cycles as the single-stepped run: the irq kernel, interrupted by the
+ * timer in the middle of a run of register operations, checks that run() and
+ * its blocks deliver events and interrupts on the same cycles as stepping.
+ *
+ * The kernels are assembled from the as17 source in the comment above each;
+ * all load and start at 0100. The disk kernels run against a scratch disk of
+ * BENCH_DISK_SECTORS, made once for the whole suite, and the table also gives
+ * their throughput. Their cycle counts vary from run to run, since they
+ * include the loops waiting for each transfer, and their instruction counts
+ * are those of the single-stepped run below, on the scheduled disk.
+ *
+ * The bus kernels are host code rather than guest code, see bench_bus.
+ */
+
+#define BENCH_BASE 0x100
+#define BENCH_MAX_STEPS 100000000 // give up on a kernel that doesn't halt
+#define BENCH_DISK_SECTORS 8192 // 4 MB
+#define BENCH_BUS_PAGE 0x20 // in field 0
+#define BENCH_BUS_OPS (1 << 24) // reads and writes, half each
+
+struct kernel {
+    const char *name;
+    const data_width_t *words;
+    size_t len;
+    unsigned long long bytes; // moved to or from the disk, 0 if not used
+    int unit; // bus kernels: through unit handlers rather than direct RAM
+};
+
+/*
+ * START,  TAD A5, XFFF0       / 16 passes
+ * OUTER,  TAD A0, X1000
+ *         DCA A0, I0
+ *         TAD A0, X2000
+ *         DCA A0, I1
+ *         TAD A4, XF000       / of 4 KW
+ * COPY,   TAD A0, *I0
+ *         DCA A0, *I1
+ *         ISZ A4
+ *         JMP COPY
+ *         ISZ A5
+ *         JMP OUTER
+ *         HLT
+ */
+
+static const data_width_t copy_words[] = {
+    0x370F, 0xFFF0, 0x230F, 0x1000, 0x6108, 0x230F, 0x2000, 0x6109,
+    0x330F, 0xF000, 0x2308, 0x6309, 0x4104, 0xA00A, 0x4105, 0xA002,
+    0xE102
+};
+
+/*
+ * START,  TAD A2, XFFF0       / 16 passes
+ * LOOP,   ISZ A1              / of 64 K
+ *         JMP LOOP
+ *         ISZ A2
+ *         JMP LOOP
+ *         HLT
+ */
+
+static const data_width_t isz_words[] = {
+    0x2B0F, 0xFFF0, 0x4101, 0xA002, 0x4102, 0xA002, 0xE102
+};
+
+/*
+ * START,  TAD A7, XC000       / 16 K passes
+ *         TAD A1, X1234
+ *         TAD A4, X0003
+ * LOOP,   SLI A1, 3
+ *         XOR A2, A1
+ *         SHR A2, A4
+ *         IOR A3, A2
+ *         ASI A3, 1
+ *         SWP A1, A2
+ *         SHL A1, A4
+ *         ISZ A7
+ *         JMP LOOP
+ *         HLT
+ */
+
+static const data_width_t regop_words[] = {
+    0x3F0F, 0xC000, 0x270F, 0x1234, 0x330F, 0x0003, 0xE752, 0xEB31,
+    0xEB64, 0xEF22, 0xEF90, 0xE712, 0xE744, 0x4107, 0xA006, 0xE102
+};
+
+/*
+ * START,  TAD A7, XC000       / 16 K passes
+ * LOOP,   CLA CLL CMA IAC A1
+ *         RAL A1
+ *         RTR A1
+ *         BSW A1
+ *         CML CMA A2
+ *         HSW A2
+ *         SZA A3
+ *         HLT
+ *         SMA A4
+ *         SNL SZA A5
+ *         NOP
+ *         ISZ A7
+ *         JMP LOOP
+ *         HLT
+ */
+
+static const data_width_t opr_words[] = {
+    0x3F0F, 0xC000, 0xE4E1, 0xE404, 0xE40A, 0xE402, 0xE830, 0xE80E,
+    0xED20, 0xE102, 0xF140, 0xF530, 0xE000, 0x4107, 0xA002, 0xE102
+};
+
+/*
+ * START,  TAD A7, XC000       / 16 K characters
+ * LOOP,   CLA A0
+ *         TAD A0, X0041
+ *         JMS A6 PUTCHR
+ *         ISZ A7
+ *         JMP LOOP
+ *         HLT
+ * PUTCHR, TPC A0              / as PRINT in example.s17
+ *         TSF
+ *         JMP .-1
+ *         RET
+ */
+
+static const data_width_t tty_words[] = {
+    0x3F0F, 0xC000, 0xE080, 0x230F, 0x0041, 0x9809, 0x4107, 0xA002,
+    0xE102, 0xC024, 0xC021, 0xA00A, 0xA306
+};
+
+/*
+ * START,  TAD A7, XFE00       / 512 transfers of 4 KW
+ *         TAD A1 CMDP
+ * LOOP,   DRD A1
+ *         DSF
+ *         JMP .-1
+ *         DRS A0
+ *         IOR A6, A0          / collect the status
+ *         DCL
+ *         CLA A0
+ *         TAD A0, X0010
+ *         TAD A0 SECT
+ *         DCA A0 SECT
+ *         ISZ A7
+ *         JMP LOOP
+ *         HLT
+ * CMDP,   #CMD
+ * CMD,    #0001               / into field 1
+ *         #0000
+ *         #1000
+ * SECT,   #0000
+ */
+
+static const data_width_t diskseq_words[] = {
+    0x3F0F, 0xFE00, 0x2411, 0xC444, 0xC041, 0xA004, 0xC043, 0xFB20,
+    0xC042, 0xE080, 0x230F, 0x0010, 0x2015, 0x6015, 0x4107, 0xA003,
+    0xE102, 0x0112, 0x0001, 0x0000, 0x1000, 0x0000
+};
+
+/*
+ * START,  TAD A7, XF000       / 4 K transfers of one sector
+ *         TAD A1 CMDP
+ * LOOP,   DRD A1
+ *         DSF
+ *         JMP .-1
+ *         DRS A0
+ *         IOR A6, A0
+ *         DCL
+ *         CLA A0              / next sector, 5 s + 7 mod 8 K
+ *         TAD A0 SECT
+ *         CLA A2
+ *         TAD A2 SECT
+ *         SLI A2, 2
+ *         TAD A0, A2
+ *         TAD A0, X0007
+ *         AND A0, X1FFF
+ *         DCA A0 SECT
+ *         ISZ A7
+ *         JMP LOOP
+ *         HLT
+ * CMDP,   #CMD
+ * CMD,    #0001
+ *         #0000
+ *         #0100
+ * SECT,   #0000
+ */
+
+static const data_width_t diskrnd_words[] = {
+    0x3F0F, 0xF000, 0x2417, 0xC444, 0xC041, 0xA004, 0xC043, 0xFB20,
+    0xC042, 0xE080, 0x201B, 0xE880, 0x281B, 0xEB51, 0x2102, 0x230F,
+    0x0007, 0x030F, 0x1FFF, 0x601B, 0x4107, 0xA003, 0xE102, 0x0118,
+    0x0001, 0x0000, 0x0100, 0x0000
+};
+
+/*
+ * START,  TAD A7, XF000       / 4 K interrupts
+ *         TAD A5 ISRP
+ *         CLA A0
+ *         TAD A0, XA305       / JMP I Z A5 at the vector
+ *         DCA A0 22
+ *         TAD A0, X0020       / timer only
+ *         SMK A0
+ *         CLA A0
+ *         TAD A0, X0001       / periodic, tick of 1
+ *         CMO A0
+ *         CLA A0
+ *         TAD A0, X0061       / 97 ticks
+ *         CST A0
+ *         ION
+ * LOOP,   IAC A1              / counts the turns between interrupts
+ *         RAL A2
+ *         SHL A3, A1
+ *         XOR A4, A3
+ *         IAC A1
+ *         SWP A2, A4
+ *         JMP LOOP
+ * ISR,    CLA A0
+ *         TAD A0, X0020
+ *         ACK A0
+ *         CCF
+ *         ISZ A7
+ *         RTI
+ *         CSP
+ *         HLT
+ * ISRP,   #ISR
+ */
+
+static const data_width_t irq_words[] = {
+    0x3F0F, 0xF000, 0x3423, 0xE080, 0x230F, 0xA305, 0x6122, 0x230F,
+    0x0020, 0xC007, 0xE080, 0x230F, 0x0001, 0xC053, 0xE080, 0x230F,
+    0x0061, 0xC054, 0xC001, 0xE401, 0xE804, 0xEF41, 0xF333, 0xE401,
+    0xEB14, 0xA013, 0xE080, 0x230F, 0x0020, 0xC006, 0xC052, 0x4107,
+    0xC005, 0xC055, 0xE102, 0x011A
+};
+
+#define KERNEL(name) {#name, name##_words, \
+    sizeof(name##_words) / sizeof(data_width_t), 0, 0}
+#define DISK_KERNEL(name, bytes) {#name, name##_words, \
+    sizeof(name##_words) / sizeof(data_width_t), bytes, 0}
+#define BUS_KERNEL(name, unit) {#name, NULL, 0, 0, unit}
+
+static const struct kernel kernels[] = {
+    KERNEL(copy), // auto-index memory copy
+    KERNEL(isz), // ISZ loop
+    KERNEL(regop), // register operation shifts
+    KERNEL(opr), // OPR microcode chains
+    KERNEL(tty), // console output
+    KERNEL(irq), // timer interrupts
+    DISK_KERNEL(diskseq, 512 * 4096 * 2), // sequential disk reads
+    DISK_KERNEL(diskrnd, 4096 * 256 * 2), // random one-sector disk reads
+    BUS_KERNEL(busram, 0), // bus reads and writes to direct RAM
+    BUS_KERNEL(busunit, 1), // and to a page of unit handlers
+};
+
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/*
+ * Fresh headless machine with a kernel loaded, and the scratch disk attached
+ * if it uses one
+ */
+
+machine *bench_machine(const struct kernel *k, data_width_t options,
+    const char *disk) {
+
+    machine *m = new_machine(-1, -1);
+    if (m == NULL) return NULL;
+
+    int result = console_capture(m);
+    if (!result && k->bytes) result = disk_attach(m, disk);
+
+    if (!result) result = bus_write_block(m, BENCH_BASE, k->words, k->len);
+
+    if (result) {
+        free_machine(m);
+        return NULL;
+    }
+
+    m->zpage[PC] = BENCH_BASE;
+    m->options = options;
+    m->headless = 1;
+    m->timer.scheduled = 1;
+
+    return m;
+}
+
+int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time runs of a kernel with run(), sorted into wall_ns, and the micro-cycles
+ * of the last in *cycles. Returns ENOMEM if a machine couldn't be made, EINVAL
+ * if a run didn't halt with the registers in regs or, for a kernel that
+ * doesn't use the disk, after steps micro-cycles, 0 otherwise.
+ */
+
+int bench_runs(const struct kernel *k, int runs, data_width_t options,
+    const char *disk, const data_width_t *regs, unsigned long long steps,
+    long long *wall_ns, unsigned int *cycles) {
+
+    int mismatch = 0;
+
+    for (int r = 0; r < runs; r++) {
+        machine *m = bench_machine(k, options, disk);
+        if (m == NULL) return ENOMEM;
+
+        volatile int running = 1;
+        struct timespec before, after;
+
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        *cycles = run(m, &running);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+
+        wall_ns[r] = (after.tv_sec - before.tv_sec) * 1000000000LL
+            + (after.tv_nsec - before.tv_nsec);
+
+        if (memcmp(regs, m->zpage, (FLAG + 1) * sizeof(data_width_t))
+            || (!k->bytes && *cycles != steps))
+            mismatch = EINVAL;
+
+        free_machine(m);
+    }
+
+    qsort(wall_ns, runs, sizeof(long long), compare_ns);
+
+    return mismatch;
+}
+
+/*
+ * Bus microbenchmark
+ *
+ * BENCH_BUS_OPS calls to bus_write and bus_read, alternately, over one page of
+ * a fresh machine, installed either as direct RAM (see bus.h) or with unit
+ * handlers that do nothing but index an array, as RAM pages were served
+ * before there was direct RAM. Both go through find_page, the counters and
+ * the write snoop as the CPU's accesses do. The table counts each call as an
+ * instruction, and gives the words moved as MB per second.
+ */
+
+static data_width_t bench_bus_words[PAGE_SIZE];
+
+int bench_bus_read(machine *m, addr_width_t src, data_width_t *dst) {
+    *dst = bench_bus_words[src & (PAGE_SIZE - 1)];
+    return 0;
+}
+
+int bench_bus_write(machine *m, addr_width_t dst, data_width_t src) {
+    bench_bus_words[dst & (PAGE_SIZE - 1)] = src;
+    return 0;
+}
+
+/*
+ * Time one pass, and the sum of the words read in *sum
+ */
+
+long long bench_bus_pass(const struct kernel *k, data_width_t *ram,
+    unsigned long long *sum) {
+
+    machine *m = new_machine(-1, -1);
+    if (m == NULL) return -1;
+
+    memset(ram, 0, PAGE_SIZE * sizeof(data_width_t));
+    memset(bench_bus_words, 0, sizeof(bench_bus_words));
+
+    int result = k->unit
+        ? install_unit(m, BENCH_BUS_PAGE, bench_bus_read, bench_bus_write)
+        : install_ram(m, BENCH_BUS_PAGE, ram);
+
+    if (result) {
+        free_machine(m);
+        return -1;
+    }
+
+    addr_width_t base = BENCH_BUS_PAGE * PAGE_SIZE;
+    struct timespec before, after;
+    data_width_t word;
+
+    *sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+
+    for (unsigned int x = 0; x < BENCH_BUS_OPS / 2; x++) {
+        bus_write(m, base + (x & (PAGE_SIZE - 1)), x);
+        bus_read(m, base + (x * 7 & (PAGE_SIZE - 1)), &word);
+        *sum += word;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    free_machine(m);
+
+    return (after.tv_sec - before.tv_sec) * 1000000000LL
+        + (after.tv_nsec - before.tv_nsec);
+}
+
+/*
+ * Run a bus kernel and print its line of the table, checking the words read
+ * against the same loop over a host array
+ */
+
+int bench_bus(const struct kernel *k, int runs) {
+    data_width_t *ram = malloc(PAGE_SIZE * sizeof(data_width_t));
+    long long *wall_ns = malloc(runs * sizeof(long long));
+    data_width_t ref[PAGE_SIZE] = {0};
+    unsigned long long expect = 0;
+    int mismatch = 0;
+
+    if (ram == NULL || wall_ns == NULL) {
+        free(ram);
+        free(wall_ns);
+        return ENOMEM;
+    }
+
+    for (unsigned int x = 0; x < BENCH_BUS_OPS / 2; x++) {
+        ref[x & (PAGE_SIZE - 1)] = x;
+        expect += ref[x * 7 & (PAGE_SIZE - 1)];
+    }
+
+    for (int r = 0; r < runs; r++) {
+        unsigned long long sum;
+
+        if ((wall_ns[r] = bench_bus_pass(k, ram, &sum)) < 0) {
+            free(ram);
+            free(wall_ns);
+            return ENOMEM;
+        }
+
+        if (sum != expect) mismatch = EINVAL;
+    }
+
+    qsort(wall_ns, runs, sizeof(long long), compare_ns);
+
+    double best = wall_ns[0] > 0 ? wall_ns[0] : 1;
+
+    printf("%-8s %10u %10s %9.3f %9.3f %8s %8.2f %7.2f %7.1f %7s %s\n",
+        k->name, BENCH_BUS_OPS, "-", best / 1e6, wall_ns[runs / 2] / 1e6, "-",
+        BENCH_BUS_OPS * 1e3 / best, best / BENCH_BUS_OPS,
+        BENCH_BUS_OPS * sizeof(data_width_t) * 1e3 / best, "-",
+        mismatch ? "MISMATCH" : "ok");
+
+    free(ram);
+    free(wall_ns);
+
+    return mismatch;
+}
+
+/*
+ * Run one kernel and print its line of the table. Returns nonzero if it
+ * couldn't be run or a timed run didn't match the reference.
+ */
+
+int bench_kernel(const struct kernel *k, int runs, data_width_t options,
+    const char *disk) {
+
+    if (k->words == NULL) return bench_bus(k, runs);
+
+    machine *m = bench_machine(k, options | OPT_PREDECODE, disk);
+    machine *ref = bench_machine(k, options & ~OPT_PREDECODE, disk);
+
+    if (m == NULL || ref == NULL) {
+        if (m != NULL) free_machine(m);
+        if (ref != NULL) free_machine(ref);
+        return ENOMEM;
+    }
+
+    m->disk.scheduled = 1;
+    ref->disk.scheduled = 1;
+
+    unsigned long long insns = 0;
+    unsigned long long steps = 0;
+    int diverged = 0;
+
+    arm_events(m);
+    arm_events(ref);
+
+    while ((m->zpage[FLAG] & 0x1E0) >> 5 != 0xF && steps < BENCH_MAX_STEPS) {
+        if ((m->zpage[FLAG] & 0x1E0) >> 5 <= 1) insns++;
+        step_timed(m);
+        step_timed(ref);
+        steps++;
+
+        if (memcmp(m->zpage, ref->zpage, sizeof(m->zpage))
+            || m->mar != ref->mar || m->mbr != ref->mbr) {
+            diverged = 1;
+            break;
+        }
+    }
+
+    data_width_t regs[FLAG + 1];
+    memcpy(regs, m->zpage, sizeof(regs));
+    int halted = (m->zpage[FLAG] & 0x1E0) >> 5 == 0xF;
+
+    free_machine(m);
+    free_machine(ref);
+
+    if (diverged) {
+        printf("%-8s predecoded and uncached diverge at micro-cycle %llu\n",
+            k->name, steps);
+        return EINVAL;
+    }
+
+    if (!halted) {
+        printf("%-8s does not halt\n", k->name);
+        return EINVAL;
+    }
+
+    long long *wall_ns = malloc(2 * runs * sizeof(long long));
+    if (wall_ns == NULL) return ENOMEM;
+
+    long long *flipped_ns = wall_ns + runs; // OPT_BLOCKS the other way
+    unsigned int cycles = 0;
+    unsigned int flipped_cycles = 0;
+
+    int result = bench_runs(k, runs, options, disk, regs, steps, wall_ns,
+        &cycles);
+    int flip = bench_runs(k, runs, options ^ OPT_BLOCKS, disk, regs, steps,
+        flipped_ns, &flipped_cycles);
+
+    if (result == ENOMEM || flip == ENOMEM) {
+        free(wall_ns);
+        return ENOMEM;
+    }
+
+    int mismatch = result || flip;
+
+    double best = wall_ns[0] > 0 ? wall_ns[0] : 1;
+    double flipped = flipped_ns[0] > 0 ? flipped_ns[0] : 1;
+    double speedup = options & OPT_BLOCKS ? flipped / best : best / flipped;
+
+    char rate[16] = "-";
+    if (k->bytes) snprintf(rate, sizeof(rate), "%.1f", k->bytes * 1e3 / best);
+
+    printf("%-8s %10llu %10u %9.3f %9.3f %8.2f %8.2f %7.2f %7s %6.2fx %s\n",
+        k->name, insns, cycles, best / 1e6, wall_ns[runs / 2] / 1e6,
+        cycles * 1e3 / best, insns * 1e3 / best, best / insns, rate,
+        speedup, mismatch ? "MISMATCH" : "ok");
+
+    free(wall_ns);
+
+    return mismatch;
+}
+
+/*
+ * Make the scratch disk, filled with a pattern so that reads are of real data
+ *
+ * return int: 0 on success, errno value if it can't be written
+ */
+
+int bench_disk(char *path) {
+    int fd = mkstemp(path);
+    if (fd < 0) return errno;
+
+    data_width_t sector[DISK_SECTOR];
+    int result = 0;
+
+    for (size_t s = 0; !result && s < BENCH_DISK_SECTORS; s++) {
+        for (size_t x = 0; x < DISK_SECTOR; x++) sector[x] = s + x;
+        if (write(fd, sector, sizeof(sector)) != sizeof(sector)) result = EIO;
+    }
+
+    close(fd);
+
+    return result;
+}
+
+/*
+ * Run every kernel, or only the one named, runs times each with the given
+ * emulator options (see cpu.h; OPT_FASTRUN makes no difference, as the timed
+ * runs always use run()) and print a table of instructions, micro-cycles,
+ * best and median wall time, millions of micro-cycles and instructions per
+ * second, host ns per instruction, disk MB per second and the speedup from
+ * OPT_BLOCKS.
+ *
+ * return int: 0 if every kernel ran and matched, nonzero otherwise
+ */
+
+int bench(const char *only, int runs, data_width_t options) {
+    int failed = 0;
+    int found = only == NULL;
+
+    for (size_t x = 0; !found && x < N_KERNELS; x++)
+        found = !strcmp(only, kernels[x].name);
+
+    if (!found) {
+        fprintf(stderr, "%s: no such kernel\n", only);
+        return 1;
+    }
+
+    if (runs < 1) runs = 1;
+
+    char disk[] = "/tmp/pdp17-disk-XXXXXX";
+    int result = bench_disk(disk);
+
+    if (result) {
+        fprintf(stderr, "%s: %s\n", disk, strerror(result));
+        unlink(disk);
+        return 1;
+    }
+
+    printf("%-8s %10s %10s %9s %9s %8s %8s %7s %7s %7s %s\n",
+        "KERNEL", "INSNS", "CYCLES", "BEST MS", "MED MS",
+        "MCYC/S", "MINSN/S", "NS/INSN", "MB/S", "BLOCKS", "CHECK");
+
+    for (size_t x = 0; x < N_KERNELS; x++) {
+        if (only != NULL && strcmp(only, kernels[x].name)) continue;
+        if (bench_kernel(&kernels[x], runs, options, disk)) failed = 1;
+    }
+
+    unlink(disk);
+
+    printf("%d runs, options %X\n", runs, options);
+
+    return failed;
+}
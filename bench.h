@@ -0,0 +1,8 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "bus.h"
+
+extern int bench(const char *only, int runs, data_width_t options);
+
+#endif
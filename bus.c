@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
 
 #include "bus.h"
+#include "perf.h"
+#include "machine.h"
 
 /*
  * Width of page offset, to be calculated at init time
@@ -13,83 +16,214 @@ data_width_t offset_width = 0;
 addr_width_t offset_mask = 0;
 
 /*
- * Per-unit read functions. Populate at startup
- *
- * addr_width_t src: address to read
- * data_width_t *dst: where to store fetched memory line
- * return int: 0 on success, nonzero on error (see errno.h for possible values)
+ * Initialize bus arrays, very important so we can reliably say what addresses
+ * are valid; also determine page size for selection.
  */
 
-int (*read[MAX_PAGES])(addr_width_t src, data_width_t *dst);
+int init_bus(machine *m) {
+	struct bus *bus = &m->bus;
+	
+	for (size_t x = 0; x < MAX_FIELDS; x++) bus->field[x] = NULL;
+	for (size_t x = 0; x < MAX_UNITS; x++) bus->attn[x] = NULL;
+	
+	bus->unshare = NULL;
+	bus->lazy_pages = 0;
+	bus->alloc = NULL;
+	bus->snoop = NULL;
+	bus->snoop_range = NULL;
+	
+	int sz = PAGE_SIZE;
+	data_width_t width = 0;
+	while (sz > 1) {
+		sz >>= 1;
+		width++;
+	}
+	
+	offset_width = width; // same for every machine
+	offset_mask = ((1 << width) - 1);
+	
+	if (sz == 1) return 0;
+	else return ENOTRECOVERABLE;
+}
+
+void free_bus(machine *m) {
+	for (size_t x = 0; x < MAX_FIELDS; x++) {
+		free(m->bus.field[x]);
+		m->bus.field[x] = NULL;
+	}
+}
 
 /*
- * Per-unit write functions. Populate at startup
- *
- * addr_width_t dst: address to write
- * data_width_t src: contents to write to memory line
- * return int: 0 on success, nonzero on error (see errno.h for possible values)
+ * Page table entry for a page, allocating its field's table if need be.
+ * Returns EINVAL if page number is too high, ENOMEM if out of memory, 0
+ * otherwise.
  */
 
-int (*write[MAX_PAGES])(addr_width_t dst, data_width_t src);
+int make_page(machine *m, size_t pgn, struct bus_page **page) {
+	if (pgn >= MAX_PAGES) return EINVAL;
+	
+	struct bus_page **field = &m->bus.field[pgn / FIELD_PAGES];
+	
+	if (*field == NULL) {
+		*field = calloc(FIELD_PAGES, sizeof(struct bus_page));
+		if (*field == NULL) return ENOMEM;
+	}
+	
+	*page = &(*field)[pgn % FIELD_PAGES];
+	
+	return 0;
+}
 
 /*
- * I/O control functions, commands defined per device. Calls may block.
- *
- * *data_width_t cmd: command to be parsed and handled by device
- * return int: 0 on success, nonzero on error (see errno.h for possible values)
+ * Install unit handlers for a page, with no block handlers. Returns EINVAL if
+ * page number is too high, ENOMEM if out of memory, 0 otherwise.
  */
 
-int (*attn[MAX_PAGES])(size_t unit, data_width_t cmd);
+int install_unit(
+	machine *m,
+	size_t pgn,
+	int (*unit_read)(machine *, addr_width_t, data_width_t *),
+	int (*unit_write)(machine *, addr_width_t, data_width_t)
+) {
+	struct bus_page *page;
+	int result = make_page(m, pgn, &page);
+	if (result) return result;
+	
+	page->read = unit_read;
+	page->write = unit_write;
+	page->read_block = NULL;
+	page->write_block = NULL;
+	page->ram = NULL;
+	page->shared = 0;
+	
+	return 0;
+}
 
 /*
- * Initialize bus arrays, very important so we can reliably say what addresses
- * are valid; also determine page size for selection.
+ * Install unit block handlers for a page that already has unit handlers.
+ * Installing NULL removes them. Returns EINVAL if page number is too high or
+ * the page has no unit handlers, 0 otherwise.
  */
 
-int init_bus() {
-	for (size_t x = 0; x < MAX_PAGES; x++) {
-		read[x] = NULL;
-		write[x] = NULL;
-		attn[x] = NULL;
-	}
+int install_block(
+	machine *m,
+	size_t pgn,
+	int (*unit_read_block) (machine *, addr_width_t, data_width_t *, size_t),
+	int (*unit_write_block) (machine *, addr_width_t, const data_width_t *,
+		size_t)
+) {
+	struct bus_page *page = bus_page(&m->bus, pgn);
 	
-	int sz = PAGE_SIZE;
-	while (sz > 1) {
-		sz >>= 1;
-		offset_width++;
-	}
+	if (page == NULL || (page->read == NULL && page->write == NULL))
+		return EINVAL;
 	
-	offset_mask = ((1 << offset_width) - 1);
+	page->read_block = unit_read_block;
+	page->write_block = unit_write_block;
 	
-	if (sz == 1) return 0;
-	else return ENOTRECOVERABLE;
+	return 0;
 }
 
 /*
- * Install unit handlers for a page. Returns EINVAL if page number is too high,
- * 0 otherwise.
+ * Install a host array of PAGE_SIZE words as direct RAM for a page, replacing
+ * any unit handlers. Installing NULL removes it. Returns EINVAL if page number
+ * is too high, ENOMEM if out of memory, 0 otherwise.
  */
 
-int install_unit(
-	size_t pgn,
-	int (*unit_read)(addr_width_t, data_width_t *),
-	int (*unit_write)(addr_width_t, data_width_t)
-) {
-	if (pgn >= MAX_PAGES) return EINVAL;
+int install_ram(machine *m, size_t pgn, data_width_t *base) {
+	struct bus_page *page;
+	int result = make_page(m, pgn, &page);
+	if (result) return result;
+	
+	page->ram = base;
+	page->shared = 0;
+	
+	return 0;
+}
+
+/*
+ * Mark a direct RAM page as shared, so that it is unshared before it is next
+ * written. Returns EINVAL if page number is too high or the page isn't RAM or
+ * there is no unshare function, 0 otherwise.
+ */
+
+int share_ram(machine *m, size_t pgn) {
+	struct bus_page *page = bus_page(&m->bus, pgn);
+	
+	if (page == NULL || page->ram == NULL || m->bus.unshare == NULL)
+		return EINVAL;
 	
-	read[pgn] = unit_read;
-	write[pgn] = unit_write;
+	page->shared = 1;
 	
 	return 0;
 }
 
 extern int install_attn(
-	size_t pgn,
-	int (*unit_attn) (size_t, data_width_t)
+	machine *m,
+	size_t unit,
+	int (*unit_attn) (machine *, size_t, data_width_t)
 ) {
-	if (pgn >= MAX_PAGES) return EINVAL;
+	if (unit >= MAX_UNITS) return EINVAL;
+	
+	m->bus.attn[unit] = unit_attn;
+	
+	return 0;
+}
+
+/*
+ * Install the lazy RAM allocation function for pages below pages. Installing
+ * NULL removes it. Returns EINVAL if pages is too high, 0 otherwise.
+ */
+
+int install_lazy(
+	machine *m,
+	size_t pages,
+	int (*unit_alloc) (machine *, size_t)
+) {
+	if (pages > MAX_PAGES) return EINVAL;
+	
+	m->bus.lazy_pages = pages;
+	m->bus.alloc = unit_alloc;
+	
+	return 0;
+}
+
+/*
+ * Install the unshare function for shared RAM. Installing NULL removes it.
+ */
+
+int install_unshare(
+	machine *m,
+	int (*unit_unshare) (machine *, size_t)
+) {
+	m->bus.unshare = unit_unshare;
 	
-	attn[pgn] = unit_attn;
+	return 0;
+}
+
+/*
+ * Install the write snoop function. Only one may be installed; installing NULL
+ * removes it.
+ */
+
+int install_snoop(
+	machine *m,
+	void (*unit_snoop) (machine *, addr_width_t)
+) {
+	m->bus.snoop = unit_snoop;
+	
+	return 0;
+}
+
+/*
+ * Install the range snoop function. Only one may be installed; installing NULL
+ * removes it.
+ */
+
+int install_snoop_range(
+	machine *m,
+	void (*unit_snoop_range) (machine *, addr_width_t, size_t)
+) {
+	m->bus.snoop_range = unit_snoop_range;
 	
 	return 0;
 }
@@ -108,30 +242,213 @@ int addr_split(addr_width_t addr, size_t *pgn, size_t *offset) {
 }
 
 /*
- * Dispatch read, write and attn calls to appropriate bus units.
+ * Find the page an address is in, giving it lazy RAM if it has nothing
+ * installed. Returns EINVAL if there is nothing there, the alloc function's
+ * error if it fails, 0 otherwise.
  */
 
-int bus_read(addr_width_t src, data_width_t *dst) {
+int find_page(machine *m, addr_width_t addr, struct bus_page **page,
+	size_t *offset) {
+	
+	struct bus *bus = &m->bus;
 	size_t pgn = 0;
+	int result;
+	
+	if (addr_split(addr, &pgn, offset)) return EINVAL;
+	
+	*page = bus_page(bus, pgn);
+	
+	if (*page != NULL && ((*page)->ram != NULL || (*page)->read != NULL
+		|| (*page)->write != NULL))
+		return 0;
+	
+	if (pgn >= bus->lazy_pages || bus->alloc == NULL) return EINVAL;
+	if ((result = (*bus->alloc)(m, pgn))) return result;
+	
+	*page = bus_page(bus, pgn);
+	
+	return *page == NULL ? EINVAL : 0;
+}
+
+/*
+ * Host pointer to a word of direct RAM for a device to transfer to or from
+ * on its own, the rest of the page following it. Lazy RAM is given to the page
+ * first, and if the device is going to write to it, shared RAM is unshared.
+ * The device must call the snoop function itself for anything it writes.
+ * Returns NULL if the address is not in RAM or the page can't be made ready.
+ */
+
+data_width_t *dma_ptr(machine *m, addr_width_t addr, int write) {
+	struct bus_page *page;
 	size_t offset = 0;
 	
-	int invalid_addr = addr_split(src, &pgn, &offset);
+	if (find_page(m, addr, &page, &offset) || page->ram == NULL) return NULL;
+	
+	if (write && page->shared
+		&& (*m->bus.unshare)(m, addr >> offset_width))
+		return NULL;
 	
-	if (invalid_addr || read[pgn] == NULL) return EINVAL;
-	else return (*read[pgn])(src, dst);
+	return &page->ram[offset];
 }
 
-int bus_write(addr_width_t dst, data_width_t src) {
-	size_t pgn = 0;
+/*
+ * Dispatch read, write and attn calls to appropriate bus units.
+ */
+
+int bus_read(machine *m, addr_width_t src, data_width_t *dst) {
+	struct bus_page *page;
 	size_t offset = 0;
 	
-	int invalid_addr = addr_split(dst, &pgn, &offset);
+	int result = find_page(m, src, &page, &offset);
+	if (result) return result;
 	
-	if (invalid_addr || write[pgn] == NULL) return EINVAL;
-	else return (*write[pgn])(dst, src);
+	PERF(page->reads++);
+	
+	if (page->ram != NULL) {
+		*dst = page->ram[offset];
+		return 0;
+	}
+	
+	if (page->read == NULL) return EINVAL;
+	else return (*page->read)(m, src, dst);
+}
+
+int bus_write(machine *m, addr_width_t dst, data_width_t src) {
+	struct bus *bus = &m->bus;
+	struct bus_page *page;
+	size_t offset = 0;
+	
+	int result = find_page(m, dst, &page, &offset);
+	if (result) return result;
+	
+	PERF(page->writes++);
+	
+	if (page->ram != NULL) {
+		if (page->shared && (result = (*bus->unshare)(m, dst >> offset_width)))
+			return result;
+		
+		page->ram[offset] = src;
+	}
+	else if (page->write == NULL) return EINVAL;
+	else result = (*page->write)(m, dst, src);
+	
+	if (!result && bus->snoop != NULL) (*bus->snoop)(m, dst);
+	
+	return result;
+}
+
+/*
+ * Read or write a run of count words, splitting it at page boundaries once
+ * rather than at every word. RAM pages are copied with memcpy, and unit pages
+ * go through their block handlers if they have them. The run stops at the
+ * first error, with the words before it already transferred, and every word
+ * written is snooped, see bus_snoop.
+ */
+
+int bus_read_block(machine *m, addr_width_t src, data_width_t *dst,
+	size_t count) {
+	
+	while (count) {
+		struct bus_page *page;
+		size_t offset = 0;
+		
+		int result = find_page(m, src, &page, &offset);
+		if (result) return result;
+		
+		size_t len = PAGE_SIZE - offset < count ? PAGE_SIZE - offset : count;
+		
+		PERF(page->reads += len);
+		
+		if (page->ram != NULL)
+			memcpy(dst, &page->ram[offset], len * sizeof(data_width_t));
+		else if (page->read_block != NULL)
+			result = (*page->read_block)(m, src, dst, len);
+		else if (page->read == NULL) return EINVAL;
+		else for (size_t x = 0; !result && x < len; x++)
+			result = (*page->read)(m, src + x, &dst[x]);
+		
+		if (result) return result;
+		
+		src += len;
+		dst += len;
+		count -= len;
+	}
+	
+	return 0;
 }
 
-int bus_attn(size_t unit, data_width_t cmd) {
-	if (unit >= MAX_PAGES || attn[unit] == NULL) return EINVAL;
-	else return (*attn[unit])(unit, cmd);
+int bus_write_block(machine *m, addr_width_t dst, const data_width_t *src,
+	size_t count) {
+	
+	struct bus *bus = &m->bus;
+	
+	while (count) {
+		struct bus_page *page;
+		size_t offset = 0;
+		
+		int result = find_page(m, dst, &page, &offset);
+		if (result) return result;
+		
+		size_t len = PAGE_SIZE - offset < count ? PAGE_SIZE - offset : count;
+		size_t done = len;
+		
+		PERF(page->writes += len);
+		
+		if (page->ram != NULL) {
+			if (page->shared
+				&& (result = (*bus->unshare)(m, dst >> offset_width)))
+				return result;
+			
+			memcpy(&page->ram[offset], src, len * sizeof(data_width_t));
+		}
+		else if (page->write_block != NULL)
+			result = (*page->write_block)(m, dst, src, len);
+		else if (page->write == NULL) return EINVAL;
+		else for (done = 0; done < len; done++)
+			if ((result = (*page->write)(m, dst + done, src[done]))) break;
+		
+		bus_snoop(m, dst, done); // a failed block handler may have written any
+		
+		if (result) return result;
+		
+		dst += len;
+		src += len;
+		count -= len;
+	}
+	
+	return 0;
+}
+
+/*
+ * Snoop a run of count words written other than by bus_write, with the range
+ * snoop function once per page if there is one, or else the write snoop
+ * function for every word
+ */
+
+void bus_snoop(machine *m, addr_width_t dst, size_t count) {
+	struct bus *bus = &m->bus;
+	
+	if (bus->snoop_range == NULL) {
+		if (bus->snoop != NULL)
+			for (size_t x = 0; x < count; x++) (*bus->snoop)(m, dst + x);
+		return;
+	}
+	
+	while (count) {
+		size_t offset = dst & offset_mask;
+		size_t len = PAGE_SIZE - offset < count ? PAGE_SIZE - offset : count;
+		
+		(*bus->snoop_range)(m, dst, len);
+		
+		dst += len;
+		count -= len;
+	}
+}
+
+int bus_attn(machine *m, size_t unit, data_width_t cmd) {
+	if (unit >= MAX_UNITS || m->bus.attn[unit] == NULL) return EINVAL;
+	
+	PERF(m->perf.attn[unit]++);
+	
+	return (*m->bus.attn[unit])(m, unit, cmd);
 }
@@ -2,6 +2,7 @@
 #define __BUS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
  * Definitions of data width, address width and the number of units to attach to
@@ -15,27 +16,228 @@ typedef uint16_t data_width_t;
 typedef uint32_t addr_width_t;
 
 #define PAGE_SIZE 256 // THIS MUST BE A POWER OF TWO
-#define MAX_PAGES 256 // THIS DOESN'T MATTER
+#define FIELD_PAGES (65536 / PAGE_SIZE) // pages in one 64 KW field
+#define MAX_FIELDS 256 // fields are 8 bits, see cpu.c
+#define MAX_PAGES (FIELD_PAGES * MAX_FIELDS)
+#define MAX_UNITS 256 // THIS DOESN'T MATTER
 
-extern int init_bus();
+typedef struct machine machine;
+
+/*
+ * One page of the address space
+ */
+
+struct bus_page {
+	/*
+	 * Unit read function
+	 *
+	 * addr_width_t src: address to read
+	 * data_width_t *dst: where to store fetched memory line
+	 * return int: 0 on success, nonzero on error (see errno.h)
+	 */
+	
+	int (*read)(machine *m, addr_width_t src, data_width_t *dst);
+	
+	/*
+	 * Unit write function
+	 *
+	 * addr_width_t dst: address to write
+	 * data_width_t src: contents to write to memory line
+	 * return int: 0 on success, nonzero on error (see errno.h)
+	 */
+	
+	int (*write)(machine *m, addr_width_t dst, data_width_t src);
+	
+	/*
+	 * Unit block read and write functions, for a run of words that never
+	 * goes past the end of the page. Optional: without them, block transfers
+	 * call the read or write function once per word.
+	 *
+	 * addr_width_t src, dst: first address to read or write
+	 * data_width_t *dst, *src: host buffer to fill or copy from
+	 * size_t count: words to transfer
+	 * return int: 0 on success, nonzero on error (see errno.h)
+	 */
+	
+	int (*read_block)(machine *m, addr_width_t src, data_width_t *dst,
+		size_t count);
+	int (*write_block)(machine *m, addr_width_t dst, const data_width_t *src,
+		size_t count);
+	
+	/*
+	 * Direct RAM, for pages that are plain memory with nothing to do on
+	 * access. When set, reads and writes go straight to the host array and
+	 * the read and write functions are not called.
+	 */
+	
+	data_width_t *ram;
+	
+	/*
+	 * Set for direct RAM that other machines can see too (see snapshot.c).
+	 * Reads go straight to it as usual, but the first write calls the bus's
+	 * unshare function, which must install a private copy.
+	 */
+	
+	uint8_t shared;
+	
+	/*
+	 * Access counts, see perf.c
+	 */
+	
+	unsigned long long reads;
+	unsigned long long writes;
+};
+
+/*
+ * Per-machine bus state. Every function is passed the machine it belongs to.
+ *
+ * The address space is a two-level table: one entry per field, pointing to
+ * that field's FIELD_PAGES pages, so that a lookup is two loads whatever the
+ * size of the space. A field's table is only allocated once something is
+ * installed in it.
+ */
+
+struct bus {
+	struct bus_page *field[MAX_FIELDS];
+	
+	/*
+	 * I/O control functions, commands defined per device. Calls may block.
+	 *
+	 * *data_width_t cmd: command to be parsed and handled by device
+	 * return int: 0 on success, nonzero on error (see errno.h)
+	 */
+	
+	int (*attn[MAX_UNITS])(machine *m, size_t unit, data_width_t cmd);
+	
+	/*
+	 * Unshare function for shared RAM, see struct bus_page
+	 *
+	 * size_t pgn: page about to be written
+	 * return int: 0 on success, nonzero on error (see errno.h)
+	 */
+	
+	int (*unshare)(machine *m, size_t pgn);
+	
+	/*
+	 * Lazy RAM allocation. Pages below lazy_pages with nothing installed are
+	 * given RAM by the alloc function the first time they are accessed, so
+	 * that the whole space can be memory without the host backing any of it
+	 * up front. Optional, populate at startup
+	 *
+	 * size_t pgn: page being accessed
+	 * return int: 0 on success, nonzero on error (see errno.h)
+	 */
+	
+	size_t lazy_pages;
+	int (*alloc)(machine *m, size_t pgn);
+	
+	/*
+	 * Write snoop function, called after every successful bus write so that
+	 * anything holding copies of memory (e.g. the CPU's predecoded
+	 * instructions) can invalidate them. Optional, populate at startup
+	 *
+	 * addr_width_t dst: address that was written
+	 */
+	
+	void (*snoop)(machine *m, addr_width_t dst);
+	
+	/*
+	 * Range snoop function, called instead of the write snoop once per page
+	 * of a block write or DMA transfer rather than for every word. Optional:
+	 * without it, the write snoop is called for every word.
+	 *
+	 * addr_width_t dst: first address written
+	 * size_t count: words written, never past the end of the page
+	 */
+	
+	void (*snoop_range)(machine *m, addr_width_t dst, size_t count);
+};
+
+extern int init_bus(machine *m);
+extern void free_bus(machine *m);
 extern data_width_t offset_width;
 extern addr_width_t offset_mask;
 
 extern int install_unit(
+	machine *m,
 	size_t pgn,
-	int (*unit_read) (addr_width_t, data_width_t *),
-	int (*unit_write) (addr_width_t, data_width_t)
+	int (*unit_read) (machine *, addr_width_t, data_width_t *),
+	int (*unit_write) (machine *, addr_width_t, data_width_t)
 );
 
-extern int install_attn(
+extern int install_block(
+	machine *m,
 	size_t pgn,
-	int (*unit_attn) (size_t, data_width_t)
+	int (*unit_read_block) (machine *, addr_width_t, data_width_t *, size_t),
+	int (*unit_write_block) (machine *, addr_width_t, const data_width_t *,
+		size_t)
+);
+
+extern int install_attn(
+	machine *m,
+	size_t unit,
+	int (*unit_attn) (machine *, size_t, data_width_t)
+);
+
+extern int make_page(machine *m, size_t pgn, struct bus_page **page);
+extern int install_ram(machine *m, size_t pgn, data_width_t *base);
+extern int share_ram(machine *m, size_t pgn);
+
+extern int install_lazy(
+	machine *m,
+	size_t pages,
+	int (*unit_alloc) (machine *, size_t)
+);
+
+extern int install_unshare(
+	machine *m,
+	int (*unit_unshare) (machine *, size_t)
+);
+
+extern int install_snoop(
+	machine *m,
+	void (*unit_snoop) (machine *, addr_width_t)
+);
+
+extern int install_snoop_range(
+	machine *m,
+	void (*unit_snoop_range) (machine *, addr_width_t, size_t)
 );
 
 extern int addr_split(addr_width_t addr, size_t *pgn, size_t *offset);
 
-extern int bus_read(addr_width_t src, data_width_t *dst);
-extern int bus_write(addr_width_t dst, data_width_t src);
-extern int bus_attn(size_t unit, data_width_t cmd);
+/*
+ * Page table entry for a page, NULL if nothing has been installed in its field
+ * or the page number is too high
+ */
+
+static inline struct bus_page *bus_page(struct bus *bus, size_t pgn) {
+	if (pgn >= MAX_PAGES || bus->field[pgn / FIELD_PAGES] == NULL) return NULL;
+	else return &bus->field[pgn / FIELD_PAGES][pgn % FIELD_PAGES];
+}
+
+/*
+ * Host pointer to a word of direct RAM, NULL if the address is not in a direct
+ * RAM page. For reading only: writes must go through bus_write, so that the
+ * snoop function sees them and shared pages are unshared first.
+ */
+
+static inline data_width_t *ram_ptr(struct bus *bus, addr_width_t addr) {
+	struct bus_page *page = bus_page(bus, addr >> offset_width);
+	
+	if (page == NULL || page->ram == NULL) return NULL;
+	else return &page->ram[addr & offset_mask];
+}
+
+extern data_width_t *dma_ptr(machine *m, addr_width_t addr, int write);
+
+extern int bus_read(machine *m, addr_width_t src, data_width_t *dst);
+extern int bus_write(machine *m, addr_width_t dst, data_width_t src);
+extern int bus_read_block(machine *m, addr_width_t src, data_width_t *dst,
+	size_t count);
+extern int bus_write_block(machine *m, addr_width_t dst,
+	const data_width_t *src, size_t count);
+extern int bus_attn(machine *m, size_t unit, data_width_t cmd);
+extern void bus_snoop(machine *m, addr_width_t dst, size_t count);
 
 #endif
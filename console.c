@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "tty.h"
+#include "console.h"
+#include "machine.h"
+
+/*
+ * Console rings. The CPU side puts output bytes and takes input bytes without
+ * making any system calls; the console thread drains and fills them with
+ * batched write and read calls.
+ */
+
+int ring_put(struct ring *r, uint8_t byte) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (tail - head == RING_SIZE) return EAGAIN;
+
+    r->buf[tail & (RING_SIZE - 1)] = byte;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+int ring_get(struct ring *r, uint8_t *byte) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head == tail) return EAGAIN;
+
+    *byte = r->buf[head & (RING_SIZE - 1)];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+size_t ring_used(struct ring *r) {
+    return atomic_load(&r->tail) - atomic_load(&r->head);
+}
+
+/*
+ * The console thread sleeps in poll when it has nothing to do. Producers only
+ * write to the wake pipe when it has said it is sleeping, so a busy console
+ * costs the CPU no system calls at all. Input is only read once the guest has
+ * asked for it, so programs that never read the keyboard leave stdin to the
+ * monitor.
+ */
+
+void init_console(machine *m, int in_fd, int out_fd) {
+    struct console *con = &m->console;
+
+    atomic_init(&con->out.head, 0);
+    atomic_init(&con->out.tail, 0);
+    atomic_init(&con->in.head, 0);
+    atomic_init(&con->in.tail, 0);
+
+    con->in_fd = in_fd;
+    con->out_fd = out_fd;
+    con->run = 0;
+    atomic_init(&con->sleeping, 0);
+    atomic_init(&con->want_input, 0);
+    con->input_eof = 0;
+    con->capture = NULL;
+
+    pthread_mutex_init(&con->space_lock, NULL);
+    pthread_cond_init(&con->space, NULL);
+
+    pipe(con->wake_pipe);
+    fcntl(con->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(con->wake_pipe[1], F_SETFL, O_NONBLOCK);
+}
+
+void free_console(machine *m) {
+    struct console *con = &m->console;
+
+    close(con->wake_pipe[0]);
+    close(con->wake_pipe[1]);
+    free(con->capture);
+
+    pthread_mutex_destroy(&con->space_lock);
+    pthread_cond_destroy(&con->space);
+}
+
+/*
+ * Headless mode: output goes straight into a growing buffer on the calling
+ * thread and there is never any input, so no console or TTY threads are
+ * needed. Returns ENOMEM if the buffer can't be allocated, 0 otherwise.
+ */
+
+int console_capture(machine *m) {
+    struct console *con = &m->console;
+
+    con->capture_size = 256;
+    con->capture_len = 0;
+    con->capture = malloc(con->capture_size);
+    if (con->capture == NULL) return ENOMEM;
+
+    con->input_eof = 1;
+
+    return 0;
+}
+
+int capture_putc(struct console *con, uint8_t byte) {
+    if (con->capture_len == con->capture_size) {
+        uint8_t *grown = realloc(con->capture, con->capture_size * 2);
+        if (grown == NULL) return 0; // drop it, as drain_out would
+
+        con->capture = grown;
+        con->capture_size *= 2;
+    }
+
+    con->capture[con->capture_len++] = byte;
+
+    return 0;
+}
+
+void console_wake(struct console *con) {
+    char dummy = 0;
+
+    atomic_thread_fence(memory_order_seq_cst); // order the ring update first
+    if (atomic_load(&con->sleeping)) write(con->wake_pipe[1], &dummy, 1);
+}
+
+int console_putc(machine *m, uint8_t byte) {
+    if (m->console.capture) return capture_putc(&m->console, byte);
+
+    int result = ring_put(&m->console.out, byte);
+
+    if (!result) console_wake(&m->console);
+
+    return result;
+}
+
+int console_getc(machine *m, uint8_t *byte) {
+    if (m->console.capture) return EAGAIN;
+
+    if (!atomic_exchange(&m->console.want_input, 1)) console_wake(&m->console);
+
+    return ring_get(&m->console.in, byte);
+}
+
+/*
+ * Returns nonzero if input is waiting
+ */
+
+int console_ready(machine *m) {
+    if (m->console.capture) return 0;
+
+    if (!atomic_exchange(&m->console.want_input, 1)) console_wake(&m->console);
+
+    return ring_used(&m->console.in) != 0;
+}
+
+/*
+ * Block until there is room in the output ring or the console is stopped
+ */
+
+void console_wait_space(machine *m) {
+    struct console *con = &m->console;
+
+    pthread_mutex_lock(&con->space_lock);
+
+    while (con->run && ring_used(&con->out) == RING_SIZE)
+        pthread_cond_wait(&con->space, &con->space_lock);
+
+    pthread_mutex_unlock(&con->space_lock);
+}
+
+/*
+ * Write out as much of the output ring as is contiguous. Returns nonzero if
+ * anything was written.
+ */
+
+int drain_out(machine *m) {
+    struct console *con = &m->console;
+    size_t head = atomic_load_explicit(&con->out.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&con->out.tail, memory_order_acquire);
+
+    if (head == tail) return 0;
+
+    size_t start = head & (RING_SIZE - 1);
+    size_t len = tail - head;
+    if (start + len > RING_SIZE) len = RING_SIZE - start;
+
+    ssize_t written = write(con->out_fd, &con->out.buf[start], len);
+    if (written <= 0) written = len; // nowhere to put it, drop it
+
+    atomic_store_explicit(&con->out.head, head + written,
+        memory_order_release);
+
+    pthread_mutex_lock(&con->space_lock);
+    pthread_cond_broadcast(&con->space);
+    pthread_mutex_unlock(&con->space_lock);
+
+    device_event(m);
+
+    return 1;
+}
+
+/*
+ * Read whatever is waiting on stdin into the input ring. Returns nonzero if
+ * anything was read.
+ */
+
+int fill_in(machine *m) {
+    struct console *con = &m->console;
+    size_t room = RING_SIZE - ring_used(&con->in);
+    uint8_t buf[256];
+
+    if (!atomic_load(&con->want_input) || con->input_eof || !room) return 0;
+
+    struct pollfd pfd;
+    pfd.fd = con->in_fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLIN | POLLHUP)))
+        return 0;
+
+    ssize_t got = read(con->in_fd, buf, room < sizeof(buf) ? room : sizeof(buf));
+
+    if (got <= 0) {
+        con->input_eof = 1;
+        return 0;
+    }
+
+    for (ssize_t x = 0; x < got; x++) ring_put(&con->in, buf[x]);
+    if (!tty_scheduled(m, TTY_IN)) raise_irq(m, TTY_IN); // see replay.c
+
+    return 1;
+}
+
+/*
+ * Console thread, vargp is the machine
+ */
+
+void *console(void *vargp) {
+    machine *m = (machine *) vargp;
+    struct console *con = &m->console;
+
+    while (1) {
+        int active = drain_out(m);
+        active |= fill_in(m);
+
+        if (active) continue;
+        if (!con->run) break; // only once all output is written
+
+        atomic_store(&con->sleeping, 1);
+
+        if (con->run && !ring_used(&con->out)) {
+            struct pollfd pfd[2];
+            int nfds = 1;
+
+            pfd[0].fd = con->wake_pipe[0];
+            pfd[0].events = POLLIN;
+
+            if (atomic_load(&con->want_input) && !con->input_eof
+                && ring_used(&con->in) < RING_SIZE) {
+                pfd[1].fd = con->in_fd;
+                pfd[1].events = POLLIN;
+                nfds++;
+            }
+
+            poll(pfd, nfds, -1);
+
+            char dummy[64];
+            while (read(con->wake_pipe[0], dummy, sizeof(dummy)) > 0);
+        }
+
+        atomic_store(&con->sleeping, 0);
+    }
+
+    return NULL;
+}
+
+/*
+ * Stop the console thread. It exits once the output ring is empty.
+ */
+
+void stop_console(machine *m) {
+    struct console *con = &m->console;
+    char dummy = 0;
+
+    pthread_mutex_lock(&con->space_lock);
+    con->run = 0;
+    pthread_cond_broadcast(&con->space);
+    pthread_mutex_unlock(&con->space_lock);
+
+    atomic_store(&con->want_input, 0);
+    write(con->wake_pipe[1], &dummy, 1);
+}
@@ -0,0 +1,61 @@
+#ifndef __CONSOLE_H__
+#define __CONSOLE_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bus.h"
+
+#define RING_SIZE 4096 // THIS MUST BE A POWER OF TWO
+
+/*
+ * Single-producer, single-consumer byte ring. head is only written by the
+ * consumer and tail only by the producer.
+ */
+
+struct ring {
+    atomic_size_t head;
+    atomic_size_t tail;
+    uint8_t buf[RING_SIZE];
+};
+
+/*
+ * Per-machine console state, see console.c
+ */
+
+struct console {
+    struct ring out;
+    struct ring in;
+    int in_fd;
+    int out_fd;
+    int run;
+    int wake_pipe[2];
+    atomic_int sleeping;
+    atomic_int want_input;
+    int input_eof;
+    pthread_mutex_t space_lock;
+    pthread_cond_t space;
+    
+    uint8_t *capture; // headless output buffer, NULL when using the rings
+    size_t capture_len;
+    size_t capture_size;
+};
+
+extern int ring_put(struct ring *r, uint8_t byte);
+extern int ring_get(struct ring *r, uint8_t *byte);
+extern size_t ring_used(struct ring *r);
+
+extern void init_console(machine *m, int in_fd, int out_fd);
+extern void free_console(machine *m);
+extern int console_capture(machine *m);
+
+extern int console_putc(machine *m, uint8_t byte);
+extern int console_getc(machine *m, uint8_t *byte);
+extern int console_ready(machine *m);
+extern void console_wait_space(machine *m);
+
+extern void *console(void *vargp);
+extern void stop_console(machine *m);
+
+#endif
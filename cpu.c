@@ -1,37 +1,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #include "bus.h"
 #include "cpu.h"
+#include "xlat.h"
+#include "perf.h"
+#include "profile.h"
+#include "trace.h"
+#include "debug.h"
+#include "sched.h"
+#include "replay.h"
+#include "machine.h"
 
-data_width_t zpage[PAGE_SIZE + 1];
-data_width_t switches;
+/*
+ * Called by a device whenever its status may have changed, so the CPU can
+ * sleep through idle loops
+ */
+
+void device_event(machine *m) {
+    pthread_mutex_lock(&m->io_lock);
+    atomic_fetch_add(&m->dev_event, 1);
+    pthread_cond_broadcast(&m->io_done);
+    pthread_mutex_unlock(&m->io_lock);
+}
 
 /*
  * Bus interface functions
  */
 
-int cpu_read(addr_width_t src, data_width_t *dst) {
+int cpu_read(machine *m, addr_width_t src, data_width_t *dst) {
     addr_width_t offset = src & offset_mask;
-    *dst = zpage[offset];
+    *dst = m->zpage[offset];
     return 0;
 }
 
-int cpu_write(addr_width_t dst, data_width_t src) {
+int cpu_write(machine *m, addr_width_t dst, data_width_t src) {
     addr_width_t offset = dst & offset_mask;
-    zpage[offset] = src;
+    m->zpage[offset] = src;
     return 0;
 }
 
-int cpu_attn(size_t unit, data_width_t cmd) {
-    return ENOSYS;
+int cpu_read_block(machine *m, addr_width_t src, data_width_t *dst,
+    size_t count) {
+
+    memcpy(dst, &m->zpage[src & offset_mask], count * sizeof(data_width_t));
+    return 0;
 }
 
-addr_width_t mar = 0;
-data_width_t mbr = 0;
+int cpu_write_block(machine *m, addr_width_t dst, const data_width_t *src,
+    size_t count) {
+
+    memcpy(&m->zpage[dst & offset_mask], src, count * sizeof(data_width_t));
+    return 0;
+}
+
+int cpu_attn(machine *m, size_t unit, data_width_t cmd) {
+    return ENOSYS;
+}
 
 /*
  * Basic instruction format
@@ -40,20 +72,20 @@ data_width_t mbr = 0;
  *       AccSel
  */
 
-int get_mbr_opcode() {
-    return (mbr & 0xE000) >> 13;
+int get_mbr_opcode(machine *m) {
+    return (m->mbr & 0xE000) >> 13;
 }
 
-int get_mbr_acc() {
-    return (mbr & 0x1C00) >> 10;
+int get_mbr_acc(machine *m) {
+    return (m->mbr & 0x1C00) >> 10;
 }
 
-int get_mbr_i() {
-    return (mbr & 0x0200) >> 9;
+int get_mbr_i(machine *m) {
+    return (m->mbr & 0x0200) >> 9;
 }
 
-int get_mbr_z() {
-    return (mbr & 0x0100) >> 8;
+int get_mbr_z(machine *m) {
+    return (m->mbr & 0x0100) >> 8;
 }
 
 /*
@@ -81,16 +113,16 @@ int get_mbr_z() {
  *       DstSel            Src/Imm4
  */
 
-int get_mbr_opr_gr() {
-    return (mbr & 0x0100) >> 8;
+int get_mbr_opr_gr(machine *m) {
+    return (m->mbr & 0x0100) >> 8;
 }
 
-int get_mbr_opr_regop() {
-    return (mbr & 0x0200) >> 9;
+int get_mbr_opr_regop(machine *m) {
+    return (m->mbr & 0x0200) >> 9;
 }
 
-int get_mbr_opr_gr2_and() {
-    return (mbr & 0x0008) >> 3;
+int get_mbr_opr_gr2_and(machine *m) {
+    return (m->mbr & 0x0008) >> 3;
 }
 
 /*
@@ -101,43 +133,54 @@ int get_mbr_opr_gr2_and() {
  */
 
 /*
- * Getters and setters for the accumulator select flags
+ * Getters for the accumulator select and cycle counter flags, for devices and
+ * for the machine stopped between runs
  */
 
-void set_flag_acc(int value) {
-    zpage[FLAG] = (zpage[FLAG] & 0x1FFF) | ((value & 0x7) << 13);
-    return;
+int get_flag_acc(machine *m) {
+    return (m->zpage[FLAG] & 0xE000) >> 13;
 }
 
-int get_flag_acc() {
-    return (zpage[FLAG] & 0xE000) >> 13;
+int get_flag_cycle(machine *m) {
+    return (m->zpage[FLAG] & 0x1E0) >> 5;
 }
 
 /*
- * Getters and setters for the temporary flags
- * Stores opcode in EXEC cycle, function in IOTXRX, OPR group in OPERTx
+ * Micro-cycle state
+ *
+ * AccSel, Tmp (the opcode in EXEC, the function in an IOT), Cycle and the Id
+ * and Ex bits only carry state from one micro-cycle to the next, so the cycle
+ * functions keep them in a struct ucycle rather than in FLAG. step() loads it
+ * from FLAG and stores it back around each micro-cycle; run() keeps it in a
+ * local for the whole run and stores it only where something else may look at
+ * FLAG. Io and Lk stay in FLAG, since devices and instructions use them.
  */
 
-void set_flag_tmp(int value) {
-    zpage[FLAG] = (zpage[FLAG] & 0xE1FF) | ((value & 0xF) << 9);
-    return;
-}
-
-int get_flag_tmp() {
-    return (zpage[FLAG] & 0x1E00) >> 9;
+void ucycle_load(machine *m, struct ucycle *u) {
+    data_width_t flag = m->zpage[FLAG];
+    
+    u->acc = (flag & 0xE000) >> 13;
+    u->tmp = (flag & 0x1E00) >> 9;
+    u->cycle = (flag & 0x1E0) >> 5;
+    u->id = (flag >> ID) & 1;
+    u->ex = (flag >> EX) & 1;
 }
 
-/*
- * Getters and setters for the cycle counter flags
- */
-
-void set_flag_cycle(int value) {
-    zpage[FLAG] = (zpage[FLAG] & 0xFE1F) | ((value & 0xF) << 5);
-    return;
+data_width_t ucycle_flag(struct ucycle *u) {
+    return u->acc << 13 | u->tmp << 9 | u->cycle << 5 | u->id << ID | u->ex << EX;
 }
 
-int get_flag_cycle() {
-    return (zpage[FLAG] & 0x1E0) >> 5;
+void ucycle_store(machine *m, struct ucycle *u) {
+    data_width_t state = ucycle_flag(u);
+    
+    if (u->cycle != 4) { // Io is only ever set in IOWAIT
+        m->zpage[FLAG] = (m->zpage[FLAG] & 1 << LK) | state;
+        return;
+    }
+    
+    pthread_mutex_lock(&m->io_lock); // a device may be clearing Io
+    m->zpage[FLAG] = (m->zpage[FLAG] & (1 << IO | 1 << LK)) | state;
+    pthread_mutex_unlock(&m->io_lock);
 }
 
 /*
@@ -149,22 +192,16 @@ int get_flag_cycle() {
  * Calculate an address using an offset and zero-page bit.
  */
 
-uint16_t df = 0; // data field
-uint16_t ib = 0; // instruction buffer
-uint16_t if_ = 0; // instruction field
-uint8_t zp = 0; // zero page
-int jump_int_lockout = 0;
-
-addr_width_t address(int z, addr_width_t offset) {
+addr_width_t address(machine *m, int z, addr_width_t offset) {
     offset &= offset_mask;
     
     if (!z) {
-    	offset |= zpage[PC] & ~offset_mask;
-    	offset |= ((addr_width_t) df) << 16;
+    	offset |= m->zpage[PC] & ~offset_mask;
+    	offset |= ((addr_width_t) m->df) << 16;
     }
     else if (z && offset > PC) {
-    	offset |= ((addr_width_t) zp) << offset_width;
-    	offset |= ((addr_width_t) df) << 16;
+    	offset |= ((addr_width_t) m->zp) << offset_width;
+    	offset |= ((addr_width_t) m->df) << 16;
     }
     
     return offset;
@@ -176,17 +213,17 @@ addr_width_t address(int z, addr_width_t offset) {
  * bit in the PSW
  */
 
-data_width_t ral(data_width_t value) {
-    data_width_t old_link = zpage[FLAG] & 1;
+data_width_t ral(machine *m, data_width_t value) {
+    data_width_t old_link = m->zpage[FLAG] & 1;
     data_width_t new_link = (value & 0x8000) >> 15;
-    zpage[FLAG] = (zpage[FLAG] & 0xFFFE) | new_link;
+    m->zpage[FLAG] = (m->zpage[FLAG] & 0xFFFE) | new_link;
     return (value << 1) | old_link;
 }
     
-data_width_t rar(data_width_t value) {
-    data_width_t old_link = (zpage[FLAG] & 1) << 15;
+data_width_t rar(machine *m, data_width_t value) {
+    data_width_t old_link = (m->zpage[FLAG] & 1) << 15;
     data_width_t new_link = value & 1;
-    zpage[FLAG] = (zpage[FLAG] & 0xFFFE) | new_link;
+    m->zpage[FLAG] = (m->zpage[FLAG] & 0xFFFE) | new_link;
     return (value >> 1) | old_link;
 }
 
@@ -194,62 +231,62 @@ data_width_t rar(data_width_t value) {
  * OPR helpers
  */
 
-void opr1(int ucode) {
-    int acc = get_flag_acc();
-    
+void opr1(machine *m, int acc, int ucode) {
     if (!ucode) {}
 
     if (ucode & 0x80) // CLA
-        zpage[acc] = 0;
+        m->zpage[acc] = 0;
     if (ucode & 0x40) // CLL
-        zpage[FLAG] &= ~(1 << LK);
+        m->zpage[FLAG] &= ~(1 << LK);
     
     if (ucode & 0x20) // CMA
-        zpage[acc] ^= 0xFFFF;
+        m->zpage[acc] ^= 0xFFFF;
     if (ucode & 0x10) // CML
-        zpage[FLAG] ^= 1 << LK;
+        m->zpage[FLAG] ^= 1 << LK;
     
     if (ucode & 0x1) { // IAC
-        int result = (int) (zpage[acc] + 1);
-        zpage[acc] = result & 0xFFFF;
-        if (result & ~(0xFFFF)) zpage[FLAG] ^= 1 << LK;
+        int result = (int) (m->zpage[acc] + 1);
+        m->zpage[acc] = result & 0xFFFF;
+        if (result & ~(0xFFFF)) m->zpage[FLAG] ^= 1 << LK;
     }
     
     switch ((ucode & 0xE) >> 1) {
         case 1: // 6-bit BSW
-            zpage[acc] = (zpage[acc] & 0xF000)
-                       | ((zpage[acc] & 07700) >> 6)
-                       | ((zpage[acc] & 077) << 6);
+            m->zpage[acc] = (m->zpage[acc] & 0xF000)
+                       | ((m->zpage[acc] & 07700) >> 6)
+                       | ((m->zpage[acc] & 077) << 6);
             break;
         
         case 2: // RAL once
-            zpage[acc] = ral(zpage[acc]);
+            m->zpage[acc] = ral(m, m->zpage[acc]);
             break;
         
         case 3: // RAL twice
-            zpage[acc] = ral(ral(zpage[acc]));
+            m->zpage[acc] = ral(m, ral(m, m->zpage[acc]));
             break;
         
         case 4: // RAR once
-            zpage[acc] = rar(zpage[acc]);
+            m->zpage[acc] = rar(m, m->zpage[acc]);
             break;
         
         case 5: // RAR twice
-            zpage[acc] = rar(rar(zpage[acc]));
+            m->zpage[acc] = rar(m, rar(m, m->zpage[acc]));
             break;
         
         case 7: // 8-bit BSW
-            zpage[acc] = (zpage[acc] & 0xFF00) >> 8
-                       | (zpage[acc] & 0xFF) << 8;
+            m->zpage[acc] = (m->zpage[acc] & 0xFF00) >> 8
+                       | (m->zpage[acc] & 0xFF) << 8;
             break;
     }
 
     return;
 }
 
-void opr2(int ucode) {
-    int acc = get_flag_acc();
-    
+/*
+ * Returns nonzero if the instruction halts
+ */
+
+int opr2(machine *m, int acc, int ucode) {
     if (!ucode) {}
 
     else if (ucode & 1); // opr3(ucode);
@@ -257,299 +294,697 @@ void opr2(int ucode) {
     else if (!((ucode & 0x0008) >> 3)) { // OR group
         int skip = 0;
         
-        if ((ucode & 0x40) && zpage[acc] & 0x8000) skip = 1; // SMA
-        if ((ucode & 0x20) && zpage[acc] == 0) skip = 1; // SZA
-        if ((ucode & 0x10) && zpage[FLAG] & 1) skip = 1; // SNL
+        if ((ucode & 0x40) && m->zpage[acc] & 0x8000) skip = 1; // SMA
+        if ((ucode & 0x20) && m->zpage[acc] == 0) skip = 1; // SZA
+        if ((ucode & 0x10) && m->zpage[FLAG] & 1) skip = 1; // SNL
         
-        if (skip) zpage[PC]++;
+        if (skip) m->zpage[PC]++;
     }
     
     else { // AND group
         int skip = 1;
         
-        if (ucode & 0x40) skip &= (zpage[acc] & 0x8000 == 0); // SPA
-        if (ucode & 0x20) skip &= (zpage[acc] != 0); // SNA
-        if (ucode & 0x10) skip &= (zpage[FLAG] & 1 == 0); // SZL
+        if (ucode & 0x40) skip &= (m->zpage[acc] & 0x8000 == 0); // SPA
+        if (ucode & 0x20) skip &= (m->zpage[acc] != 0); // SNA
+        if (ucode & 0x10) skip &= (m->zpage[FLAG] & 1 == 0); // SZL
         
-        if (skip) zpage[PC]++;
+        if (skip) m->zpage[PC]++;
     }
     
-    if (ucode & 0x80) zpage[acc] = 0; // CLA
+    if (ucode & 0x80) m->zpage[acc] = 0; // CLA
     
-    if (ucode & 0x04) zpage[acc] |= switches; // OSR
-    if (ucode & 0x02) set_flag_cycle(0xF); // HLT
+    if (ucode & 0x04) m->zpage[acc] |= m->switches; // OSR
     
-    return;
+    return ucode & 0x02; // HLT
 }
 
 /*
  * New OPR group with register-register operations
  */
 
-void reg_op(void) {
-    uint32_t dst = get_flag_acc();
-    uint32_t src = mbr & 07;
-    uint32_t imm4 = mbr & 017;
+void reg_op(machine *m, int acc) {
+    uint32_t dst = acc;
+    uint32_t src = m->mbr & 07;
+    uint32_t imm4 = m->mbr & 017;
     uint32_t result = 0;
     int s_result = 0;
     
-    switch ((mbr & 0x00F0) >> 4) {
+    switch ((m->mbr & 0x00F0) >> 4) {
         case 0x00: // SIR
-            zpage[dst + 010] = zpage[src];
+            m->zpage[dst + 010] = m->zpage[src];
             break;
             
         case 0x01: // SWP
-            result = zpage[src];
-            zpage[src] = zpage[dst];
-            zpage[dst] = result;
+            result = m->zpage[src];
+            m->zpage[src] = m->zpage[dst];
+            m->zpage[dst] = result;
             break;
         
         case 0x02: // OR
-            zpage[dst] |= zpage[src];
+            m->zpage[dst] |= m->zpage[src];
             break;
         
         case 0x03: // XOR
-            zpage[dst] ^= zpage[src];
+            m->zpage[dst] ^= m->zpage[src];
             break;
         
         case 0x04: // SHL
-            result = zpage[dst];
-            result <<= (zpage[src] & 0xF);
-            zpage[dst] = result;
-            if (result & 0x10000) zpage[FLAG] |= 1 << LK;
-            else zpage[FLAG] &= ~(1 << LK);
+            result = m->zpage[dst];
+            result <<= (m->zpage[src] & 0xF);
+            m->zpage[dst] = result;
+            if (result & 0x10000) m->zpage[FLAG] |= 1 << LK;
+            else m->zpage[FLAG] &= ~(1 << LK);
             break;
             
         case 0x05: // SLI
-            result = zpage[dst];
+            result = m->zpage[dst];
             result <<= imm4 + 1;
-            zpage[dst] = result;
-            if (result & 0x10000) zpage[FLAG] |= 1 << LK;
-            else zpage[FLAG] &= ~(1 << LK);
+            m->zpage[dst] = result;
+            if (result & 0x10000) m->zpage[FLAG] |= 1 << LK;
+            else m->zpage[FLAG] &= ~(1 << LK);
             break;
             
         case 0x06: // SHR
-            result = zpage[dst];
+            result = m->zpage[dst];
             
-            if ((zpage[src] & 0xF) && result & (1 << ((zpage[src] & 0xF) - 1)))
-                zpage[FLAG] |= 1 << LK;
-            else if ((zpage[src] & 0xF)) zpage[FLAG] &= ~(1 << LK);
+            if ((m->zpage[src] & 0xF) && result & (1 << ((m->zpage[src] & 0xF) - 1)))
+                m->zpage[FLAG] |= 1 << LK;
+            else if ((m->zpage[src] & 0xF)) m->zpage[FLAG] &= ~(1 << LK);
             
-            result >>= (zpage[src] & 0xF);
-            zpage[dst] = result;
+            result >>= (m->zpage[src] & 0xF);
+            m->zpage[dst] = result;
             break;
             
         case 0x07: // SRI
-            result = zpage[dst];
+            result = m->zpage[dst];
             
             if (result & (1 << imm4))
-                zpage[FLAG] |= 1 << LK;
-            else zpage[FLAG] &= ~(1 << LK);
+                m->zpage[FLAG] |= 1 << LK;
+            else m->zpage[FLAG] &= ~(1 << LK);
             
             result >>= imm4 + 1;
-            zpage[dst] = result;
+            m->zpage[dst] = result;
             break;
             
         case 0x08: // ASR
-            s_result = (int16_t) zpage[dst];
+            s_result = (int16_t) m->zpage[dst];
             
-            if ((zpage[src] & 0xF) && s_result & (1 << ((zpage[src] & 0xF) - 1)))
-                zpage[FLAG] |= 1 << LK;
-            else if ((zpage[src] & 0xF)) zpage[FLAG] &= ~(1 << LK);
+            if ((m->zpage[src] & 0xF) && s_result & (1 << ((m->zpage[src] & 0xF) - 1)))
+                m->zpage[FLAG] |= 1 << LK;
+            else if ((m->zpage[src] & 0xF)) m->zpage[FLAG] &= ~(1 << LK);
             
-            s_result >>= (zpage[src] & 0xF);
-            zpage[dst] = s_result;
+            s_result >>= (m->zpage[src] & 0xF);
+            m->zpage[dst] = s_result;
             break;
             
         case 0x09: // ASI
-            s_result = (int16_t) zpage[dst];
+            s_result = (int16_t) m->zpage[dst];
             
             if (s_result & (1 << imm4))
-                zpage[FLAG] |= 1 << LK;
-            else zpage[FLAG] &= ~(1 << LK);
+                m->zpage[FLAG] |= 1 << LK;
+            else m->zpage[FLAG] &= ~(1 << LK);
             
             s_result >>= imm4 + 1;
-            zpage[dst] = s_result;
+            m->zpage[dst] = s_result;
             break;
     }
     return;
 }
 
 /*
- * Cycle 0: IFETCH
+ * Interrupts
+ *
+ * Devices 0-15 each own a bit of the pending word and set it with raise_irq.
+ * IFETCH delivers an interrupt when interrupts are on, an unmasked request is
+ * pending and no jump is outstanding after a field change. Delivery saves the
+ * PC in INT_PC and the fields in INT_SF (in the same layout LDI uses), clears
+ * the fields and carries on at INT_VEC in field 0 with interrupts off.
+ *
+ * IOT device 0 controls them:
+ * 0 WAI - wait (in IOWAIT) until an unmasked request is pending
+ * 1 ION - interrupts on, after the next instruction
+ * 2 IOF - interrupts off
+ * 3 SRQ - skip if an unmasked request is pending
+ * 4 RPR - read pending requests into accumulator
+ * 5 RTI - return from interrupt, restoring PC and fields, interrupts on
+ * 6 ACK - clear the pending requests set in accumulator
+ * 7 SMK - set the request mask from accumulator
+ */
+
+#define INT_OFF 0
+#define INT_DELAY 1
+#define INT_ON 2
+
+void raise_irq(machine *m, size_t unit) {
+    if (unit >= 16) return;
+    
+    atomic_fetch_or(&m->irq_pending, 1 << unit);
+    
+    pthread_mutex_lock(&m->io_lock);
+    
+    if (m->int_waiting && (atomic_load(&m->irq_pending) & m->irq_mask)) {
+        m->int_waiting = 0;
+        m->zpage[FLAG] &= ~(1 << IO);
+    }
+    
+    atomic_fetch_add(&m->dev_event, 1);
+    pthread_cond_broadcast(&m->io_done);
+    pthread_mutex_unlock(&m->io_lock);
+}
+
+/*
+ * Returns nonzero if the next IFETCH has interrupt work to do
+ */
+
+int int_due(machine *m) {
+    return m->int_enable == INT_DELAY || (m->int_enable == INT_ON
+        && !m->jump_int_lockout && (atomic_load(&m->irq_pending) & m->irq_mask));
+}
+
+void interrupt(machine *m) {
+    m->zpage[INT_PC] = m->zpage[PC];
+    m->zpage[INT_SF] = m->df | (m->if_ << 8);
+    
+    m->df = 0;
+    m->ib = 0;
+    m->if_ = 0;
+    m->zpage[PC] = INT_VEC;
+    
+    m->int_enable = INT_OFF;
+}
+
+/*
+ * Returns the next micro-cycle, IOWAIT if waiting
+ */
+
+int int_iot(machine *m, int acc, int func) {
+    int cycle = 0;
+    
+    switch (func) {
+        case 0: // WAI
+            pthread_mutex_lock(&m->io_lock);
+            
+            if (!(atomic_load(&m->irq_pending) & m->irq_mask)) {
+                m->int_waiting = 1;
+                m->zpage[FLAG] |= 1 << IO;
+                cycle = 4;
+            }
+            
+            pthread_mutex_unlock(&m->io_lock);
+            break;
+        
+        case 1: // ION
+            if (m->int_enable == INT_OFF) m->int_enable = INT_DELAY;
+            break;
+        
+        case 2: // IOF
+            m->int_enable = INT_OFF;
+            break;
+        
+        case 3: // SRQ
+            if (atomic_load(&m->irq_pending) & m->irq_mask) m->zpage[PC]++;
+            break;
+        
+        case 4: // RPR
+            m->zpage[acc] = atomic_load(&m->irq_pending);
+            break;
+        
+        case 5: // RTI
+            m->zpage[PC] = m->zpage[INT_PC];
+            m->df = m->zpage[INT_SF] & 0xFF;
+            m->ib = (m->zpage[INT_SF] & 0xFF00) >> 8;
+            m->if_ = m->ib;
+            m->jump_int_lockout = 0;
+            m->int_enable = INT_DELAY;
+            break;
+        
+        case 6: // ACK
+            atomic_fetch_and(&m->irq_pending, ~((unsigned int) m->zpage[acc]));
+            break;
+        
+        case 7: // SMK
+            m->irq_mask = m->zpage[acc];
+            break;
+    }
+    
+    return cycle;
+}
+
+/*
+ * Predecoded instruction store
+ *
+ * Direct-mapped on the low bits of the fetch address and tagged with the full
+ * field:address, each entry holds the fetched word along with its decoded
+ * fields so that IFETCH can skip both the bus read and the decode. Entries are
+ * invalidated by the bus write snoop. Page 0 is never cached, since the
+ * registers live there and are written without going through the bus.
  */
 
-void cycle_IFETCH(void) {
-    zpage[FLAG] &= 1;
+enum {
+    INS_BASIC, INS_IOT, INS_FIELD, INS_INTR, INS_REGOP, INS_OPR1, INS_OPR2,
+    INS_BREAK // breakpoint, see debug.c
+};
 
-    mar = zpage[PC]++ | ((addr_width_t) if_) << 16;
-    bus_read(mar, &mbr);
-    // printf("%04X %04hX\n", mar, mbr);
+void decode(machine *m, struct predecoded *ins) {
+    ins->opcode = get_mbr_opcode(m);
+    ins->acc = get_mbr_acc(m);
+    ins->i = get_mbr_i(m);
+    ins->z = get_mbr_z(m);
     
-    int opcode = get_mbr_opcode();
-    switch (opcode) {
+    switch (ins->opcode) {
         case 6:
+            if ((m->mbr & 0x3F0) >> 4 == 0b010000) ins->kind = INS_FIELD;
+            else if ((m->mbr & 0x3F0) >> 4 == 0) ins->kind = INS_INTR;
+            else ins->kind = INS_IOT;
+            ins->class = PERF_IOT;
+            break;
+        
+        case 7:
+            if (get_mbr_opr_regop(m) && get_mbr_opr_gr(m)) {
+                ins->kind = INS_REGOP;
+                ins->class = PERF_REGOP;
+            } else if (!get_mbr_opr_gr(m)) {
+                ins->kind = INS_OPR1;
+                ins->class = PERF_OPR1;
+            } else {
+                ins->kind = INS_OPR2;
+                ins->class = PERF_OPR2;
+            }
+            break;
+        
+        default:
+            ins->kind = INS_BASIC;
+            
+            // register forms, as told apart in cycle_IFETCH
+            if (ins->z && (m->mbr & offset_mask) <= PC
+                && (ins->opcode <= 3 ? !ins->i
+                    : ins->i || (ins->opcode == 5 && ins->acc)))
+                ins->class = PERF_REGFORM;
+            else ins->class = PERF_BASIC;
+    }
+    
+    return;
+}
+
+/*
+ * Read the instruction at src into mbr and return its decoded form, from the
+ * store if possible
+ */
+
+struct predecoded *fetch(machine *m, addr_width_t src) {
+    struct predecoded *ins = &m->uncached;
+    
+    if (!(m->options & OPT_PREDECODE) || !(src >> offset_width)) {
+        bus_read(m, src, &m->mbr);
+        decode(m, ins);
+    }
+    
+    else {
+        ins = &m->predecode[src & (PREDECODE_SIZE - 1)];
+        
+        if (ins->valid && ins->tag == src) {
+            m->mbr = ins->word;
+            return ins;
+        }
+        
+        if (bus_read(m, src, &m->mbr)) { // don't remember failed reads
+            ins = &m->uncached;
+            decode(m, ins);
+        }
+        
+        else {
+            decode(m, ins);
+            ins->tag = src;
+            ins->word = m->mbr;
+            ins->valid = 1;
+        }
+    }
+    
+    if (m->debug.n_breaks && debug_break(m, src)) ins->kind = INS_BREAK;
+    
+    return ins;
+}
+
+void predecode_snoop(machine *m, addr_width_t dst) {
+    struct predecoded *ins = &m->predecode[dst & (PREDECODE_SIZE - 1)];
+    if (ins->tag == dst) ins->valid = 0;
+}
+
+void predecode_flush(machine *m) {
+    for (size_t x = 0; x < PREDECODE_SIZE; x++) m->predecode[x].valid = 0;
+}
+
+/*
+ * Bus write snoop, keeps the predecoded store and translated blocks coherent
+ */
+
+void cpu_snoop(machine *m, addr_width_t dst) {
+    predecode_snoop(m, dst);
+    xlat_snoop(m, dst);
+}
+
+/*
+ * Range snoop, as cpu_snoop for every word of a run within one page but
+ * bumping the page's block generation once
+ */
+
+void cpu_snoop_range(machine *m, addr_width_t dst, size_t count) {
+    for (size_t x = 0; x < count; x++) predecode_snoop(m, dst + x);
+    xlat_snoop(m, dst);
+}
+
+/*
+ * Idle loop detection
+ *
+ * A skip IOT that doesn't skip, followed by a JMP straight back to it, can do
+ * nothing but go round again until the device's status changes. IFETCH arms
+ * the detector on every skip IOT; run() checks the next instruction and, if it
+ * closes such a loop, sleeps until a device event instead. No cycles are
+ * counted for the sleep, since how many turns the loop would have made
+ * depends on nothing but host timing, but an estimate of them, the host time
+ * slept at the rate the run has kept up while awake, is added to idle_slept.
+ * With device events queued (see sched.c) there is nothing to sleep for, and
+ * the loop is skipped through in virtual time instead, see idle_skip; those
+ * cycles are counted as usual, and in idle_cycles too.
+ *
+ * Other loops that only poll a device, with more than the JMP between the
+ * skip and the IOT, aren't detected and are run in full.
+ */
+
+#define IDLE_LOOP_CYCLES 3 // IFETCH and IOWAIT for the IOT, IFETCH for the JMP
+
+/*
+ * Returns nonzero if the instruction at src is a JMP to idle_pc
+ */
+
+int jmp_back(machine *m, addr_width_t src) {
+    data_width_t word;
+    addr_width_t target;
+    
+    if (bus_read(m, src, &word)) return 0;
+    if ((word & 0xFE00) != 0xA000 || m->ib != m->if_) return 0; // JMP, no I
+    
+    if (!(word & 0x0100)) target = (word & offset_mask)
+        | ((data_width_t) (src + 1) & ~offset_mask);
+    else if ((word & offset_mask) > PC) target = (word & offset_mask)
+        | ((addr_width_t) m->zp) << offset_width;
+    else return 0; // MOV
+    
+    return target == (m->idle_pc & 0xFFFF);
+}
+
+/*
+ * The loop can only end at a queued event, so skip whole turns of it up to
+ * the last one that finishes before the next event or the end of the budget.
+ * The rest are run for real, so the event fires on the same cycle as it would
+ * have if none were skipped. Returns the number of cycles skipped.
+ */
+
+unsigned int idle_skip(machine *m, unsigned int cycles) {
+    unsigned long long gap = sched_next(&m->sched) - m->sched.now;
+    
+    if (atomic_load(&m->dev_event) != m->idle_event) return 0; // just fired
+    if (int_due(m) || m->debug.n_breaks || m->trace.ring != NULL) return 0;
+    
+    if (m->budget && m->budget - cycles < gap) gap = m->budget - cycles;
+    if (UINT_MAX - cycles < gap) gap = UINT_MAX - cycles;
+    
+    return (gap - 1) - (gap - 1) % IDLE_LOOP_CYCLES;
+}
+
+/*
+ * Called by run() at the instruction after a skip IOT. Returns the number of
+ * cycles skipped through, 0 if slept.
+ */
+
+unsigned int idle(machine *m, volatile int *running, unsigned int cycles) {
+    addr_width_t pc = m->zpage[PC] | ((addr_width_t) m->if_) << 16;
+    m->idle_armed = 0;
+    
+    if (!(m->options & OPT_IDLE) || pc != m->idle_pc + 1 || !jmp_back(m, pc)) return 0;
+    
+    if (m->sched.devices) {
+        unsigned int skipped = idle_skip(m, cycles);
+        m->idle_cycles += skipped;
+        return skipped;
+    }
+    
+    if (m->options & OPT_DETERMINISTIC) return 0; // sleeping takes host time
+    
+    struct timespec before, after;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    
+    pthread_mutex_lock(&m->io_lock);
+    
+    while (atomic_load(&m->dev_event) == m->idle_event && *running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 50000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        
+        pthread_cond_timedwait(&m->io_done, &m->io_lock, &deadline);
+    }
+    
+    pthread_mutex_unlock(&m->io_lock);
+    
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    
+    long long slept = (after.tv_sec - before.tv_sec) * 1000000000LL
+        + (after.tv_nsec - before.tv_nsec);
+    long long awake = (before.tv_sec - m->run_start.tv_sec) * 1000000000LL
+        + (before.tv_nsec - m->run_start.tv_nsec) - m->idle_ns;
+    
+    if (awake > 0) m->idle_slept += (double) slept * cycles / awake;
+    m->idle_ns += slept;
+    
+    return 0;
+}
+
+/*
+ * Cycle 0: IFETCH
+ */
+
+void cycle_IFETCH(machine *m, struct ucycle *u) {
+    if (m->trace.ring != NULL) {
+        ucycle_store(m, u); // the last instruction's, see trace_retire
+        trace_retire(m);
+    }
+    
+    u->cycle = 0;
+    u->acc = 0;
+    u->tmp = 0;
+    u->id = 0;
+    u->ex = 0;
+    
+    if (m->int_enable == INT_DELAY) m->int_enable = INT_ON;
+    else if (m->int_enable == INT_ON && !m->jump_int_lockout
+        && (atomic_load(&m->irq_pending) & m->irq_mask)) interrupt(m);
+
+    m->mar = m->zpage[PC]++ | ((addr_width_t) m->if_) << 16;
+    struct predecoded *ins = fetch(m, m->mar);
+    
+    if (m->trace.ring != NULL) {
+        m->trace.next.pc = m->mar;
+        m->trace.next.word = m->mbr;
+        m->trace.pending = 1;
+    }
+    
+    PERF(m->perf.insns[ins->class]++);
+    
+dispatch:;
+    int opcode = ins->opcode;
+    switch (ins->kind) {
+        case INS_BREAK:
+            if (m->mar != m->debug.skip) {
+                PERF(m->perf.insns[ins->class]--);
+                debug_hit(m);
+                u->cycle = 0xF;
+                return;
+            }
+            
+            m->debug.skip = DEBUG_NONE; // resuming from it, run it as usual
+            ins = &m->uncached;
+            decode(m, ins);
+            goto dispatch;
+        
+        case INS_INTR:
+            u->acc = ins->acc;
+            u->cycle = int_iot(m, u->acc, m->mbr & 0x7);
+            break;
+        
+        case INS_IOT:
+        case INS_FIELD:
             // IOT
-            mar = (mbr & 0x3F0) >> 4;
-            set_flag_tmp(mbr & 0x7);
-            set_flag_acc(get_mbr_acc());
+            m->mar = (m->mbr & 0x3F0) >> 4;
+            u->tmp = m->mbr & 0x7;
+            u->acc = ins->acc;
             
-            if (mar == 0b010000) { // SZP, SDF, SIB, SDI, LZP, LDF, LIF, LDI
+            if (ins->kind == INS_FIELD) { // SZP, SDF, SIB, SDI, LZP, LDF, LIF, LDI
             	uint16_t field;
-            	if (!(mbr & 0x8)) field = zpage[get_flag_acc()];
-            	else field = get_flag_acc() | (get_flag_acc() << 8);
+            	if (!(m->mbr & 0x8)) field = m->zpage[u->acc];
+            	else field = u->acc | (u->acc << 8);
             	
-            	switch (get_flag_tmp()) {
+            	switch (u->tmp) {
             		case 0: // Set Zero Page
-            			zp = field & 0xFF;
+            			m->zp = field & 0xFF;
             			break;
             	
             		case 1: // Set Data Field
-            			df = field & 0xFF;
+            			m->df = field & 0xFF;
             			break;
             		
             		case 2: // Set Instruction Buffer
-            			ib = field & 0xFF;
-            			jump_int_lockout = 1;
+            			m->ib = field & 0xFF;
+            			m->jump_int_lockout = 1;
             			break;
             		
             		case 3: // Set Data Field, Instruction Buffer
-            			df = field & 0xFF;
-            			ib = (field & 0xFF00) >> 8;
-            			jump_int_lockout = 1;
+            			m->df = field & 0xFF;
+            			m->ib = (field & 0xFF00) >> 8;
+            			m->jump_int_lockout = 1;
             			break;
             		
             		case 4: // Load Zero Page
-            			zpage[get_flag_acc()] = zp;
+            			m->zpage[u->acc] = m->zp;
             			break;
             			
             		case 5: // Load Data Field
-            			zpage[get_flag_acc()] = df;
+            			m->zpage[u->acc] = m->df;
             			break;
             			
             		case 6: // Load Instruction Field
-            			zpage[get_flag_acc()] = if_;
+            			m->zpage[u->acc] = m->if_;
             			break;
             			
             		case 7: // Load Data Field, Instruction Field
-            			zpage[get_flag_acc()] = df;
-            			zpage[get_flag_acc()] |= if_ << 8;
+            			m->zpage[u->acc] = m->df;
+            			m->zpage[u->acc] |= m->if_ << 8;
             			break;
             	}
             }
             
             else {
-            	zpage[FLAG] |= 1 << IO;
-            	set_flag_cycle(4);
+            	if (u->tmp == 1) { // skip IOT, may be an idle loop
+            		m->idle_pc = (data_width_t) (m->zpage[PC] - 1)
+            			| ((addr_width_t) m->if_) << 16;
+            		m->idle_event = atomic_load(&m->dev_event);
+            		m->idle_armed = 1;
+            	}
             	
-            	if (bus_attn(mar, get_flag_tmp())) {
-                	zpage[FLAG] &= ~(1 << IO);
-                	set_flag_cycle(0);
+            	// for the device, which reads AccSel; nothing can be clearing
+            	// Io before it is called
+            	u->cycle = 4;
+            	m->zpage[FLAG] = (m->zpage[FLAG] & 1 << LK) | 1 << IO
+            	    | ucycle_flag(u);
+            	
+            	if (bus_attn(m, m->mar, u->tmp)) {
+                	m->zpage[FLAG] &= ~(1 << IO);
+                	u->cycle = 0;
                 }
             }
             
             break;
         
-        case 7:
-            // OPR
-            if (get_mbr_opr_regop() && get_mbr_opr_gr()) { // Reg-reg operation
-                set_flag_acc(get_mbr_acc());
-                reg_op();
-            }
-            else if (!get_mbr_opr_gr()) { // OPR1
-                set_flag_acc(get_mbr_acc());
-                opr1(mbr & offset_mask);
-            }
-            else if (get_mbr_opr_gr()) { // OPR2
-                set_flag_acc(get_mbr_acc());
-                opr2(mbr & offset_mask);
-            }
-            
+        case INS_REGOP: // Reg-reg operation
+            u->acc = ins->acc;
+            reg_op(m, u->acc);
+            break;
+        
+        case INS_OPR1:
+            u->acc = ins->acc;
+            opr1(m, u->acc, m->mbr & offset_mask);
+            break;
+        
+        case INS_OPR2:
+            u->acc = ins->acc;
+            if (opr2(m, u->acc, m->mbr & offset_mask)) u->cycle = 0xF;
             break;
         
         default:
             // Basic instruction
-            set_flag_tmp(opcode);
-            set_flag_acc(get_mbr_acc());
+            u->tmp = opcode;
+            u->acc = ins->acc;
             
-            int zero = get_mbr_z();
-            int indirect = get_mbr_i() << ID;
+            int zero = ins->z;
+            int indirect = ins->i;
             
             data_width_t cmp_val = 0;
             
-            mar = address(zero, mbr & offset_mask);
-            if (opcode <= 3 && zero && !indirect && mar <= PC) {
+            m->mar = address(m, zero, m->mbr & offset_mask);
+            if (opcode <= 3 && zero && !indirect && m->mar <= PC) {
                 int result;
                 switch (opcode) {
                     case 0: // ANDR
-                        zpage[get_flag_acc()] &= zpage[mar];
+                        m->zpage[u->acc] &= m->zpage[m->mar];
                         break;
                     case 1: // TADR
-                        result = (int) zpage[get_flag_acc()] + (int) zpage[mar];                        
-                        if (result & ~(0xFFFF)) zpage[FLAG] ^= 1 << LK; // carry complement
-                        zpage[get_flag_acc()] = (data_width_t) (result & 0xFFFF);
+                        result = (int) m->zpage[u->acc] + (int) m->zpage[m->mar];                        
+                        if (result & ~(0xFFFF)) m->zpage[FLAG] ^= 1 << LK; // carry complement
+                        m->zpage[u->acc] = (data_width_t) (result & 0xFFFF);
                         break;
                     case 2: // ISZR
-                        result = ++zpage[mar];
+                        result = ++m->zpage[m->mar];
                         
-                        if (get_flag_acc()) cmp_val = zpage[get_flag_acc()]; // ISE
+                        if (u->acc) cmp_val = m->zpage[u->acc]; // ISE
                         
-                        if (result == cmp_val) zpage[PC]++;
+                        if (result == cmp_val) m->zpage[PC]++;
                         break;
                     case 3: // DCAR
-                        zpage[mar] = zpage[get_flag_acc()];
-                        zpage[get_flag_acc()] = 0;
+                        m->zpage[m->mar] = m->zpage[u->acc];
+                        m->zpage[u->acc] = 0;
                         break;
                 }
             }
             
             else if (opcode >= 4 && zero && indirect
-                && mar <= PC && (opcode == 4 || !get_flag_acc())) { // JMSR, JMPR
+                && m->mar <= PC && (opcode == 4 || !u->acc)) { // JMSR, JMPR
                 
-                addr_width_t jmp_addr = (010 <= mar && PC >= mar)
-                    ? zpage[mar]++ 
-                    : zpage[mar];
-                if (opcode == 4) zpage[get_flag_acc()] = zpage[PC];
-                zpage[PC] = jmp_addr;
+                addr_width_t jmp_addr = (010 <= m->mar && PC >= m->mar)
+                    ? m->zpage[m->mar]++ 
+                    : m->zpage[m->mar];
+                if (opcode == 4) m->zpage[u->acc] = m->zpage[PC];
+                m->zpage[PC] = jmp_addr;
                 
-                if_ = ib;
-                jump_int_lockout = 0;
+                m->if_ = m->ib;
+                m->jump_int_lockout = 0;
             }
             
             else if ((opcode == 4 && !indirect)
-                || (opcode == 5 && !indirect && !get_flag_acc())) { // JMS, JMP
+                || (opcode == 5 && !indirect && !u->acc)) { // JMS, JMP
                 
-                if (opcode == 4) zpage[get_flag_acc()] = zpage[PC];
-                zpage[PC] = (data_width_t) mar;
+                if (opcode == 4) m->zpage[u->acc] = m->zpage[PC];
+                m->zpage[PC] = (data_width_t) m->mar;
                 
-                if_ = ib;
-                jump_int_lockout = 0;
+                m->if_ = m->ib;
+                m->jump_int_lockout = 0;
             }
             
             else if (opcode == 5 && !indirect && zero
-            	&& mar <= PC && get_flag_acc()) { // MOV
-            	zpage[get_flag_acc()] = zpage[mar];
+            	&& m->mar <= PC && u->acc) { // MOV
+            	m->zpage[u->acc] = m->zpage[m->mar];
             }
             
             else {
-                zpage[FLAG] |= 1 << EX;
+                u->ex = 1;
                 
                 if (indirect) {
-                    if (mar < PC)
-                        mar = ((010 <= mar && PC >= mar)
-                            ? zpage[mar]++ 
-                            : zpage[mar])
-                            | ((addr_width_t) df) << 16;
-                    else if (mar == PC)
-                    	mar = zpage[PC]++ | ((addr_width_t) if_) << 16;
-                    else zpage[FLAG] |= 1 << ID;
+                    if (m->mar < PC)
+                        m->mar = ((010 <= m->mar && PC >= m->mar)
+                            ? m->zpage[m->mar]++ 
+                            : m->zpage[m->mar])
+                            | ((addr_width_t) m->df) << 16;
+                    else if (m->mar == PC)
+                    	m->mar = m->zpage[PC]++ | ((addr_width_t) m->if_) << 16;
+                    else u->id = 1;
                 }
             }
     }
     
-    if ((zpage[FLAG] >> ID) & 1) set_flag_cycle(2);
-    else if ((zpage[FLAG] >> EX) & 1) set_flag_cycle(3);
-    else if ((zpage[FLAG] >> OP) & 1) set_flag_cycle(5);
+    if (u->id) u->cycle = 2;
+    else if (u->ex) u->cycle = 3;
     
     return;
 }
@@ -558,20 +993,20 @@ void cycle_IFETCH(void) {
  * Cycle 2: INADDR
  */
 
-void cycle_INADDR(void) {
-    if (mar < PC)
-        mar = ((010 <= mar && PC >= mar)
-            ? zpage[mar]++ 
-            : zpage[mar])
-            | ((addr_width_t) df) << 16;
-    else if (mar == PC)
-        mar = zpage[PC]++ | ((addr_width_t) if_) << 16;
+void cycle_INADDR(machine *m, struct ucycle *u) {
+    if (m->mar < PC)
+        m->mar = ((010 <= m->mar && PC >= m->mar)
+            ? m->zpage[m->mar]++ 
+            : m->zpage[m->mar])
+            | ((addr_width_t) m->df) << 16;
+    else if (m->mar == PC)
+        m->mar = m->zpage[PC]++ | ((addr_width_t) m->if_) << 16;
     else {
-        bus_read(mar, &mbr);
-        mar = ((addr_width_t) mbr) | ((addr_width_t) df) << 16;
+        bus_read(m, m->mar, &m->mbr);
+        m->mar = ((addr_width_t) m->mbr) | ((addr_width_t) m->df) << 16;
     }
     
-    set_flag_cycle(3);
+    u->cycle = 3;
     
     return;
 }
@@ -580,108 +1015,115 @@ void cycle_INADDR(void) {
  * Cycle 3: EXEC
  */
 
-int local_read(addr_width_t src, data_width_t *dst) {
+int local_read(machine *m, addr_width_t src, data_width_t *dst) {
+    struct bus_page *page;
+    
     if (src <= PC) {
-        *dst = zpage[src];
+        *dst = m->zpage[src];
+        return 0;
+    } else if ((page = bus_page(&m->bus, src >> offset_width)) != NULL
+        && page->ram != NULL) {
+        PERF(page->reads++);
+        *dst = page->ram[src & offset_mask];
         return 0;
     } else {
-        return bus_read(src, dst);
+        return bus_read(m, src, dst);
     }
 }
 
-int local_write(addr_width_t dst, data_width_t src) {
+int local_write(machine *m, addr_width_t dst, data_width_t src) {
     if (dst <= PC) {
-        zpage[dst] = src;
+        m->zpage[dst] = src;
         return 0;
     } else {
-        return bus_write(dst, src);
+        return bus_write(m, dst, src);
     }
 }
 
-void cycle_EXEC(void) {
-    int acc = get_flag_acc();
+void cycle_EXEC(machine *m, struct ucycle *u) {
+    int acc = u->acc;
     
-    switch (get_flag_tmp()) {
+    switch (u->tmp) {
         case 0:
             // AND
-            local_read(mar, &mbr);
+            local_read(m, m->mar, &m->mbr);
             
-            mbr = zpage[acc] & mbr;
-            zpage[FLAG] &= ~(1 << ID); // writeback to accumulator
-            zpage[get_flag_acc()] = mbr;
+            m->mbr = m->zpage[acc] & m->mbr;
+            u->id = 0; // writeback to accumulator
+            m->zpage[acc] = m->mbr;
             break;
         
         case 1:
             // TAD
-            local_read(mar, &mbr);
+            local_read(m, m->mar, &m->mbr);
             
-            int result = (int) zpage[acc] + (int) mbr;
-            mbr = (data_width_t) (result & 0xFFFF);
+            int result = (int) m->zpage[acc] + (int) m->mbr;
+            m->mbr = (data_width_t) (result & 0xFFFF);
             
-            if (result & ~(0xFFFF)) zpage[FLAG] ^= 1 << LK; // carry complement
+            if (result & ~(0xFFFF)) m->zpage[FLAG] ^= 1 << LK; // carry complement
             
-            zpage[FLAG] &= ~(1 << ID); // writeback to accumulator
-            zpage[get_flag_acc()] = mbr;
+            u->id = 0; // writeback to accumulator
+            m->zpage[acc] = m->mbr;
             break;
 
         case 2:
             // ISZ/STA
             
             if (acc) { // STA
-                mbr = zpage[acc];
-                local_write(mar, mbr);
-                zpage[FLAG] &= ~(1 << ID);
+                m->mbr = m->zpage[acc];
+                local_write(m, m->mar, m->mbr);
+                u->id = 0;
             }
             
             else { // ISZ
-                local_read(mar, &mbr);
-                mbr++;
+                local_read(m, m->mar, &m->mbr);
+                m->mbr++;
                 
-                if (mbr == 0) zpage[PC]++;
+                if (m->mbr == 0) m->zpage[PC]++;
                 
-                if (mar <= PC) { // contents in register, no deferral needed
-                    zpage[mar]++;
-                    zpage[FLAG] &= ~(1 << ID);
+                if (m->mar <= PC) { // contents in register, no deferral needed
+                    m->zpage[m->mar]++;
+                    u->id = 0;
                 }
-                else zpage[FLAG] |= 1 << ID; // deferred writeback to memory
+                else u->id = 1; // deferred writeback to memory
             }
             
             break;
         
         case 3:
             // DCA
-            mbr = zpage[acc];
-            local_write(mar, mbr);
+            m->mbr = m->zpage[acc];
+            local_write(m, m->mar, m->mbr);
             
-            zpage[FLAG] &= ~(1 << ID); // writeback to accumulator
-            zpage[get_flag_acc()] = 0;
+            u->id = 0; // writeback to accumulator
+            m->zpage[acc] = 0;
             break;
         
         case 4:
             // JMS
-            mbr = zpage[PC];
-            zpage[PC] = (data_width_t) mar;
+            m->mbr = m->zpage[PC];
+            m->zpage[PC] = (data_width_t) m->mar;
 
-            zpage[FLAG] &= ~(1 << ID); // writeback to accumulator
-            zpage[get_flag_acc()] = mbr;
+            u->id = 0; // writeback to accumulator
+            m->zpage[acc] = m->mbr;
             
-            if_ = ib;
-            jump_int_lockout = 0;
+            m->if_ = m->ib;
+            m->jump_int_lockout = 0;
             break;
         
         case 5:
             // JMP/LDA
             
             if (acc) { // LDA
-                local_read(mar, &mbr);
-                zpage[acc] = mbr;
-                zpage[FLAG] &= ~(1 << ID);
+                local_read(m, m->mar, &m->mbr);
+                m->zpage[acc] = m->mbr;
+                u->id = 0;
             }
             else { // JMP
-                zpage[PC] = (data_width_t) mar;
-                zpage[FLAG] &= ~(1 << ID); // writeback to accumulator
-                if_ = ib;
-                jump_int_lockout = 0;
+                m->zpage[PC] = (data_width_t) m->mar;
+                u->id = 0; // writeback to accumulator
+                m->if_ = m->ib;
+                m->jump_int_lockout = 0;
             }
             break;
         
@@ -690,8 +1132,7 @@ void cycle_EXEC(void) {
             printf("Illegal opcode - how?!?\n");
     }
     
-    if ((zpage[FLAG] >> ID) & 1) set_flag_cycle(9);
-    else set_flag_cycle(0);
+    u->cycle = u->id ? 9 : 0;
     
     return;
 }
@@ -700,48 +1141,365 @@ void cycle_EXEC(void) {
  * Cycle 4: IOWAIT
  */
 
-void cycle_IOWAIT(void) {
-    if (!(zpage[FLAG] & (1 << IO))) set_flag_cycle(0);
+void cycle_IOWAIT(machine *m, struct ucycle *u) {
+    if (!(m->zpage[FLAG] & (1 << IO))) u->cycle = 0;
+}
+
+/*
+ * Called by a device when it has finished with the outstanding IOT
+ */
+
+void io_complete(machine *m) {
+    pthread_mutex_lock(&m->io_lock);
+    m->zpage[FLAG] &= ~(1 << IO);
+    pthread_cond_broadcast(&m->io_done);
+    pthread_mutex_unlock(&m->io_lock);
+}
+
+/*
+ * Sleep until the outstanding IOT completes. Wakes up periodically to check
+ * *running, since the SIGINT handler can't signal the condition variable.
+ */
+
+void io_wait(machine *m, volatile int *running) {
+    PERF(struct timespec before);
+    PERF(clock_gettime(CLOCK_MONOTONIC, &before));
+    
+    pthread_mutex_lock(&m->io_lock);
+    
+    while ((m->zpage[FLAG] & (1 << IO)) && *running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 50000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        
+        pthread_cond_timedwait(&m->io_done, &m->io_lock, &deadline);
+    }
+    
+    pthread_mutex_unlock(&m->io_lock);
+    
+    PERF(struct timespec after);
+    PERF(clock_gettime(CLOCK_MONOTONIC, &after));
+    PERF(m->perf.iowait_ns += (after.tv_sec - before.tv_sec) * 1000000000LL
+        + (after.tv_nsec - before.tv_nsec));
 }
 
 /*
  * Cycle 9: WTBACK
  */
 
-void cycle_WTBACK(void) {
-    set_flag_cycle(0);
+void cycle_WTBACK(machine *m, struct ucycle *u) {
+    u->cycle = 0;
 
-    if (zpage[FLAG] & 1 << ID) local_write(mar, mbr);
-    else zpage[get_flag_acc()] = mbr;
+    if (u->id) local_write(m, m->mar, m->mbr);
+    else m->zpage[u->acc] = m->mbr;
     
     return;
 }
 
-void step(void) {
-    switch (get_flag_cycle()) {
+void step(machine *m) {
+    struct ucycle u;
+    ucycle_load(m, &u);
+    
+    switch (u.cycle) {
         case 0:
-            cycle_IFETCH();
+            PERF(m->perf.cycles[PERF_IFETCH]++);
+            cycle_IFETCH(m, &u);
             break;
         case 1:
-            cycle_IFETCH();
+            PERF(m->perf.cycles[PERF_IFETCH]++);
+            cycle_IFETCH(m, &u);
             break;
         case 2:
-            cycle_INADDR();
+            PERF(m->perf.cycles[PERF_INADDR]++);
+            cycle_INADDR(m, &u);
             break;
         case 3:
-            cycle_EXEC();
+            PERF(m->perf.cycles[PERF_EXEC]++);
+            cycle_EXEC(m, &u);
             break;
         case 4:
-            cycle_IOWAIT();
+            PERF(m->perf.cycles[PERF_IOWAIT]++);
+            cycle_IOWAIT(m, &u);
             break;
         case 9:
-            cycle_WTBACK();
+            PERF(m->perf.cycles[PERF_WTBACK]++);
+            cycle_WTBACK(m, &u);
             break;
         default:
             printf("Invalid cycle - how?!?\n");
     }
     
+    ucycle_store(m, &u);
+    
     // printf("%04hX %04hX\n", zpage[7], zpage[15]);
 }
 
+/*
+ * Queue the events that depend on settings made between runs, profiler
+ * samples and input (see profile.c and replay.c), for a run starting now.
+ * Device events already queued are left as they are.
+ *
+ * return unsigned long long: cycle of the first event
+ */
+
+unsigned long long arm_events(machine *m) {
+    profile_arm(m);
+    replay_arm(m);
+
+    return sched_next(&m->sched);
+}
+
+/*
+ * step() with the run engine's bookkeeping around it: the cycle is counted in
+ * m->cycles, and events are fired at instruction boundaries and during WAI
+ * just as run() would fire them, so both give the same timing.
+ */
+
+void step_timed(machine *m) {
+    int cycle = get_flag_cycle(m);
+
+    if (cycle <= 1) m->sched.now = m->cycles;
+    if ((cycle <= 1 || cycle == 4) && m->cycles >= sched_next(&m->sched))
+        sched_run(m, m->cycles);
+
+    step(m);
+    m->cycles++;
+}
+
+/*
+ * Cycles from base to event at, as run() counts them
+ */
+
+static unsigned int until(unsigned long long at, unsigned long long base) {
+    if (at <= base) return 0;
+
+    return at - base >= UINT_MAX ? UINT_MAX : at - base;
+}
 
+/*
+ * Cycles a translated block may run for from cycles into a run: up to the
+ * next event, so that it fires on the same cycle as it would have without
+ * blocks, and no further than the rest of the budget
+ */
+
+static unsigned int block_limit(machine *m, unsigned int cycles,
+    unsigned int next_event) {
+    unsigned int limit = next_event > cycles ? next_event - cycles : 0;
+
+    if (m->budget && m->budget - cycles < limit)
+        limit = m->budget > cycles ? m->budget - cycles : 0;
+
+    return limit;
+}
+
+/*
+ * Fast run engine
+ *
+ * Runs until halted or until *running is cleared, dispatching straight from
+ * one micro-cycle to the next instead of going back through step(), and
+ * counting micro-cycles and keeping the micro-cycle state in locals. FLAG is
+ * only brought up to date before an IOT (the device reads AccSel), before
+ * events fire (see replay.c) and when the run stops; IOWAIT reads just its Io
+ * bit. Translated blocks are run in place of IFETCH where available, unless
+ * tracing (see trace.c) or profiling (see profile.c), and idle loops are
+ * slept through. The running flag, the cycle budget and events are only
+ * checked at instruction boundaries (the next event's cycle is looked up again
+ * after every IOT, which may have scheduled one), so the machine always stops
+ * in IFETCH or HLT with the same FLAG contents single-stepping would have
+ * produced. The exceptions are a headless machine, which stops in IOWAIT if an
+ * IOT can't complete straight away, and one stopped during WAI while device
+ * events are queued, which skips ahead from event to event rather than
+ * waiting (see sched.c).
+ *
+ * Blocks are cut short at the next event and the end of the budget (see
+ * block_limit), so events and the interrupts they raise land on the same
+ * cycles with or without them, and a replayed log gives the same timing under
+ * g as under s and t; the bench's irq kernel checks this.
+ *
+ * return unsigned int: number of micro-cycles executed
+ */
+
+unsigned int run_loop(machine *m, volatile int *running) {
+    unsigned int cycles = 0;
+    unsigned long long base = m->cycles;
+    unsigned int next_event = until(arm_events(m), base);
+    int blocks = m->options & OPT_BLOCKS && m->trace.ring == NULL
+        && !m->profile.interval;
+    struct ucycle u;
+    
+    m->idle_armed = 0;
+    m->idle_cycles = 0;
+    m->idle_slept = 0;
+    m->idle_ns = 0;
+    clock_gettime(CLOCK_MONOTONIC, &m->run_start);
+    ucycle_load(m, &u);
+
+#ifdef __GNUC__
+    static void *dispatch[16] = {
+        &&ifetch, &&ifetch, &&inaddr, &&exec,
+        &&iowait, &&invalid, &&invalid, &&invalid,
+        &&invalid, &&wtback, &&invalid, &&invalid,
+        &&invalid, &&invalid, &&invalid, &&halt
+    };
+    
+    goto *dispatch[u.cycle];
+    
+ifetch:
+    if (!*running || (m->budget && cycles >= m->budget)) goto stop;
+    m->sched.now = base + cycles;
+    if (cycles >= next_event) {
+        ucycle_store(m, &u);
+        next_event = until(sched_run(m, base + cycles), base);
+    }
+    if (m->idle_armed) cycles += idle(m, running, cycles);
+    if (blocks && !int_due(m)) {
+        unsigned int block_cycles = run_block(m, &u,
+            block_limit(m, cycles, next_event));
+        
+        if (block_cycles) {
+            cycles += block_cycles;
+            PERF(m->perf.cycles[PERF_IFETCH] += block_cycles);
+            goto ifetch;
+        }
+    }
+    cycle_IFETCH(m, &u);
+    cycles++;
+    PERF(m->perf.cycles[PERF_IFETCH]++);
+    goto *dispatch[u.cycle];
+
+inaddr:
+    cycle_INADDR(m, &u);
+    cycles++;
+    PERF(m->perf.cycles[PERF_INADDR]++);
+    goto *dispatch[u.cycle];
+
+exec:
+    cycle_EXEC(m, &u);
+    cycles++;
+    PERF(m->perf.cycles[PERF_EXEC]++);
+    goto *dispatch[u.cycle];
+
+iowait:
+    cycle_IOWAIT(m, &u);
+    cycles++;
+    PERF(m->perf.cycles[PERF_IOWAIT]++);
+    next_event = until(sched_next(&m->sched), base); // the IOT may schedule
+    if (u.cycle == 4) {
+        if (m->sched.devices && next_event != UINT_MAX) {
+            if (!*running || (m->budget && cycles >= m->budget)) goto stop;
+            if (m->budget && next_event > m->budget) {
+                cycles = m->budget; // waits out the rest of the budget
+                goto stop;
+            }
+            if (cycles < next_event) cycles = next_event; // skip to it
+            ucycle_store(m, &u);
+            next_event = until(sched_run(m, base + cycles), base);
+        }
+        else if (m->headless) goto stop;
+        else io_wait(m, running);
+    }
+    goto *dispatch[u.cycle];
+
+wtback:
+    cycle_WTBACK(m, &u);
+    cycles++;
+    PERF(m->perf.cycles[PERF_WTBACK]++);
+    goto *dispatch[u.cycle];
+
+invalid:
+    printf("Invalid cycle - how?!?\n");
+halt:
+stop:
+    ucycle_store(m, &u);
+    return cycles;
+#else
+    while (u.cycle != 0xF) {
+        if (u.cycle <= 1) {
+            if (!*running || (m->budget && cycles >= m->budget)) break;
+            m->sched.now = base + cycles;
+            if (cycles >= next_event) {
+                ucycle_store(m, &u);
+                next_event = until(sched_run(m, base + cycles), base);
+            }
+            if (m->idle_armed)
+                cycles += idle(m, running, cycles);
+            if (blocks && !int_due(m)) {
+                unsigned int block_cycles = run_block(m, &u,
+                    block_limit(m, cycles, next_event));
+                
+                if (block_cycles) {
+                    cycles += block_cycles;
+                    PERF(m->perf.cycles[PERF_IFETCH] += block_cycles);
+                    continue;
+                }
+            }
+        }
+        
+        switch (u.cycle) {
+            case 0:
+            case 1:
+                PERF(m->perf.cycles[PERF_IFETCH]++);
+                cycle_IFETCH(m, &u);
+                break;
+            case 2:
+                PERF(m->perf.cycles[PERF_INADDR]++);
+                cycle_INADDR(m, &u);
+                break;
+            case 3:
+                PERF(m->perf.cycles[PERF_EXEC]++);
+                cycle_EXEC(m, &u);
+                break;
+            case 4:
+                PERF(m->perf.cycles[PERF_IOWAIT]++);
+                cycle_IOWAIT(m, &u);
+                break;
+            case 9:
+                PERF(m->perf.cycles[PERF_WTBACK]++);
+                cycle_WTBACK(m, &u);
+                break;
+            default:
+                printf("Invalid cycle - how?!?\n");
+                goto stop;
+        }
+        cycles++;
+        
+        if (u.cycle == 4) {
+            next_event = until(sched_next(&m->sched), base);
+            if (m->sched.devices && next_event != UINT_MAX) {
+                if (!*running || (m->budget && cycles >= m->budget)) break;
+                if (m->budget && next_event > m->budget) {
+                    cycles = m->budget;
+                    break;
+                }
+                if (cycles < next_event) cycles = next_event;
+                ucycle_store(m, &u);
+                next_event = until(sched_run(m, base + cycles), base);
+            }
+            else if (m->headless) break;
+            else io_wait(m, running);
+        }
+    }
+    
+stop:
+    ucycle_store(m, &u);
+    return cycles;
+#endif
+}
+
+/*
+ * Run the machine with run_loop, leaving the running flag where watchpoints
+ * (see debug.c) can clear it meanwhile
+ */
+
+unsigned int run(machine *m, volatile int *running) {
+    m->running = running;
+    unsigned int cycles = run_loop(m, running);
+    m->running = NULL;
+    m->cycles += cycles;
+    
+    return cycles;
+}
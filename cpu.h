@@ -2,7 +2,6 @@
 #define __CPU_H__
 
 #include "bus.h"
-#include <pthread.h>
 
 #define ID 4
 #define EX 3
@@ -13,15 +12,74 @@
 #define FLAG (PAGE_SIZE + 1)
 #define PC 017
 
-extern int cpu_read(addr_width_t src, data_width_t *dst);
-extern int cpu_write(addr_width_t dst, data_width_t src);
-extern int cpu_attn(size_t unit, data_width_t cmd);
+#define INT_PC 020 // PC saved here on interrupt
+#define INT_SF 021 // fields saved here on interrupt
+#define INT_VEC 022 // and execution continues here
 
-extern data_width_t zpage[PAGE_SIZE + 1];
-extern data_width_t switches;
+/*
+ * Emulator options, settable from the monitor
+ */
 
-extern pthread_mutex_t io_lock;
+#define OPT_PREDECODE 0x1 // cache decoded instructions
+#define OPT_FASTRUN 0x2 // use run() rather than step() for g and c
+#define OPT_BLOCKS 0x4 // run threaded-code blocks in run(), see xlat.c
+#define OPT_IDLE 0x8 // sleep through idle loops in run()
+#define OPT_DETERMINISTIC 0x10 // devices independent of host timing, see replay.c
 
-extern void step(void);
+/*
+ * Predecoded instruction, see cpu.c
+ */
+
+#define PREDECODE_SIZE 4096 // THIS MUST BE A POWER OF TWO
+
+struct predecoded {
+    addr_width_t tag;
+    data_width_t word;
+    uint8_t valid;
+    uint8_t kind;
+    uint8_t class; // for the performance counters, see perf.h
+    uint8_t opcode;
+    uint8_t acc;
+    uint8_t i;
+    uint8_t z;
+};
+
+/*
+ * Micro-cycle state, FLAG's AccSel, Tmp, Cycle, Id and Ex fields as the cycle
+ * functions keep them, see cpu.c
+ */
+
+struct ucycle {
+    int cycle;
+    int acc;
+    int tmp;
+    int id;
+    int ex;
+};
+
+extern int cpu_read(machine *m, addr_width_t src, data_width_t *dst);
+extern int cpu_write(machine *m, addr_width_t dst, data_width_t src);
+extern int cpu_read_block(machine *m, addr_width_t src, data_width_t *dst,
+    size_t count);
+extern int cpu_write_block(machine *m, addr_width_t dst,
+    const data_width_t *src, size_t count);
+extern int cpu_attn(machine *m, size_t unit, data_width_t cmd);
+
+extern int get_flag_acc(machine *m);
+
+extern void io_complete(machine *m);
+extern void device_event(machine *m);
+extern void raise_irq(machine *m, size_t unit);
+extern void io_wait(machine *m, volatile int *running);
+
+extern void predecode_snoop(machine *m, addr_width_t dst);
+extern void predecode_flush(machine *m);
+extern void cpu_snoop(machine *m, addr_width_t dst);
+extern void cpu_snoop_range(machine *m, addr_width_t dst, size_t count);
+
+extern void step(machine *m);
+extern unsigned int run(machine *m, volatile int *running);
+extern unsigned long long arm_events(machine *m);
+extern void step_timed(machine *m);
 
 #endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "xlat.h"
+#include "debug.h"
+#include "machine.h"
+
+/*
+ * Breakpoints and watchpoints
+ *
+ * Neither costs anything on the paths that run every instruction or every
+ * write. A breakpoint is only looked for where an instruction is decoded
+ * afresh: IFETCH's predecode miss path marks the entry as a breakpoint, so
+ * the switch IFETCH already does on the instruction kind stops there, and
+ * the translator ends blocks before one. Setting or clearing a breakpoint
+ * invalidates the predecoded entry and the page's blocks, like a write to it.
+ *
+ * Watchpoints swap the bus write snoop for debug_snoop for as long as there
+ * are any, and remove the range snoop so that block writes and DMA are seen
+ * word by word too. A watched write completes, along with the instruction making it,
+ * and the machine stops at the next instruction boundary by clearing the
+ * running flag of run(). Registers (017 and below) are written without the
+ * bus, so can't be watched.
+ *
+ * Addresses are 24 bits, field << 16 | address.
+ */
+
+/*
+ * Returns nonzero if there is a breakpoint at addr
+ */
+
+int debug_break(machine *m, addr_width_t addr) {
+    for (int x = 0; x < m->debug.n_breaks; x++)
+        if (m->debug.breaks[x] == addr) return 1;
+
+    return 0;
+}
+
+/*
+ * Called by IFETCH on fetching a breakpoint, which then halts. Undoes the
+ * fetch, so that the machine stops with the PC on the breakpoint.
+ */
+
+void debug_hit(machine *m) {
+    m->debug.hit = DEBUG_BREAK;
+    m->debug.hit_addr = m->mar;
+    m->zpage[PC]--;
+    m->trace.pending = 0;
+}
+
+/*
+ * Add a point to a set, or remove it if it is already there. Returns ENOSPC
+ * if the set is full.
+ */
+
+int toggle(addr_width_t *set, int *n, addr_width_t addr) {
+    for (int x = 0; x < *n; x++) {
+        if (set[x] == addr) {
+            set[x] = set[--*n];
+            return 0;
+        }
+    }
+
+    if (*n == DEBUG_POINTS) return ENOSPC;
+
+    set[(*n)++] = addr;
+
+    return 0;
+}
+
+/*
+ * Set or clear a breakpoint
+ *
+ * return int: 0 on success, ENOSPC if there are DEBUG_POINTS already
+ */
+
+int toggle_break(machine *m, addr_width_t addr) {
+    int result = toggle(m->debug.breaks, &m->debug.n_breaks, addr);
+
+    predecode_snoop(m, addr);
+    xlat_snoop(m, addr);
+
+    return result;
+}
+
+/*
+ * Set or clear a watchpoint
+ *
+ * return int: 0 on success, ENOSPC if there are DEBUG_POINTS already
+ */
+
+int toggle_watch(machine *m, addr_width_t addr) {
+    int result = toggle(m->debug.watches, &m->debug.n_watches, addr);
+
+    install_snoop(m, m->debug.n_watches ? debug_snoop : cpu_snoop);
+    install_snoop_range(m, m->debug.n_watches ? NULL : cpu_snoop_range);
+
+    return result;
+}
+
+/*
+ * Bus write snoop while there are watchpoints
+ */
+
+void debug_snoop(machine *m, addr_width_t dst) {
+    cpu_snoop(m, dst);
+
+    for (int x = 0; x < m->debug.n_watches; x++) {
+        if (m->debug.watches[x] != dst) continue;
+
+        m->debug.hit = DEBUG_WATCH;
+        m->debug.hit_addr = dst;
+        if (m->running != NULL) *m->running = 0;
+    }
+}
+
+/*
+ * Called before the machine is run or stepped, so that if it is on a
+ * breakpoint it runs the instruction there rather than stopping again
+ */
+
+void debug_resume(machine *m) {
+    addr_width_t pc = m->zpage[PC] | ((addr_width_t) m->if_) << 16;
+
+    m->debug.skip = debug_break(m, pc) ? pc : DEBUG_NONE;
+    m->debug.hit = 0;
+}
+
+/*
+ * Print what stopped the machine, if a breakpoint or watchpoint did
+ */
+
+void debug_report(machine *m, FILE *f) {
+    if (m->debug.hit == DEBUG_BREAK)
+        fprintf(f, "break %06X\n", m->debug.hit_addr);
+    else if (m->debug.hit == DEBUG_WATCH)
+        fprintf(f, "watch %06X\n", m->debug.hit_addr);
+
+    m->debug.hit = 0;
+}
+
+void debug_list(machine *m, FILE *f) {
+    for (int x = 0; x < m->debug.n_breaks; x++)
+        fprintf(f, "break %06X\n", m->debug.breaks[x]);
+    for (int x = 0; x < m->debug.n_watches; x++)
+        fprintf(f, "watch %06X\n", m->debug.watches[x]);
+}
@@ -0,0 +1,38 @@
+#ifndef __DEBUG_H__
+#define __DEBUG_H__
+
+#include <stdio.h>
+
+#include "bus.h"
+
+/*
+ * Breakpoints and watchpoints, see debug.c
+ */
+
+#define DEBUG_POINTS 16 // of each kind
+#define DEBUG_NONE 0xFFFFFFFF // no address
+
+#define DEBUG_BREAK 1
+#define DEBUG_WATCH 2
+
+struct debug {
+    addr_width_t breaks[DEBUG_POINTS];
+    int n_breaks;
+    addr_width_t watches[DEBUG_POINTS];
+    int n_watches;
+    
+    addr_width_t skip; // breakpoint to run through once, see debug_resume
+    int hit; // what stopped the machine, 0 for neither
+    addr_width_t hit_addr;
+};
+
+extern int debug_break(machine *m, addr_width_t addr);
+extern void debug_hit(machine *m);
+extern int toggle_break(machine *m, addr_width_t addr);
+extern int toggle_watch(machine *m, addr_width_t addr);
+extern void debug_snoop(machine *m, addr_width_t dst);
+extern void debug_resume(machine *m);
+extern void debug_report(machine *m, FILE *f);
+extern void debug_list(machine *m, FILE *f);
+
+#endif
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "sched.h"
+#include "disk.h"
+#include "machine.h"
+
+/*
+ * Disk
+ *
+ * Unit 4 moves whole runs of words between a host file and memory, without
+ * the CPU. The file is an array of DISK_SECTOR word sectors, in host byte
+ * order as images are, and its size is the size of the disk. A transfer is
+ * described by a command block of four words in the data field, at the
+ * address in the accumulator of the IOT that starts it:
+ *
+ *   +0 field of the buffer
+ *   +1 address of the buffer in that field
+ *   +2 words to transfer, 0 for 65536
+ *   +3 first sector
+ *
+ * The IOTs are:
+ * 1 DSF - skip if the done flag is set
+ * 2 DCL - clear the done and error flags
+ * 3 DRS - read status into accumulator (DISK_DONE, DISK_ERROR, DISK_BUSY,
+ *         DISK_NONE)
+ * 4 DRD - start reading from the disk into memory
+ * 5 DWR - start writing from memory to the disk
+ *
+ * and all of them complete at once. A transfer sets the done flag when it has
+ * finished, along with the error flag if it failed, and raises the unit's
+ * interrupt; one with nothing attached or outside the disk or RAM fails
+ * straight away. One started while another is in flight is refused: it only
+ * sets the error flag, and the done flag and interrupt are left to the
+ * transfer in flight, so the guest doesn't go on to use its buffer early.
+ *
+ * Starting a transfer resolves the buffer to the host RAM pages behind it,
+ * giving pages their own memory where they are to be written (see dma_ptr),
+ * and splits it into jobs of up to DISK_JOB_WORDS, each a single preadv or
+ * pwritev on an iovec pointing straight at those pages. A pool of
+ * DISK_WORKERS threads carries the jobs out side by side, so the guest runs
+ * on while the transfer is under way, and the last job to finish sets the
+ * flags. The predecoded store and translated blocks are invalidated over the
+ * buffer when the transfer starts, so the guest must not run code from it
+ * before the done flag is set.
+ *
+ * On the scheduled model (see sched.c) the jobs are carried out there and
+ * then, on the CPU's thread, and the flags are set by an event
+ * DISK_SEEK_CYCLES plus DISK_WORD_CYCLES per word later, so that the guest
+ * sees the same timing on every run.
+ */
+
+/*
+ * Returns nonzero if the disk runs on the scheduled model
+ */
+
+int disk_scheduled(machine *m) {
+    return m->disk.scheduled || m->options & OPT_DETERMINISTIC;
+}
+
+void init_disk(machine *m) {
+    struct disk *d = &m->disk;
+
+    d->fd = -1;
+    atomic_init(&d->done, 0);
+    atomic_init(&d->error, 0);
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->wake, NULL);
+    pthread_cond_init(&d->idle, NULL);
+
+    d->finish.device = 1;
+}
+
+void free_disk(machine *m) {
+    struct disk *d = &m->disk;
+
+    disk_detach(m);
+
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->wake);
+    pthread_cond_destroy(&d->idle);
+}
+
+/*
+ * Carry out one job
+ *
+ * return int: 0 on success, errno value if the file couldn't be read or
+ * written
+ */
+
+int disk_io(int fd, struct disk_job *job) {
+    struct iovec *iov = job->iov;
+    int n_iov = job->n_iov;
+    off_t offset = job->offset;
+
+    while (n_iov) {
+        ssize_t moved = job->write ? pwritev(fd, iov, n_iov, offset)
+            : preadv(fd, iov, n_iov, offset);
+
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved < 0) return errno;
+        if (moved == 0) return EIO; // the file has shrunk under us
+
+        offset += moved;
+
+        while (n_iov && (size_t) moved >= iov->iov_len) {
+            moved -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+
+        if (n_iov) { // part way through a page
+            iov->iov_base = (uint8_t *) iov->iov_base + moved;
+            iov->iov_len -= moved;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Set the flags at the end of a transfer
+ */
+
+void disk_complete(machine *m, int failed) {
+    struct disk *d = &m->disk;
+
+    if (failed) atomic_store(&d->error, 1);
+    atomic_store(&d->done, 1);
+
+    raise_irq(m, DISK);
+}
+
+/*
+ * Scheduled model's event, at the end of a transfer
+ */
+
+void disk_finish(machine *m, unsigned long long now) {
+    disk_complete(m, m->disk.failed);
+}
+
+/*
+ * Worker thread, vargp is the machine
+ */
+
+void *disk_worker(void *vargp) {
+    machine *m = (machine *) vargp;
+    struct disk *d = &m->disk;
+
+    pthread_mutex_lock(&d->lock);
+
+    while (1) {
+        while (d->run && d->next_job == d->n_jobs)
+            pthread_cond_wait(&d->wake, &d->lock);
+
+        if (!d->run) break;
+
+        struct disk_job *job = &d->jobs[d->next_job++];
+
+        pthread_mutex_unlock(&d->lock);
+        int result = disk_io(d->fd, job);
+        pthread_mutex_lock(&d->lock);
+
+        if (result) d->failed = 1;
+
+        if (!--d->pending) {
+            disk_complete(m, d->failed);
+            pthread_cond_broadcast(&d->idle);
+        }
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+/*
+ * Attach a host file as the disk, replacing whatever was attached
+ *
+ * return int: 0 on success, EINVAL if its size isn't a whole number of words,
+ * errno value if it can't be opened or the workers can't be started
+ */
+
+int disk_attach(machine *m, const char *path) {
+    struct disk *d = &m->disk;
+    struct stat st;
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0) return errno;
+
+    if (fstat(fd, &st)) {
+        int result = errno;
+        close(fd);
+        return result;
+    }
+
+    if (st.st_size % sizeof(data_width_t)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    disk_detach(m);
+
+    d->fd = fd;
+    d->size = st.st_size;
+    d->run = 1;
+    d->n_jobs = d->next_job = d->pending = 0;
+
+    for (d->n_workers = 0; d->n_workers < DISK_WORKERS; d->n_workers++) {
+        int result = pthread_create(&d->workers[d->n_workers], NULL,
+            disk_worker, (void *) m);
+
+        if (result) {
+            disk_detach(m);
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Detach the disk once any transfer in flight has finished, and stop its
+ * workers
+ */
+
+void disk_detach(machine *m) {
+    struct disk *d = &m->disk;
+    if (d->fd < 0) return;
+
+    disk_drain(m);
+
+    pthread_mutex_lock(&d->lock);
+    d->run = 0;
+    pthread_cond_broadcast(&d->wake);
+    pthread_mutex_unlock(&d->lock);
+
+    for (int x = 0; x < d->n_workers; x++) pthread_join(d->workers[x], NULL);
+
+    d->n_workers = 0;
+    close(d->fd);
+    d->fd = -1;
+}
+
+/*
+ * Wait for the transfer in flight, if any, to finish. A scheduled transfer's
+ * data has already been moved, and only its flags wait for the event.
+ */
+
+void disk_drain(machine *m) {
+    struct disk *d = &m->disk;
+
+    pthread_mutex_lock(&d->lock);
+    while (d->pending) pthread_cond_wait(&d->idle, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * Split a transfer into jobs over the RAM pages of the buffer, leaving them
+ * for the caller to hand to the workers or carry out
+ *
+ * return int: 0 on success, EINVAL if the buffer isn't all RAM or the
+ * transfer goes past the end of the disk
+ */
+
+int disk_plan(machine *m, const data_width_t *block, int write,
+    size_t *n_jobs) {
+
+    struct disk *d = &m->disk;
+    addr_width_t addr = (addr_width_t) (block[0] & 0xFF) << 16 | block[1];
+    size_t count = block[2] ? block[2] : 65536;
+    off_t offset = (off_t) block[3] * DISK_SECTOR * sizeof(data_width_t);
+
+    if (offset + (off_t) (count * sizeof(data_width_t)) > d->size)
+        return EINVAL;
+    if (addr + count > (addr_width_t) MAX_PAGES * PAGE_SIZE) return EINVAL;
+
+    *n_jobs = 0;
+
+    for (size_t x = 0; x < count; ) {
+        struct disk_job *job = &d->jobs[(*n_jobs)++];
+        size_t end = x + DISK_JOB_WORDS < count ? x + DISK_JOB_WORDS : count;
+
+        job->offset = offset + x * sizeof(data_width_t);
+        job->write = write;
+        job->n_iov = 0;
+
+        while (x < end) {
+            data_width_t *ram = dma_ptr(m, addr + x, !write);
+            size_t len = PAGE_SIZE - ((addr + x) & (PAGE_SIZE - 1));
+
+            if (ram == NULL) return EINVAL;
+            if (len > end - x) len = end - x;
+
+            job->iov[job->n_iov].iov_base = ram;
+            job->iov[job->n_iov++].iov_len = len * sizeof(data_width_t);
+            x += len;
+        }
+    }
+
+    if (!write) bus_snoop(m, addr, count);
+
+    d->transfers++;
+    d->words += count;
+
+    return 0;
+}
+
+/*
+ * Returns nonzero if a transfer is in flight
+ */
+
+int disk_busy(machine *m) {
+    struct disk *d = &m->disk;
+
+    pthread_mutex_lock(&d->lock);
+    int busy = d->pending || d->finish.slot;
+    pthread_mutex_unlock(&d->lock);
+
+    return busy;
+}
+
+/*
+ * Start a transfer from the command block the IOT's accumulator points to
+ */
+
+void disk_start(machine *m, int write) {
+    struct disk *d = &m->disk;
+    data_width_t block[4];
+    addr_width_t at = m->zpage[get_flag_acc(m)];
+    size_t n_jobs;
+
+    if (disk_busy(m)) {
+        atomic_store(&d->error, 1);
+        return;
+    }
+
+    // the block wraps around within the data field
+    size_t first = 0x10000 - at < 4 ? 0x10000 - at : 4;
+
+    if (bus_read_block(m, (addr_width_t) m->df << 16 | at, block, first)
+        || bus_read_block(m, (addr_width_t) m->df << 16, &block[first],
+        4 - first)) {
+        disk_complete(m, 1);
+        return;
+    }
+
+    atomic_store(&d->done, 0);
+    atomic_store(&d->error, 0);
+    d->failed = 0;
+
+    if (d->fd < 0 || disk_plan(m, block, write, &n_jobs)) {
+        disk_complete(m, 1);
+        return;
+    }
+
+    if (disk_scheduled(m)) {
+        for (size_t x = 0; x < n_jobs && !d->failed; x++)
+            if (disk_io(d->fd, &d->jobs[x])) d->failed = 1;
+
+        d->finish.fire = disk_finish;
+        if (schedule(m, &d->finish, m->sched.now + DISK_SEEK_CYCLES
+            + (block[2] ? block[2] : 65536) * DISK_WORD_CYCLES))
+            disk_complete(m, d->failed); // no room in the queue, done already
+
+        return;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    d->n_jobs = n_jobs;
+    d->next_job = 0;
+    d->pending = n_jobs;
+    pthread_cond_broadcast(&d->wake);
+    pthread_mutex_unlock(&d->lock);
+}
+
+int disk_attn(machine *m, size_t unit, data_width_t cmd) {
+    struct disk *d = &m->disk;
+
+    switch (cmd) {
+        case 0x1: // DSF
+            if (atomic_load(&d->done)) m->zpage[PC]++;
+            break;
+        case 0x2: // DCL
+            atomic_store(&d->done, 0);
+            atomic_store(&d->error, 0);
+            break;
+        case 0x3: // DRS
+            m->zpage[get_flag_acc(m)] = (atomic_load(&d->done) ? DISK_DONE : 0)
+                | (atomic_load(&d->error) ? DISK_ERROR : 0)
+                | (disk_busy(m) ? DISK_BUSY : 0)
+                | (d->fd < 0 ? DISK_NONE : 0);
+            break;
+        case 0x4: // DRD
+        case 0x5: // DWR
+            disk_start(m, cmd == 0x5);
+            break;
+    }
+
+    io_complete(m);
+
+    return 0;
+}
+
+/*
+ * Print the disk's size in sectors, then the transfers and words moved so far
+ */
+
+void disk_show(machine *m, FILE *f) {
+    struct disk *d = &m->disk;
+
+    fprintf(f, "%llu %llu %llu\n", d->fd < 0 ? 0ULL : (unsigned long long)
+        (d->size / (DISK_SECTOR * sizeof(data_width_t))), d->transfers,
+        d->words);
+}
@@ -0,0 +1,88 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "bus.h"
+#include "sched.h"
+
+#define DISK 4
+
+#define DISK_SECTOR 256 // words per sector
+#define DISK_WORKERS 4 // threads per attached disk
+#define DISK_JOB_WORDS 4096 // words a worker moves at a time
+#define DISK_JOBS (65536 / DISK_JOB_WORDS) // enough for the largest transfer
+#define DISK_JOB_IOV (DISK_JOB_WORDS / PAGE_SIZE + 1)
+
+#define DISK_SEEK_CYCLES 1000 // per transfer, on the scheduled model
+#define DISK_WORD_CYCLES 1 // per word, likewise
+
+/*
+ * Status bits, see DRS
+ */
+
+#define DISK_DONE 0x1
+#define DISK_ERROR 0x2
+#define DISK_BUSY 0x4
+#define DISK_NONE 0x8 // nothing attached
+
+/*
+ * Part of a transfer, see disk.c
+ */
+
+struct disk_job {
+    off_t offset; // in the file, in bytes
+    int write; // from memory to the file
+    int n_iov;
+    struct iovec iov[DISK_JOB_IOV]; // straight into the RAM pages
+};
+
+/*
+ * Per-machine disk state
+ */
+
+struct disk {
+    int fd; // host file, -1 if nothing attached
+    off_t size; // in bytes
+    int scheduled; // do transfers on the CPU's thread in virtual time
+
+    atomic_int done; // flags the guest sees
+    atomic_int error;
+
+    /*
+     * Transfer in flight and the workers carrying it out
+     */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a job is waiting, or the workers are to stop
+    pthread_cond_t idle; // the transfer has finished
+    struct disk_job jobs[DISK_JOBS];
+    size_t n_jobs;
+    size_t next_job; // first not yet taken by a worker
+    size_t pending; // jobs not yet finished
+    int failed;
+    int run;
+    pthread_t workers[DISK_WORKERS];
+    int n_workers;
+
+    struct event finish; // scheduled model: the transfer completes
+
+    unsigned long long transfers;
+    unsigned long long words;
+};
+
+extern int disk_scheduled(machine *m);
+extern void init_disk(machine *m);
+extern void free_disk(machine *m);
+extern int disk_attach(machine *m, const char *path);
+extern void disk_detach(machine *m);
+extern void disk_drain(machine *m);
+extern int disk_busy(machine *m);
+extern int disk_attn(machine *m, size_t unit, data_width_t cmd);
+extern void disk_show(machine *m, FILE *f);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "xlat.h"
+#include "image.h"
+#include "machine.h"
+
+/*
+ * Images are loaded by mapping the file's data straight in as the backing
+ * store for RAM pages, privately so that the guest's writes are copied on
+ * write and never reach the file. Until then every process running the image
+ * shares the same page cache pages, and nothing is read that the guest doesn't
+ * touch. Pages the image covers that belong to a unit rather than RAM (page 0)
+ * are written through the bus instead. If the host's page size doesn't divide
+ * IMAGE_DATA the data is read into memory instead of mapped.
+ *
+ * The data becomes one of the machine's memory blocks, which it keeps until it
+ * is freed, as RAM pages may still point into it.
+ */
+
+/*
+ * Returns nonzero if page pgn can be backed by the image directly
+ */
+
+int ram_page(machine *m, size_t pgn) {
+    struct bus_page *page = bus_page(&m->bus, pgn);
+
+    return page == NULL || page->ram != NULL
+        || (page->read == NULL && page->write == NULL);
+}
+
+/*
+ * Load an image written by as17 or save_image into a machine, setting the PC,
+ * fields and switches from its header.
+ *
+ * return int: 0 on success, ENOEXEC if the file isn't an image for this host,
+ * EINVAL if it doesn't fit the bus, errno value if it can't be read, or the
+ * bus error from a bad address
+ */
+
+int load_image(machine *m, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno;
+
+    struct image_header header;
+    struct stat st;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, IMAGE_MAGIC, 4)
+        || header.version != IMAGE_VERSION) {
+        close(fd);
+        return ENOEXEC;
+    }
+
+    size_t len = (size_t) header.words * sizeof(data_width_t);
+
+    if (header.base % PAGE_SIZE || header.words % PAGE_SIZE
+        || (header.base + (size_t) header.words) / PAGE_SIZE > MAX_PAGES
+        || fstat(fd, &st) || (size_t) st.st_size < IMAGE_DATA + len) {
+        close(fd);
+        return EINVAL;
+    }
+
+    long host_page = sysconf(_SC_PAGESIZE);
+    data_width_t *data = NULL;
+    int mapped = 0;
+    int result = 0;
+
+    if (len && host_page > 0 && IMAGE_DATA % host_page == 0) {
+        data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, IMAGE_DATA);
+        if (data == MAP_FAILED) data = NULL;
+        else mapped = 1;
+    }
+
+    if (len && data == NULL) {
+        data = malloc(len);
+
+        if (data == NULL) result = ENOMEM;
+        else if (pread(fd, data, len, IMAGE_DATA) != (ssize_t) len)
+            result = EIO;
+    }
+
+    close(fd);
+
+    if (!result && len && add_block(m, data, len, mapped) == NULL)
+        result = ENOMEM;
+
+    if (result) {
+        if (mapped) munmap(data, len);
+        else free(data);
+        return result;
+    }
+
+    for (uint32_t x = 0; !result && x < header.words; x += PAGE_SIZE) {
+        size_t pgn = (header.base + x) / PAGE_SIZE;
+
+        if (ram_page(m, pgn)) {
+            install_ram(m, pgn, &data[x]);
+            continue;
+        }
+
+        result = bus_write_block(m, header.base + x, &data[x], PAGE_SIZE);
+    }
+
+    predecode_flush(m);
+    xlat_flush(m);
+
+    if (result) return result;
+
+    m->zpage[PC] = header.start;
+    m->df = header.df;
+    m->ib = header.if_;
+    m->if_ = header.if_;
+    m->zp = header.zp;
+    m->switches = header.switches;
+
+    return 0;
+}
+
+/*
+ * Save every page from 0 up to the last one installed that has ever been
+ * written (RAM still on the zero page has only been read), with the current
+ * PC, fields and switches in the header, so that loading it carries on from
+ * here.
+ *
+ * return int: 0 on success, errno value if the file can't be written
+ */
+
+int save_image(machine *m, const char *path) {
+    size_t pages = MAX_PAGES;
+
+    while (pages && ram_page(m, pages - 1)) {
+        data_width_t *ram = ram_ptr(&m->bus, (pages - 1) * PAGE_SIZE);
+        if (ram != NULL && ram != zero_page) break;
+        pages--;
+    }
+
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.start = m->zpage[PC];
+    header.df = m->df;
+    header.if_ = m->if_;
+    header.zp = m->zp;
+    header.switches = m->switches;
+    header.base = 0;
+    header.words = pages * PAGE_SIZE;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) return errno;
+
+    uint8_t pad[IMAGE_DATA] = {0};
+    memcpy(pad, &header, sizeof(header));
+    fwrite(pad, 1, IMAGE_DATA, f);
+
+    for (size_t pgn = 0; pgn < pages; pgn++) {
+        data_width_t buf[PAGE_SIZE] = {0};
+        data_width_t *page = ram_ptr(&m->bus, pgn * PAGE_SIZE);
+
+        if (page == NULL) {
+            page = buf;
+
+            // pages with nothing installed are left as zeroes rather than
+            // read, which would allocate them
+            if (!ram_page(m, pgn)
+                && bus_read_block(m, pgn * PAGE_SIZE, buf, PAGE_SIZE))
+                memset(buf, 0, sizeof(buf));
+        }
+
+        fwrite(page, sizeof(data_width_t), PAGE_SIZE, f);
+    }
+
+    int result = ferror(f) ? EIO : 0;
+    if (fclose(f) && !result) result = errno;
+
+    return result;
+}
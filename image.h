@@ -0,0 +1,37 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdint.h>
+
+#include "bus.h"
+
+/*
+ * Binary image format, written by as17 and loaded by the emulator. A header
+ * is followed, at IMAGE_DATA bytes into the file, by words of memory in host
+ * byte order starting at address base. base and words are multiples of
+ * PAGE_SIZE so that the data is made of whole pages. An image written on a
+ * host of the other byte order fails the version check.
+ */
+
+#define IMAGE_MAGIC "P17I"
+#define IMAGE_VERSION 1
+#define IMAGE_DATA 4096 // offset of the first word, in bytes
+
+struct image_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t start; // initial PC
+    uint8_t df; // initial fields
+    uint8_t if_;
+    uint8_t zp;
+    uint8_t reserved;
+    uint16_t switches;
+    uint16_t reserved2;
+    uint32_t base; // address of the first word
+    uint32_t words; // number of words
+};
+
+extern int load_image(machine *m, const char *path);
+extern int save_image(machine *m, const char *path);
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "tty.h"
+#include "console.h"
+#include "disk.h"
+#include "timer.h"
+#include "xlat.h"
+#include "snapshot.h"
+#include "machine.h"
+
+/*
+ * RAM is sparse. A page with nothing installed is given the zero page, shared
+ * by every machine, the first time it is touched, so reading memory costs the
+ * host nothing. Writing to it unshares it like any other shared page, which
+ * copies it into a private page from the machine's arena: host memory is
+ * allocated ARENA_PAGES at a time and handed out a page at a time, so a
+ * machine holds one block per chunk rather than one per page.
+ */
+
+data_width_t zero_page[PAGE_SIZE]; // NEVER WRITE TO THIS
+
+/*
+ * Take a page from the arena. Its contents are undefined.
+ *
+ * return data_width_t *: the page, NULL if out of memory
+ */
+
+data_width_t *new_page(machine *m) {
+    if (!m->arena_free) {
+        size_t len = ARENA_PAGES * PAGE_SIZE * sizeof(data_width_t);
+        data_width_t *chunk = malloc(len);
+
+        if (chunk == NULL) return NULL;
+
+        if (add_block(m, chunk, len, 0) == NULL) {
+            free(chunk);
+            return NULL;
+        }
+
+        m->arena = chunk;
+        m->arena_free = ARENA_PAGES;
+        m->arena_pages += ARENA_PAGES;
+    }
+
+    m->arena_free--;
+    m->arena += PAGE_SIZE;
+
+    return m->arena - PAGE_SIZE;
+}
+
+/*
+ * Give a page with nothing installed the zero page, see struct bus
+ */
+
+int alloc_page(machine *m, size_t pgn) {
+    int result = install_ram(m, pgn, zero_page);
+
+    if (!result) result = share_ram(m, pgn);
+
+    return result;
+}
+
+/*
+ * Give a shared page a private copy, see struct bus_page
+ */
+
+int unshare_page(machine *m, size_t pgn) {
+    data_width_t *page = new_page(m);
+    if (page == NULL) return ENOMEM;
+
+    memcpy(page, bus_page(&m->bus, pgn)->ram,
+        PAGE_SIZE * sizeof(data_width_t));
+
+    return install_ram(m, pgn, page);
+}
+
+/*
+ * Count a machine's RAM pages by what backs them
+ */
+
+void mem_stats(machine *m, struct mem_stats *stats) {
+    memset(stats, 0, sizeof(struct mem_stats));
+
+    for (size_t pgn = 0; pgn < MAX_PAGES; pgn++) {
+        struct bus_page *page = bus_page(&m->bus, pgn);
+
+        if (page == NULL) pgn += FIELD_PAGES - 1; // skip the empty field
+        if (page == NULL || page->ram == NULL) continue;
+
+        stats->ram++;
+
+        if (page->ram == zero_page) stats->zero++;
+        else if (page->shared) stats->shared++;
+        else stats->resident++;
+    }
+
+    stats->arena = m->arena_pages;
+    stats->arena_used = m->arena_pages - m->arena_free;
+}
+
+/*
+ * Switch a unit between its threaded and scheduled models (see sched.c), for
+ * the units that have both. The machine must be stopped.
+ *
+ * return int: 0 on success, ENODEV if the unit has no scheduled model
+ */
+
+int toggle_scheduled(machine *m, size_t unit) {
+    if (unit == DISK) m->disk.scheduled = !m->disk.scheduled;
+    else if (unit == TIMER) m->timer.scheduled = !m->timer.scheduled;
+    else if (unit == TTY_OUT || unit == TTY_IN)
+        m->tty[unit].scheduled = !m->tty[unit].scheduled;
+    else return ENODEV;
+
+    return 0;
+}
+
+/*
+ * Print the model each unit that has a choice is running on
+ */
+
+void list_scheduled(machine *m, FILE *f) {
+    for (size_t unit = TTY_OUT; unit <= TTY_IN; unit++)
+        fprintf(f, "%02zX %s\n", unit,
+            tty_scheduled(m, unit) ? "scheduled" : "threaded");
+
+    fprintf(f, "%02X %s\n", DISK, disk_scheduled(m) ? "scheduled" : "threaded");
+    fprintf(f, "%02X %s\n", TIMER,
+        timer_scheduled(m) ? "scheduled" : "threaded");
+}
+
+/*
+ * Create a machine with the console on the given file descriptors. Every page
+ * of the 16 MW address space other than page 0 is RAM, allocated as it is
+ * touched. The CPU and device threads are not started; that is up to the
+ * caller.
+ *
+ * return machine *: the new machine, NULL if out of memory
+ */
+
+machine *new_machine(int in_fd, int out_fd) {
+    machine *m = calloc(1, sizeof(machine));
+    if (m == NULL) return NULL;
+
+    m->xlat = new_xlat();
+
+    if (m->xlat == NULL) {
+        free(m);
+        return NULL;
+    }
+
+    m->options = OPT_PREDECODE | OPT_FASTRUN | OPT_IDLE;
+    m->irq_mask = 0xFFFF;
+    m->debug.skip = DEBUG_NONE;
+    m->replay.latch = -1;
+
+    pthread_mutex_init(&m->io_lock, NULL);
+    pthread_cond_init(&m->io_done, NULL);
+
+    init_bus(m);
+    init_tty(m);
+    init_console(m, in_fd, out_fd);
+    init_disk(m);
+    init_timer(m);
+
+    install_unit(m, 0, cpu_read, cpu_write);
+    install_block(m, 0, cpu_read_block, cpu_write_block);
+    install_snoop(m, cpu_snoop);
+    install_snoop_range(m, cpu_snoop_range);
+    install_unshare(m, unshare_page);
+    install_lazy(m, MAX_PAGES, alloc_page);
+
+    install_attn(m, TTY_OUT, tty_attn);
+    install_attn(m, TTY_IN, tty_attn);
+    install_attn(m, DISK, disk_attn);
+    install_attn(m, TIMER, timer_attn);
+
+    return m;
+}
+
+/*
+ * Free a machine. Its threads must already have been stopped and joined.
+ */
+
+void free_machine(machine *m) {
+    trace_stop(m);
+    stop_record(m);
+    stop_replay(m);
+    free_timer(m);
+    free_disk(m);
+    free_console(m);
+    free_tty(m);
+
+    pthread_mutex_destroy(&m->io_lock);
+    pthread_cond_destroy(&m->io_done);
+
+    free_bus(m);
+    free_profile(m);
+    free_blocks(m->blocks);
+    release_store(m->store);
+    free(m->xlat);
+    free(m);
+}
+
+/*
+ * Hand a block of memory to the machine, which frees or unmaps it along with
+ * itself, as RAM pages may point into it until then.
+ *
+ * return struct mem_block *: the block, NULL if out of memory (data is not
+ * freed)
+ */
+
+struct mem_block *add_block(machine *m, void *data, size_t len, int mapped) {
+    struct mem_block *block = malloc(sizeof(struct mem_block));
+    if (block == NULL) return NULL;
+
+    block->data = data;
+    block->len = len;
+    block->mapped = mapped;
+    block->next = m->blocks;
+    m->blocks = block;
+
+    return block;
+}
+
+void free_blocks(struct mem_block *block) {
+    while (block != NULL) {
+        struct mem_block *next = block->next;
+
+        if (block->mapped) munmap(block->data, block->len);
+        else free(block->data);
+        free(block);
+
+        block = next;
+    }
+}
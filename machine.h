@@ -0,0 +1,184 @@
+#ifndef __MACHINE_H__
+#define __MACHINE_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "tty.h"
+#include "console.h"
+#include "disk.h"
+#include "timer.h"
+#include "perf.h"
+#include "profile.h"
+#include "trace.h"
+#include "debug.h"
+#include "sched.h"
+#include "replay.h"
+
+/*
+ * Complete state of one PDP-17. Nothing in the emulator is process-global
+ * apart from the page geometry in bus.c, so any number of machines can run
+ * side by side, each on its own thread.
+ */
+
+struct machine {
+    /*
+     * CPU registers and cycle state, see cpu.c
+     */
+    
+    data_width_t zpage[FLAG + 1];
+    data_width_t switches;
+    data_width_t options;
+    
+    addr_width_t mar;
+    data_width_t mbr;
+    
+    uint16_t df; // data field
+    uint16_t ib; // instruction buffer
+    uint16_t if_; // instruction field
+    uint8_t zp; // zero page
+    int jump_int_lockout;
+    
+    unsigned long long cycles; // micro-cycles run so far, see sched.c
+    unsigned int budget; // run() stops after this many cycles, 0 for no limit
+    int headless; // no device threads, so run() stops rather than IOWAIT
+    volatile int *running; // run()'s running flag while it runs, else NULL
+    
+    /*
+     * Interrupts
+     */
+    
+    atomic_uint irq_pending;
+    data_width_t irq_mask;
+    int int_enable;
+    int int_waiting;
+    
+    /*
+     * I/O completion and device events
+     */
+    
+    pthread_mutex_t io_lock;
+    pthread_cond_t io_done;
+    atomic_ulong dev_event;
+    
+    /*
+     * Idle loop detection
+     */
+    
+    addr_width_t idle_pc;
+    unsigned long idle_event;
+    int idle_armed;
+    unsigned long long idle_cycles;
+    unsigned long long idle_slept; // estimated, not counted in the run
+    unsigned long long idle_ns; // host time slept this run
+    struct timespec run_start;
+    
+    /*
+     * Decoded and translated code
+     */
+    
+    struct predecoded predecode[PREDECODE_SIZE];
+    struct predecoded uncached;
+    struct xlat *xlat;
+    
+    /*
+     * Performance counters, see perf.c
+     */
+    
+    struct perf perf;
+    
+    /*
+     * Sampling profiler, see profile.c
+     */
+    
+    struct profile profile;
+    
+    /*
+     * Execution trace, see trace.c
+     */
+    
+    struct trace trace;
+    
+    /*
+     * Breakpoints and watchpoints, see debug.c
+     */
+    
+    struct debug debug;
+    
+    /*
+     * Virtual-time events, see sched.c
+     */
+    
+    struct sched sched;
+    
+    /*
+     * Deterministic input, see replay.c
+     */
+    
+    struct replay replay;
+    
+    /*
+     * Bus and devices
+     */
+    
+    struct bus bus;
+    struct tty_unit tty[TTY_IN + 1];
+    int run_tty;
+    struct console console;
+    struct disk disk;
+    struct timer timer;
+    
+    /*
+     * Memory backing RAM pages. A machine owns the blocks it allocates or maps
+     * itself, and shares those of the machines it was forked from through its
+     * store, see snapshot.c. Private pages are carved out of the current
+     * arena chunk, see machine.c
+     */
+    
+    struct mem_block *blocks;
+    struct store *store;
+    data_width_t *arena;
+    size_t arena_free; // pages left in the current chunk
+    size_t arena_pages; // pages in every chunk so far
+};
+
+#define ARENA_PAGES 64 // pages per arena chunk
+
+/*
+ * Memory statistics, see mem_stats
+ */
+
+struct mem_stats {
+    size_t ram; // RAM pages installed
+    size_t resident; // of which held by this machine alone
+    size_t shared; // shared with other machines or mapped from an image
+    size_t zero; // still reading the zero page
+    size_t arena; // pages reserved by the arena
+    size_t arena_used; // of which handed out
+};
+
+struct mem_block {
+    void *data;
+    size_t len;
+    int mapped; // from mmap rather than malloc
+    struct mem_block *next;
+};
+
+extern data_width_t zero_page[PAGE_SIZE]; // see machine.c, NEVER WRITE TO THIS
+
+extern machine *new_machine(int in_fd, int out_fd);
+extern void free_machine(machine *m);
+extern struct mem_block *add_block(machine *m, void *data, size_t len,
+    int mapped);
+extern void free_blocks(struct mem_block *block);
+extern data_width_t *new_page(machine *m);
+extern int alloc_page(machine *m, size_t pgn);
+extern int unshare_page(machine *m, size_t pgn);
+extern void mem_stats(machine *m, struct mem_stats *stats);
+extern int toggle_scheduled(machine *m, size_t unit);
+extern void list_scheduled(machine *m, FILE *f);
+
+#endif
@@ -1,32 +1,35 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
 #include <poll.h>
 #include <termios.h>
+#include <unistd.h>
 
 #include "bus.h"
 #include "cpu.h"
 #include "tty.h"
+#include "console.h"
+#include "disk.h"
+#include "xlat.h"
+#include "batch.h"
+#include "bench.h"
+#include "perf.h"
+#include "profile.h"
+#include "trace.h"
+#include "debug.h"
+#include "image.h"
+#include "snapshot.h"
+#include "machine.h"
 
-#define MEM_SIZE 65536
+machine *m = NULL;
 
-data_width_t mem[MEM_SIZE];
-
-int mem_read(addr_width_t src, data_width_t *dst) {
-    *dst = mem[src];
-    return 0;
-}
-
-int mem_write(addr_width_t dst, data_width_t src) {
-    mem[dst] = src;
-    return 0;
-}
-
-int cpu_running = 0;
+volatile int cpu_running = 0;
+unsigned int last_cycles = 0;
 
 void ctrl_c(int dummy) {
     cpu_running = 0;
@@ -35,8 +38,10 @@ void ctrl_c(int dummy) {
 unsigned int run_cpu(void) {
     unsigned int cycles = 0;
     
-    run_tty = 1;
+    m->run_tty = 1;
     cpu_running = 1;
+    perf_reset(m);
+    profile_reset(m);
     
     signal(SIGINT, ctrl_c);
     
@@ -46,41 +51,57 @@ unsigned int run_cpu(void) {
     newt.c_lflag &= ~(ICANON);
     tcsetattr(0, TCSANOW, &newt);
     
+    fflush(stdout);
+    m->console.run = 1;
+    
+    pthread_t console_tid;
+    pthread_create(&console_tid, NULL, console, (void *) m);
+    
     pthread_t tty_tid;
-    size_t tty_id = 2;
-    pthread_create(&tty_tid, NULL, tty, (void *) &tty_id);
+    int threaded = !tty_scheduled(m, TTY_OUT);
+    if (threaded) pthread_create(&tty_tid, NULL, tty, (void *) m);
     
-    pthread_t ttyin_tid;
-    size_t ttyin_id = 3;
-    pthread_create(&ttyin_tid, NULL, ttyin, (void *) &ttyin_id);
+    debug_resume(m);
     
-    while ((zpage[FLAG] & 0x1E0) >> 5 != 0xF && cpu_running) {
-        step();
-        cycles++;
+    if (m->options & OPT_FASTRUN) cycles = run(m, &cpu_running);
+    else {
+        arm_events(m);
+        m->running = &cpu_running;
+        
+        while ((m->zpage[FLAG] & 0x1E0) >> 5 != 0xF && cpu_running) {
+            step_timed(m);
+            cycles++;
+        }
+        
+        m->running = NULL;
     }
     
-    zpage[FLAG] &= ~(0x1E0);
+    m->zpage[FLAG] &= ~(0x1E0);
     
-    run_tty = 0;
-    pthread_join(tty_tid, NULL);
-    pthread_join(ttyin_tid, NULL);
+    stop_tty(m);
+    if (threaded) pthread_join(tty_tid, NULL);
+    stop_console(m);
+    pthread_join(console_tid, NULL);
+    disk_drain(m);
     
     tcsetattr(0, TCSANOW, &oldt);
     
     signal(SIGINT, NULL);
     printf("\n");
+    debug_report(m, stdout);
     
     return cycles;
 }
 
 void regs(void) {
     printf("%04hX %04hX %04hX %04hX %04hX %04hX %04hX %04hX\n",
-        zpage[0], zpage[1], zpage[2], zpage[3],
-        zpage[4], zpage[5], zpage[6], zpage[7]);
+        m->zpage[0], m->zpage[1], m->zpage[2], m->zpage[3],
+        m->zpage[4], m->zpage[5], m->zpage[6], m->zpage[7]);
     
     printf("%04hX %04hX %04hX %04hX %04hX %04hX %04hX %04hX\n%04hX\n",
-        zpage[8], zpage[9], zpage[10], zpage[11],
-        zpage[12], zpage[13], zpage[14], zpage[15], zpage[FLAG]);
+        m->zpage[8], m->zpage[9], m->zpage[10], m->zpage[11],
+        m->zpage[12], m->zpage[13], m->zpage[14], m->zpage[15],
+        m->zpage[FLAG]);
     
     return;
 }
@@ -88,36 +109,109 @@ void regs(void) {
 addr_width_t dump(addr_width_t address, data_width_t lines) {
     address &= 0xFFF8;
     for (int i = 0; i < lines; i++) {
+        data_width_t data[8] = {0};
+        bus_read_block(m, address, data, 8);
+
         printf("%04hX|", (unsigned short) address);
-        for (int j = 0; j < 8; j++) {
-            data_width_t data;
-            bus_read(address++, &data);
-            address &= 0xFFFF;
-            printf("%04hX ", data);
-        }
+        for (int j = 0; j < 8; j++) printf("%04hX ", data[j]);
         printf("\n");
+
+        address = (address + 8) & 0xFFFF;
     }
     return address;
 }
 
-int main(int argc, char *argv) {
-    init_bus();
-    switches = 0;
+void usage(char *name) {
+    fprintf(stderr, "usage: %s [image]\n"
+        "       %s -b joblist [-j threads] [-c budget] [-o] [-p] [-s]\n"
+        "       %s -B [-r runs] [-O options] [kernel]\n", name, name, name);
+}
+
+int main(int argc, char **argv) {
+    char *list = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int budget = 0;
+    int show_output = 0;
+    int show_perf = 0;
+    int scaling = 0;
+    int benchmark = 0;
+    int runs = 5;
+    data_width_t options = OPT_PREDECODE | OPT_FASTRUN;
+    int opt;
     
-    install_unit(0, cpu_read, cpu_write);
+    while ((opt = getopt(argc, argv, "b:j:c:opsBr:O:")) != -1) {
+        switch (opt) {
+            case 'b': // headless batch run, see batch.c
+                list = optarg;
+                break;
+            case 'j': // worker threads
+                threads = atoi(optarg);
+                break;
+            case 'c': // default cycle budget per job
+                budget = strtoul(optarg, NULL, 10);
+                break;
+            case 'o': // print each job's console output
+                show_output = 1;
+                break;
+            case 'p': // dump each job's performance counters
+                show_perf = 1;
+                break;
+            case 's': // sweep worker threads up to -j, see batch.c
+                scaling = 1;
+                break;
+            case 'B': // benchmark suite, see bench.c
+                benchmark = 1;
+                break;
+            case 'r': // benchmark runs per kernel
+                runs = atoi(optarg);
+                break;
+            case 'O': // benchmark emulator options, hex as in the monitor
+                options = strtoul(optarg, NULL, 16);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    
+    if (list != NULL && scaling) return sweep(list, threads, budget);
+    if (list != NULL) return batch(list, threads, budget, show_output, show_perf);
+    
+    if (benchmark) {
+        if (optind < argc - 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        
+        return bench(optind < argc ? argv[optind] : NULL, runs, options);
+    }
     
-    for (int i = 1; i <= 16; i++) // 4 KW core
-        install_unit(i, mem_read, mem_write);
+    if (optind < argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    m = new_machine(0, 1);
+    if (m == NULL) {
+        perror("new_machine");
+        return 1;
+    }
     
-    install_attn(2, tty_attn);
-    install_attn(3, tty_attn);
+    if (optind == argc - 1) {
+        int result = load_image(m, argv[optind]);
+        
+        if (result) {
+            fprintf(stderr, "%s: %s\n", argv[optind], strerror(result));
+            return 1;
+        }
+    }
     
     int run = 1;
     
     printf("\"PDP-17\" - for evaluation use only\n");
     
     char command = '\0';
-    data_width_t addr = 0;
+    data_width_t addr = m->zpage[PC];
     data_width_t data = 0;
     data_width_t dump_len = 0;
     
@@ -131,6 +225,9 @@ int main(int argc, char *argv) {
         size_t len = 0;
         getline(&line, &len, stdin);
         int valid = sscanf(line, " %c%4hX %c", &command, &value, &garbage);
+        int result;
+        char path[256];
+        addr_width_t point;
         
         command = tolower(command);
         
@@ -143,14 +240,14 @@ int main(int argc, char *argv) {
                 if (valid > 2) printf("?\n");
                 else {
                     if (valid == 2) data = value;
-                    bus_write(addr++, data);
+                    bus_write(m, addr++, data);
                 }
                 break;
             case 'i': // inspect
                 if (valid > 2) printf("?\n");
                 else {
                     if (valid == 2) addr = value;
-                    bus_read(addr, &data);
+                    bus_read(m, addr, &data);
                     printf("%04hX\n", data);
                     addr++;
                 }
@@ -166,53 +263,206 @@ int main(int argc, char *argv) {
                 if (valid > 2) printf("?\n");
                 else {
                     if (valid == 2) addr = value;
-                    zpage[15] = addr;
-                    unsigned int cycles = run_cpu();
-                    addr = zpage[15];
-                    // printf("%ud\n", cycles);
+                    m->zpage[15] = addr;
+                    last_cycles = run_cpu();
+                    addr = m->zpage[15];
                 }
                 break;
             case 'c': // continue
                 if (valid > 1) printf("?\n");
                 else {
-                    unsigned int cycles = run_cpu();
-                    addr = zpage[15];
-                    // printf("%ud\n", cycles);
+                    last_cycles = run_cpu();
+                    addr = m->zpage[15];
                 }
                 break;
             case 's': // single step
                 if (valid > 1) printf("?\n");
                 else {
-                    if ((zpage[FLAG] & 0x1E0) >> 5 == 0xF)
-                        zpage[FLAG] &= ~(0x1E0);
-                    step();
+                    if ((m->zpage[FLAG] & 0x1E0) >> 5 == 0xF)
+                        m->zpage[FLAG] &= ~(0x1E0);
+                    debug_resume(m);
+                    step_timed(m);
+                    debug_report(m, stdout);
                 }
                 break;
             case 't': // step and show regs
                 if (valid == 1) {
-                    if ((zpage[FLAG] & 0x1E0) >> 5 == 0xF)
-                        zpage[FLAG] &= ~(0x1E0);
-                    step(); regs();
+                    if ((m->zpage[FLAG] & 0x1E0) >> 5 == 0xF)
+                        m->zpage[FLAG] &= ~(0x1E0);
+                    debug_resume(m);
+                    step_timed(m); regs();
+                    debug_report(m, stdout);
                 }
                 else printf("?\n");
                 break;
             case 'r': // view regs
                 if (valid == 1) regs();
-                else if (valid == 2 && value <= 15) printf("%04hX\n", zpage[value]);
+                else if (valid == 2 && value <= 15) printf("%04hX\n", m->zpage[value]);
                 else printf("?\n");
                 break;
             case 'z': // zap registers
                 if (valid == 1) {
-                	for (int i = 0; i < 16; zpage[i++] = 0);
-                	zpage[FLAG] = 0;
+                	for (int i = 0; i < 16; m->zpage[i++] = 0);
+                	m->zpage[FLAG] = 0;
                 }
                 else printf("?\n");
                 break;
             case 'w': // set switches
-                if (valid == 2) switches = value;
-                else if (valid == 1) printf("%04hX\n", switches);
+                if (valid == 2) m->switches = value;
+                else if (valid == 1) printf("%04hX\n", m->switches);
+                else printf("?\n");
+                break;
+            case 'o': // set options
+                if (valid == 2) {
+                    m->options = value;
+                    predecode_flush(m);
+                    xlat_flush(m);
+                }
+                else if (valid == 1) printf("%04hX\n", m->options);
+                else printf("?\n");
+                break;
+            case 'n': // cycle counts of last run
+                if (valid == 1) printf("%u %llu %llu\n", last_cycles,
+                    m->idle_cycles, m->idle_slept);
                 else printf("?\n");
                 break;
+            case 'm': // memory statistics
+                if (valid == 1) {
+                    struct mem_stats stats;
+                    mem_stats(m, &stats);
+                    printf("%zu %zu %zu %zu %zu %zu\n", stats.ram,
+                        stats.resident, stats.shared, stats.zero,
+                        stats.arena, stats.arena_used);
+                }
+                else printf("?\n");
+                break;
+            case 'p': // performance counters of last run
+                if (valid == 1) perf_dump(m, stdout, NULL);
+                else printf("?\n");
+                break;
+            case 'e': // profiler sample interval
+                if (valid == 2) {
+                    m->profile.interval = value;
+                    profile_reset(m);
+                }
+                else if (valid == 1) printf("%04X\n", m->profile.interval);
+                else printf("?\n");
+                break;
+            case 'y': // load symbols
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = load_symbols(m, path)))
+                        printf("%s\n", strerror(result));
+                }
+                else printf("?\n");
+                break;
+            case 'j': // profile of last run
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    FILE *f = fopen(path, "w");
+                    
+                    if (f == NULL) result = errno;
+                    else {
+                        result = profile_folded(m, f);
+                        if (fclose(f) && !result) result = errno;
+                    }
+                    
+                    if (result) printf("%s\n", strerror(result));
+                }
+                else profile_report(m, stdout);
+                break;
+            case 'f': // trace ring size
+                if (valid == 2) {
+                    if (!value) trace_stop(m);
+                    else if ((result = trace_start(m, (size_t) value << 10)))
+                        printf("%s\n", strerror(result));
+                }
+                else if (valid == 1) printf("%zu %llu %llu\n", m->trace.size
+                    * (m->trace.ring != NULL), atomic_load(&m->trace.head),
+                    m->trace.lost);
+                else printf("?\n");
+                break;
+            case 'h': // show or save trace
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = trace_save(m, path)))
+                        printf("%s\n", strerror(result));
+                }
+                else trace_show(m, stdout, 16);
+                break;
+            case 'b': // stream trace
+                if (sscanf(line, " %*c %255s", path) == 1)
+                    result = trace_stream(m, path);
+                else result = trace_unstream(m);
+                
+                if (result) printf("%s\n", strerror(result));
+                break;
+            case 'l': // load image
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = load_image(m, path)))
+                        printf("%s\n", strerror(result));
+                    else addr = m->zpage[PC];
+                }
+                else printf("?\n");
+                break;
+            case 'v': // save image
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = save_image(m, path)))
+                        printf("%s\n", strerror(result));
+                }
+                else printf("?\n");
+                break;
+            case 'k': // save snapshot
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = save_snapshot(m, path)))
+                        printf("%s\n", strerror(result));
+                }
+                else printf("?\n");
+                break;
+            case 'x': // restore snapshot
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = load_snapshot(m, path)))
+                        printf("%s\n", strerror(result));
+                    else addr = m->zpage[PC];
+                }
+                else printf("?\n");
+                break;
+            case '@': // toggle or list breakpoints
+            case '!': // toggle or list watchpoints
+                if (sscanf(line, " %*c%6X %c", &point, &garbage) == 1) {
+                    result = command == '@' ? toggle_break(m, point)
+                        : toggle_watch(m, point);
+                    if (result) printf("%s\n", strerror(result));
+                }
+                else if (valid == 1) debug_list(m, stdout);
+                else printf("?\n");
+                break;
+            case '*': // attach or show disk
+                if (sscanf(line, " %*c %255s", path) == 1) {
+                    if ((result = disk_attach(m, path)))
+                        printf("%s\n", strerror(result));
+                }
+                else if (valid == 1) disk_show(m, stdout);
+                else printf("?\n");
+                break;
+            case '%': // toggle or list scheduled devices
+                if (sscanf(line, " %*c%2X %c", &point, &garbage) == 1) {
+                    if ((result = toggle_scheduled(m, point)))
+                        printf("%s\n", strerror(result));
+                }
+                else if (valid == 1) list_scheduled(m, stdout);
+                else printf("?\n");
+                break;
+            case '>': // start or stop recording input
+            case '<': // start or stop replaying input
+                if (sscanf(line, " %*c %255s", path) == 1)
+                    result = command == '>' ? start_record(m, path)
+                        : start_replay(m, path);
+                else if (command == '>') result = stop_record(m);
+                else {
+                    stop_replay(m);
+                    result = 0;
+                }
+                
+                if (result) printf("%s\n", strerror(result));
+                break;
             case 'q': // quit
                 if (valid > 1) printf("?\n");
                 else run = 0;
@@ -224,5 +474,7 @@ int main(int argc, char *argv) {
         free(line);
     }
     
+    free_machine(m);
+    
     return 0;
 }
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bus.h"
+#include "perf.h"
+#include "machine.h"
+
+/*
+ * Performance counters
+ *
+ * Every machine has its own counters, updated with plain increments by the
+ * thread running it, so they cost a memory increment each and need no locking
+ * or atomics. The CPU counts instructions by class and micro-cycles by state,
+ * the bus counts reads and writes per page (in struct bus_page) and attention
+ * calls per unit, and io_wait counts the time spent blocked. Bus accesses made
+ * from other threads, such as the monitor's, are counted too but are not
+ * synchronised with the machine's thread.
+ */
+
+static const char *class_names[PERF_CLASSES] = {
+    "basic", "regform", "iot", "opr1", "opr2", "regop"
+};
+
+static const char *state_names[PERF_STATES] = {
+    "ifetch", "inaddr", "exec", "iowait", "wtback"
+};
+
+void perf_reset(machine *m) {
+    memset(&m->perf, 0, sizeof(struct perf));
+
+    for (size_t pgn = 0; pgn < MAX_PAGES; pgn++) {
+        struct bus_page *page = bus_page(&m->bus, pgn);
+
+        if (page == NULL) pgn += FIELD_PAGES - 1; // skip the empty field
+        else page->reads = page->writes = 0;
+    }
+}
+
+/*
+ * Print every counter, one "name value" line each, preceded by tag and a space
+ * if tag isn't NULL. Units and pages that were never used are left out; pages
+ * are named by their first address, in hex.
+ */
+
+void perf_dump(machine *m, FILE *f, const char *tag) {
+    const char *sep = tag == NULL ? "" : " ";
+    if (tag == NULL) tag = "";
+
+    for (int x = 0; x < PERF_CLASSES; x++)
+        fprintf(f, "%s%sinsns.%s %llu\n", tag, sep, class_names[x],
+            m->perf.insns[x]);
+
+    for (int x = 0; x < PERF_STATES; x++)
+        fprintf(f, "%s%scycles.%s %llu\n", tag, sep, state_names[x],
+            m->perf.cycles[x]);
+
+    fprintf(f, "%s%siowait_ns %llu\n", tag, sep, m->perf.iowait_ns);
+
+    for (int x = 0; x < MAX_UNITS; x++)
+        if (m->perf.attn[x])
+            fprintf(f, "%s%sattn.%d %llu\n", tag, sep, x, m->perf.attn[x]);
+
+    for (size_t pgn = 0; pgn < MAX_PAGES; pgn++) {
+        struct bus_page *page = bus_page(&m->bus, pgn);
+
+        if (page == NULL) {
+            pgn += FIELD_PAGES - 1;
+            continue;
+        }
+
+        if (page->reads)
+            fprintf(f, "%s%sreads.%06zX %llu\n", tag, sep, pgn * PAGE_SIZE,
+                page->reads);
+        if (page->writes)
+            fprintf(f, "%s%swrites.%06zX %llu\n", tag, sep, pgn * PAGE_SIZE,
+                page->writes);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdio.h>
+
+#include "bus.h"
+
+/*
+ * Performance counters, see perf.c. Compiled in unless NO_PERF is defined;
+ * PERF(x) wraps every statement that updates one.
+ */
+
+#ifdef NO_PERF
+#define PERF(x)
+#else
+#define PERF(x) x
+#endif
+
+#define PERF_BASIC 0 // memory reference instruction
+#define PERF_REGFORM 1 // memory reference instruction on a register
+#define PERF_IOT 2
+#define PERF_OPR1 3
+#define PERF_OPR2 4
+#define PERF_REGOP 5
+#define PERF_CLASSES 6
+
+#define PERF_IFETCH 0
+#define PERF_INADDR 1
+#define PERF_EXEC 2
+#define PERF_IOWAIT 3
+#define PERF_WTBACK 4
+#define PERF_STATES 5
+
+struct perf {
+    unsigned long long insns[PERF_CLASSES]; // instructions retired by class
+    unsigned long long cycles[PERF_STATES]; // micro-cycles by state
+    unsigned long long attn[MAX_UNITS]; // attention calls by unit
+    unsigned long long iowait_ns; // time blocked waiting for IOTs
+};
+
+extern void perf_reset(machine *m);
+extern void perf_dump(machine *m, FILE *f, const char *tag);
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bus.h"
+#include "sched.h"
+#include "profile.h"
+#include "machine.h"
+
+/*
+ * Sampling profiler
+ *
+ * When the interval is set, the run engine calls profile_sample at the first
+ * instruction boundary after every interval micro-cycles (see sched.c),
+ * which counts the address of the next instruction in a histogram keyed by
+ * if_ << 16 | PC. Costing one compare per instruction while off, and one hash
+ * table update per sample while on, it leaves the interpreter loop alone
+ * otherwise. Threaded-code blocks would run as one unit, so that the samples
+ * falling inside one landed on the instruction after it, and so aren't used
+ * while profiling (see run_loop).
+ *
+ * Addresses are named after the nearest label at or below them, from a
+ * symbol file written by as17 -s.
+ */
+
+#define PROFILE_INIT 1024 // initial histogram slots
+
+static uint32_t sample_hash(uint32_t addr) {
+    return addr * 2654435761u; // Knuth's multiplicative hash
+}
+
+/*
+ * Double the histogram, or allocate it. Returns ENOMEM if it can't.
+ */
+
+int profile_grow(struct profile *p) {
+    size_t size = p->size ? p->size * 2 : PROFILE_INIT;
+    struct profile_sample *slots = calloc(size, sizeof(struct profile_sample));
+    if (slots == NULL) return ENOMEM;
+
+    for (size_t x = 0; x < p->size; x++) {
+        if (!p->slots[x].count) continue;
+
+        size_t y = sample_hash(p->slots[x].addr) & (size - 1);
+        while (slots[y].count) y = (y + 1) & (size - 1);
+        slots[y] = p->slots[x];
+    }
+
+    free(p->slots);
+    p->slots = slots;
+    p->size = size;
+
+    return 0;
+}
+
+/*
+ * Set the first sample of a run
+ */
+
+void profile_arm(machine *m) {
+    struct profile *p = &m->profile;
+
+    p->event.fire = profile_sample;
+    schedule(m, &p->event, p->interval ? m->cycles + p->interval : SCHED_NEVER);
+}
+
+/*
+ * Count one sample of the machine's next instruction, and set the next
+ */
+
+void profile_sample(machine *m, unsigned long long now) {
+    struct profile *p = &m->profile;
+    uint32_t addr = (uint32_t) (m->if_ & 0xFF) << 16 | m->zpage[PC];
+
+    schedule(m, &p->event, now + p->interval);
+
+    if (p->used * 2 >= p->size && profile_grow(p)) { // keep it at most half full
+        p->dropped++;
+        return;
+    }
+
+    size_t x = sample_hash(addr) & (p->size - 1);
+
+    while (p->slots[x].count && p->slots[x].addr != addr)
+        x = (x + 1) & (p->size - 1);
+
+    if (!p->slots[x].count) {
+        p->slots[x].addr = addr;
+        p->used++;
+    }
+
+    p->slots[x].count++;
+    p->total++;
+}
+
+/*
+ * Clear the samples, keeping the interval and symbols
+ */
+
+void profile_reset(machine *m) {
+    struct profile *p = &m->profile;
+
+    if (p->slots != NULL)
+        memset(p->slots, 0, p->size * sizeof(struct profile_sample));
+    p->used = 0;
+    p->total = 0;
+    p->dropped = 0;
+}
+
+void free_symbols(struct profile *p) {
+    for (size_t x = 0; x < p->n_symbols; x++) free(p->symbols[x].name);
+    free(p->symbols);
+
+    p->symbols = NULL;
+    p->n_symbols = 0;
+}
+
+void free_profile(machine *m) {
+    free(m->profile.slots);
+    free_symbols(&m->profile);
+}
+
+int compare_symbols(const void *a, const void *b) {
+    const struct profile_symbol *x = a;
+    const struct profile_symbol *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Load a symbol file, one "address name" line per symbol with the address in
+ * hex, replacing any symbols loaded before. Lines that don't parse are
+ * skipped.
+ *
+ * return int: 0 on success, ENOMEM if out of memory, errno value if the file
+ * can't be read
+ */
+
+int load_symbols(machine *m, const char *path) {
+    struct profile *p = &m->profile;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return errno;
+
+    free_symbols(p);
+
+    size_t size = 0;
+    char *line = NULL;
+    size_t len = 0;
+    int result = 0;
+
+    while (!result && getline(&line, &len, f) >= 0) {
+        unsigned int addr;
+        char name[256];
+
+        if (sscanf(line, "%X %255s", &addr, name) != 2) continue;
+
+        if (p->n_symbols == size) {
+            size = size ? size * 2 : 64;
+            struct profile_symbol *grown =
+                realloc(p->symbols, size * sizeof(struct profile_symbol));
+
+            if (grown == NULL) {
+                result = ENOMEM;
+                break;
+            }
+
+            p->symbols = grown;
+        }
+
+        struct profile_symbol *sym = &p->symbols[p->n_symbols];
+
+        if ((sym->name = strdup(name)) == NULL) result = ENOMEM;
+        else {
+            sym->addr = addr;
+            p->n_symbols++;
+        }
+    }
+
+    if (!result && ferror(f)) result = EIO;
+
+    free(line);
+    fclose(f);
+
+    if (result) free_symbols(p);
+    else qsort(p->symbols, p->n_symbols, sizeof(struct profile_symbol),
+        compare_symbols);
+
+    return result;
+}
+
+/*
+ * Nearest symbol at or below addr, NULL if none
+ */
+
+struct profile_symbol *find_symbol(struct profile *p, uint32_t addr) {
+    size_t lo = 0;
+    size_t hi = p->n_symbols;
+
+    while (lo < hi) { // first symbol above addr
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (p->symbols[mid].addr <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo ? &p->symbols[lo - 1] : NULL;
+}
+
+int compare_addrs(const void *a, const void *b) {
+    const struct profile_sample *x = a;
+    const struct profile_sample *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+int compare_counts(const void *a, const void *b) {
+    const struct profile_sample *x = a;
+    const struct profile_sample *y = b;
+
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return compare_addrs(a, b);
+}
+
+/*
+ * Copy the samples out of the histogram in address order. Returns NULL if
+ * there are none or it's out of memory.
+ */
+
+struct profile_sample *sorted_samples(struct profile *p) {
+    if (!p->used) return NULL;
+
+    struct profile_sample *samples =
+        malloc(p->used * sizeof(struct profile_sample));
+    if (samples == NULL) return NULL;
+
+    size_t n = 0;
+
+    for (size_t x = 0; x < p->size; x++)
+        if (p->slots[x].count) samples[n++] = p->slots[x];
+
+    qsort(samples, n, sizeof(struct profile_sample), compare_addrs);
+
+    return samples;
+}
+
+/*
+ * Print the hotspot table: samples per symbol, most first, with addresses
+ * before the first symbol counted on their own. Each row is the sample
+ * count, its share of all samples and the symbol.
+ */
+
+void profile_report(machine *m, FILE *f) {
+    struct profile *p = &m->profile;
+    struct profile_sample *samples = sorted_samples(p);
+
+    if (p->used && samples == NULL) {
+        fprintf(f, "%s\n", strerror(ENOMEM));
+        return;
+    }
+
+    // merge each symbol's samples into its first
+    size_t rows = 0;
+
+    for (size_t x = 0; x < p->used; x++) {
+        struct profile_symbol *sym = find_symbol(p, samples[x].addr);
+
+        if (rows && sym != NULL
+            && sym == find_symbol(p, samples[rows - 1].addr)) {
+            samples[rows - 1].count += samples[x].count;
+            continue;
+        }
+
+        samples[rows++] = samples[x];
+    }
+
+    qsort(samples, rows, sizeof(struct profile_sample), compare_counts);
+
+    fprintf(f, "%10s %6s %s\n", "SAMPLES", "%", "SYMBOL");
+
+    for (size_t x = 0; x < rows; x++) {
+        struct profile_symbol *sym = find_symbol(p, samples[x].addr);
+
+        fprintf(f, "%10llu %6.2f ", samples[x].count,
+            samples[x].count * 100.0 / p->total);
+
+        if (sym != NULL) fprintf(f, "%s\n", sym->name);
+        else fprintf(f, "%06X\n", samples[x].addr);
+    }
+
+    fprintf(f, "%llu samples every %u cycles", p->total, p->interval);
+    if (p->dropped) fprintf(f, ", %llu dropped", p->dropped);
+    fprintf(f, "\n");
+
+    free(samples);
+}
+
+/*
+ * Write the samples as folded stacks for flame graph tools, one
+ * "symbol;address count" line per address in address order. The guest has no
+ * call stack to walk, so each stack is just the symbol and the instruction.
+ *
+ * return int: 0 on success, ENOMEM if out of memory, EIO if f can't be written
+ */
+
+int profile_folded(machine *m, FILE *f) {
+    struct profile *p = &m->profile;
+    struct profile_sample *samples = sorted_samples(p);
+
+    if (p->used && samples == NULL) return ENOMEM;
+
+    for (size_t x = 0; samples != NULL && x < p->used; x++) {
+        struct profile_symbol *sym = find_symbol(p, samples[x].addr);
+
+        fprintf(f, "%s;%06X %llu\n", sym != NULL ? sym->name : "?",
+            samples[x].addr, samples[x].count);
+    }
+
+    free(samples);
+
+    return ferror(f) ? EIO : 0;
+}
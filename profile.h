@@ -0,0 +1,46 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bus.h"
+#include "sched.h"
+
+/*
+ * Sampling profiler, see profile.c
+ */
+
+struct profile_sample {
+    uint32_t addr; // if_ << 16 | PC
+    unsigned long long count; // 0 for an empty slot
+};
+
+struct profile_symbol {
+    uint32_t addr;
+    char *name;
+};
+
+struct profile {
+    unsigned int interval; // micro-cycles between samples, 0 for off
+    struct event event; // next sample, see sched.c
+    
+    struct profile_sample *slots;
+    size_t size; // THIS MUST BE A POWER OF TWO
+    size_t used;
+    unsigned long long total;
+    unsigned long long dropped; // samples the table couldn't grow for
+    
+    struct profile_symbol *symbols; // in address order
+    size_t n_symbols;
+};
+
+extern void profile_arm(machine *m);
+extern void profile_sample(machine *m, unsigned long long now);
+extern void profile_reset(machine *m);
+extern void free_profile(machine *m);
+extern int load_symbols(machine *m, const char *path);
+extern void profile_report(machine *m, FILE *f);
+extern int profile_folded(machine *m, FILE *f);
+
+#endif
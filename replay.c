@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "tty.h"
+#include "console.h"
+#include "sched.h"
+#include "replay.h"
+#include "machine.h"
+
+/*
+ * Deterministic mode
+ *
+ * With OPT_DETERMINISTIC set the TTYs stop depending on host timing: both
+ * units run on the scheduled model (see tty.c), as state machines stepped in
+ * virtual time, and idle loops are run rather than slept through. Input only
+ * reaches the guest at instruction boundaries chosen by the run engine, by
+ * way of a scheduled event (see sched.c): a byte is taken into the latch,
+ * which KSF tests and KRB empties, and TTY_IN's interrupt is raised there
+ * rather than by the console thread. WAI skips ahead to the next event, so
+ * the cycles a program takes depend on nothing but the program and its input.
+ *
+ * Once the guest has used the keyboard in a run, live input is looked for
+ * every REPLAY_POLL cycles, whenever the latch is empty, and the machine
+ * sleeps for REPLAY_WAIT_NS between looks if it is waiting in WAI. Recording
+ * logs each byte with the cycle it was latched on, and replaying latches the
+ * logged bytes on the same cycles instead of reading the console, which
+ * reproduces the run exactly. A log is the header followed by
+ * one record per byte: the cycles since the byte before (or since recording
+ * started) as a LEB128 varint, then the byte.
+ */
+
+/*
+ * Read the next byte to replay, or note that there are none left
+ */
+
+void replay_read(struct replay *r) {
+    unsigned long long delta = 0;
+    int shift = 0;
+    int c;
+
+    do {
+        if ((c = getc(r->replay)) == EOF || shift > 63) {
+            r->replay_byte = -1;
+            return;
+        }
+
+        delta |= (unsigned long long) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    if ((c = getc(r->replay)) == EOF) {
+        r->replay_byte = -1;
+        return;
+    }
+
+    r->replay_at += delta;
+    r->replay_byte = c;
+}
+
+/*
+ * Schedule the first input event of a run: the next byte to replay, if the
+ * keyboard is scheduled. Live input is only looked for once the guest asks
+ * for it (see replay_want), as with the threaded keyboard, so that programs
+ * that never read it leave stdin to the monitor.
+ */
+
+void replay_arm(machine *m) {
+    struct replay *r = &m->replay;
+    unsigned long long at = SCHED_NEVER;
+
+    r->poll.fire = replay_poll;
+    r->poll.device = 1;
+
+    if (tty_scheduled(m, TTY_IN) && r->replay != NULL && r->replay_byte >= 0)
+        at = r->replay_at;
+
+    schedule(m, &r->poll, at);
+}
+
+/*
+ * Called by the scheduled keyboard's IOTs, to start looking for live input at
+ * the next instruction boundary if it isn't already
+ */
+
+void replay_want(machine *m) {
+    struct replay *r = &m->replay;
+
+    if (r->replay == NULL && !r->poll.slot && !m->console.input_eof)
+        schedule(m, &r->poll, m->sched.now);
+}
+
+/*
+ * Input event
+ */
+
+void replay_poll(machine *m, unsigned long long now) {
+    struct replay *r = &m->replay;
+    uint8_t byte;
+
+    if (r->replay != NULL) {
+        if (r->replay_byte < 0) return;
+
+        if (r->latch >= 0) { // only if the run has diverged from the log
+            schedule(m, &r->poll, now + REPLAY_POLL);
+            return;
+        }
+
+        r->latch = r->replay_byte;
+        raise_irq(m, TTY_IN);
+
+        replay_read(r);
+        if (r->replay_byte >= 0) schedule(m, &r->poll, r->replay_at);
+
+        return;
+    }
+
+    if (r->latch < 0 && !console_getc(m, &byte)) {
+        r->latch = byte;
+        raise_irq(m, TTY_IN);
+
+        if (r->record != NULL) {
+            uint8_t rec[11];
+            unsigned long long delta = now - r->record_at;
+            size_t len = 0;
+
+            while (delta >= 0x80) {
+                rec[len++] = (delta & 0x7F) | 0x80;
+                delta >>= 7;
+            }
+
+            rec[len++] = delta;
+            fwrite(rec, 1, len, r->record);
+            fputc(byte, r->record);
+
+            r->record_at = now;
+        }
+    }
+
+    else if (r->latch < 0 && m->console.input_eof) return; // none to come
+
+    else if (r->latch < 0 && (m->zpage[FLAG] & 0x1E0) >> 5 == 4) {
+        struct timespec wait = {0, REPLAY_WAIT_NS}; // WAI, don't spin
+        nanosleep(&wait, NULL);
+    }
+
+    schedule(m, &r->poll, now + REPLAY_POLL);
+}
+
+/*
+ * Start recording the input latched from the console to a log
+ *
+ * return int: 0 on success, EBUSY if already recording or replaying, errno
+ * value if the file can't be written
+ */
+
+int start_record(machine *m, const char *path) {
+    struct replay *r = &m->replay;
+
+    if (r->record != NULL || r->replay != NULL) return EBUSY;
+    if ((r->record = fopen(path, "wb")) == NULL) return errno;
+
+    struct replay_header header = {REPLAY_MAGIC, REPLAY_VERSION};
+    fwrite(&header, sizeof(header), 1, r->record);
+
+    r->record_at = m->cycles;
+
+    return 0;
+}
+
+/*
+ * Start replaying a log, with its first cycle now and the latch empty
+ *
+ * return int: 0 on success, EBUSY if already recording or replaying, ENOEXEC
+ * if the file isn't a log, errno value if it can't be read
+ */
+
+int start_replay(machine *m, const char *path) {
+    struct replay *r = &m->replay;
+    struct replay_header header;
+
+    if (r->record != NULL || r->replay != NULL) return EBUSY;
+    if ((r->replay = fopen(path, "rb")) == NULL) return errno;
+
+    if (fread(&header, sizeof(header), 1, r->replay) != 1
+        || memcmp(header.magic, REPLAY_MAGIC, 4)
+        || header.version != REPLAY_VERSION) {
+        fclose(r->replay);
+        r->replay = NULL;
+        return ENOEXEC;
+    }
+
+    r->replay_at = m->cycles;
+    r->latch = -1;
+    replay_read(r);
+
+    return 0;
+}
+
+/*
+ * return int: 0 on success or if not recording, errno value if the log
+ * couldn't be written
+ */
+
+int stop_record(machine *m) {
+    struct replay *r = &m->replay;
+    if (r->record == NULL) return 0;
+
+    int result = ferror(r->record) ? EIO : 0;
+    if (fclose(r->record) && !result) result = errno;
+    r->record = NULL;
+
+    return result;
+}
+
+void stop_replay(machine *m) {
+    if (m->replay.replay != NULL) fclose(m->replay.replay);
+    m->replay.replay = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdio.h>
+
+#include "bus.h"
+#include "sched.h"
+
+/*
+ * Deterministic console input, recording and replay, see replay.c
+ */
+
+#define REPLAY_MAGIC "P17R"
+#define REPLAY_VERSION 1
+
+#define REPLAY_POLL 4096 // cycles between looks at the console for input
+#define REPLAY_WAIT_NS 1000000 // host sleep per poll while waiting for input
+
+struct replay_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct replay {
+    int latch; // input byte the guest can see, -1 if none
+    struct event poll; // next look for input or replayed byte
+    
+    FILE *record;
+    unsigned long long record_at; // cycle of the last byte recorded
+    
+    FILE *replay;
+    unsigned long long replay_at; // cycle of the next byte replayed
+    int replay_byte; // -1 once the file is used up
+};
+
+extern void replay_arm(machine *m);
+extern void replay_poll(machine *m, unsigned long long now);
+extern void replay_want(machine *m);
+extern int start_record(machine *m, const char *path);
+extern int start_replay(machine *m, const char *path);
+extern int stop_record(machine *m);
+extern void stop_replay(machine *m);
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "bus.h"
+#include "sched.h"
+#include "machine.h"
+
+/*
+ * Virtual-time scheduler
+ *
+ * Events are due on a cycle of m->cycles and kept in a binary min-heap keyed
+ * on it, so the run engine only compares its cycle count against the root at
+ * each instruction boundary, and finding, adding or moving an event costs
+ * O(log n). Everything runs on the machine's own thread: an event is a
+ * function called by the run engine at the first instruction boundary on or
+ * after its cycle (or during WAI, see run_loop), with that cycle as now.
+ * Devices modelled this way are state machines that schedule their own next
+ * step, and need no thread, lock or condition variable to talk to the CPU.
+ *
+ * The profiler and the polling of deterministic input are events too, as are
+ * the scheduled TTY units (see tty.c), disk and timer. Events stay queued
+ * while the machine is stopped, and fire when it reaches their cycle on the
+ * next run.
+ */
+
+static void swap(struct sched *s, size_t a, size_t b) {
+    struct event *e = s->heap[a];
+
+    s->heap[a] = s->heap[b];
+    s->heap[b] = e;
+    s->heap[a]->slot = a + 1;
+    s->heap[b]->slot = b + 1;
+}
+
+static void sift_up(struct sched *s, size_t x) {
+    while (x && s->heap[(x - 1) / 2]->at > s->heap[x]->at) {
+        swap(s, x, (x - 1) / 2);
+        x = (x - 1) / 2;
+    }
+}
+
+static void sift_down(struct sched *s, size_t x) {
+    while (1) {
+        size_t min = x;
+        size_t left = 2 * x + 1;
+        size_t right = left + 1;
+
+        if (left < s->n && s->heap[left]->at < s->heap[min]->at) min = left;
+        if (right < s->n && s->heap[right]->at < s->heap[min]->at) min = right;
+        if (min == x) return;
+
+        swap(s, x, min);
+        x = min;
+    }
+}
+
+/*
+ * Queue an event for cycle at, or move it there if it is already queued.
+ * SCHED_NEVER cancels it.
+ *
+ * return int: 0 on success, ENOSPC if the queue is full
+ */
+
+int schedule(machine *m, struct event *e, unsigned long long at) {
+    struct sched *s = &m->sched;
+
+    if (at == SCHED_NEVER) {
+        cancel(m, e);
+        return 0;
+    }
+
+    if (e->slot) {
+        unsigned long long was = e->at;
+        e->at = at;
+
+        if (at < was) sift_up(s, e->slot - 1);
+        else sift_down(s, e->slot - 1);
+
+        return 0;
+    }
+
+    if (s->n == SCHED_SIZE) return ENOSPC;
+
+    e->at = at;
+    e->slot = s->n + 1;
+    s->heap[s->n++] = e;
+    sift_up(s, s->n - 1);
+
+    if (e->device) s->devices++;
+
+    return 0;
+}
+
+/*
+ * Take an event off the queue, if it is on it
+ */
+
+void cancel(machine *m, struct event *e) {
+    struct sched *s = &m->sched;
+    if (!e->slot) return;
+
+    size_t x = e->slot - 1;
+
+    e->slot = 0;
+    if (e->device) s->devices--;
+
+    if (x == --s->n) return;
+
+    s->heap[x] = s->heap[s->n];
+    s->heap[x]->slot = x + 1;
+    sift_down(s, x);
+    sift_up(s, x);
+}
+
+/*
+ * Fire every event due by cycle now, earliest first. Events may reschedule
+ * themselves or each other while this runs.
+ *
+ * return unsigned long long: cycle of the next event, SCHED_NEVER if none
+ */
+
+unsigned long long sched_run(machine *m, unsigned long long now) {
+    struct sched *s = &m->sched;
+
+    s->now = now;
+
+    while (s->n && s->heap[0]->at <= now) {
+        struct event *e = s->heap[0];
+
+        cancel(m, e);
+        e->fire(m, now);
+    }
+
+    return sched_next(s);
+}
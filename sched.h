@@ -0,0 +1,39 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include "bus.h"
+
+/*
+ * Virtual-time event queue, see sched.c
+ */
+
+#define SCHED_SIZE 16 // events that can be queued at once
+#define SCHED_NEVER ((unsigned long long) -1)
+
+struct event {
+    unsigned long long at; // cycle it is due on, counted as in m->cycles
+    void (*fire)(machine *m, unsigned long long now);
+    int device; // a device's event, which WAI skips ahead to (see run_loop)
+    size_t slot; // position in the heap plus one, 0 while not queued
+};
+
+struct sched {
+    struct event *heap[SCHED_SIZE];
+    size_t n;
+    size_t devices; // device events queued
+    unsigned long long now; // cycle of the instruction running, for devices
+};
+
+/*
+ * Cycle of the earliest event queued, SCHED_NEVER if none
+ */
+
+static inline unsigned long long sched_next(struct sched *s) {
+    return s->n ? s->heap[0]->at : SCHED_NEVER;
+}
+
+extern int schedule(machine *m, struct event *e, unsigned long long at);
+extern void cancel(machine *m, struct event *e);
+extern unsigned long long sched_run(machine *m, unsigned long long now);
+
+#endif
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "tty.h"
+#include "xlat.h"
+#include "snapshot.h"
+#include "machine.h"
+
+/*
+ * Snapshots and copy-on-write forks
+ *
+ * A snapshot holds everything the guest can see: the CPU registers, cycle
+ * count and cycle state, interrupt state, the TTY command queues, which TTYs
+ * are scheduled and whether the printer is ready, the timer, the disk's
+ * flags, the console input latch and every RAM page. Other host-side state
+ * (the console rings, options and caches) is not part of it, and restoring
+ * flushes the caches. A count the timer or a scheduled printer is running is
+ * kept as the cycles or ticks it has left and started again from there, on
+ * whichever model the restored machine's timer runs on; a disk transfer in
+ * flight can't be kept, so a machine can't be saved or forked until it has
+ * finished.
+ *
+ * Forking shares RAM between machines instead of copying it. share_machine
+ * moves the machine's memory blocks into a reference counted store, which
+ * chains to the store it was forked from in turn, and marks every RAM page
+ * shared so that the bus unshares it before it is next written (see bus.c).
+ * Unsharing copies the one page into the arena (see machine.c), so a fork
+ * costs PAGE_SIZE words for each page either side writes to, and nothing for
+ * pages only read. The parent keeps running on the shared pages the same way.
+ */
+
+struct store {
+    atomic_int refs;
+    struct mem_block *blocks;
+    struct store *prev; // store this one's machine was forked from, if any
+};
+
+struct snapshot_state {
+    uint64_t cycles;
+    data_width_t zpage[FLAG + 1];
+    data_width_t switches;
+    data_width_t mbr;
+    addr_width_t mar;
+    uint16_t df;
+    uint16_t ib;
+    uint16_t if_;
+    uint8_t zp;
+    uint8_t int_enable;
+    uint8_t int_waiting;
+    uint8_t jump_int_lockout;
+    data_width_t irq_mask;
+    uint32_t irq_pending;
+
+    data_width_t tty_cmd[TTY_IN + 1][QUEUE_SIZE];
+    uint32_t tty_head[TTY_IN + 1];
+    uint32_t tty_tail[TTY_IN + 1];
+    uint64_t tty_left; // before the printer is ready, if it isn't
+    uint8_t tty_scheduled[TTY_IN + 1];
+    uint8_t tty_ready;
+
+    uint64_t timer_period;
+    uint64_t timer_left; // before the count next runs out, if armed
+    data_width_t timer_mode;
+    data_width_t timer_count_mode;
+    uint8_t timer_flag;
+    uint8_t timer_armed;
+
+    uint8_t disk_done;
+    uint8_t disk_error;
+    int16_t replay_latch;
+};
+
+void release_store(struct store *store) {
+    while (store != NULL && atomic_fetch_sub(&store->refs, 1) == 1) {
+        struct store *prev = store->prev;
+
+        free_blocks(store->blocks);
+        free(store);
+
+        store = prev;
+    }
+}
+
+/*
+ * Make every RAM page of a stopped machine copy-on-write, so that forks can
+ * share them. Once done, until the machine next writes to memory, this and
+ * fork_machine only read the machine, so any number of threads may fork it
+ * at once.
+ *
+ * return int: 0 on success, ENOMEM if out of memory
+ */
+
+int share_machine(machine *m) {
+    if (m->blocks != NULL) {
+        struct store *store = malloc(sizeof(struct store));
+        if (store == NULL) return ENOMEM;
+
+        atomic_init(&store->refs, 1);
+        store->blocks = m->blocks;
+        store->prev = m->store; // our reference passes to the new store
+
+        m->blocks = NULL;
+        m->store = store;
+    }
+
+    for (size_t pgn = 0; pgn < MAX_PAGES; pgn++) {
+        struct bus_page *page = bus_page(&m->bus, pgn);
+
+        if (page == NULL) pgn += FIELD_PAGES - 1; // skip the empty field
+        else if (page->ram != NULL && !page->shared) share_ram(m, pgn);
+    }
+
+    return 0;
+}
+
+/*
+ * Fork a stopped machine: the child starts where the parent stopped, with the
+ * same registers, cycle count, interrupt state, TTY queues, timer, disk
+ * flags, console input latch, options and switches, and a copy-on-write view
+ * of its RAM. The child's TTYs, timer and disk run on the same models as the
+ * parent's. Other units the parent has installed are not carried over. The child's console is on
+ * the given file descriptors.
+ *
+ * return machine *: the child, NULL if out of memory, the timer can't be
+ * started or the parent has a disk transfer in flight
+ */
+
+machine *fork_machine(machine *parent, int in_fd, int out_fd) {
+    if (disk_busy(parent) || share_machine(parent)) return NULL;
+
+    machine *m = new_machine(in_fd, out_fd);
+    if (m == NULL) return NULL;
+
+    if (parent->store != NULL) atomic_fetch_add(&parent->store->refs, 1);
+    m->store = parent->store;
+
+    for (size_t pgn = 0; pgn < MAX_PAGES; pgn++) {
+        struct bus_page *page = bus_page(&parent->bus, pgn);
+
+        if (page == NULL) pgn += FIELD_PAGES - 1;
+        if (page == NULL || page->ram == NULL) continue;
+
+        if (install_ram(m, pgn, page->ram)) {
+            free_machine(m);
+            return NULL;
+        }
+
+        share_ram(m, pgn);
+    }
+
+    memcpy(m->zpage, parent->zpage, sizeof(m->zpage));
+    m->cycles = parent->cycles;
+    m->switches = parent->switches;
+    m->options = parent->options;
+    m->mar = parent->mar;
+    m->mbr = parent->mbr;
+    m->df = parent->df;
+    m->ib = parent->ib;
+    m->if_ = parent->if_;
+    m->zp = parent->zp;
+    m->jump_int_lockout = parent->jump_int_lockout;
+
+    atomic_store(&m->irq_pending, atomic_load(&parent->irq_pending));
+    m->irq_mask = parent->irq_mask;
+    m->int_enable = parent->int_enable;
+    m->int_waiting = parent->int_waiting;
+
+    for (int x = 0; x <= TTY_IN; x++) {
+        struct tty_unit *u = &parent->tty[x];
+
+        pthread_mutex_lock(&u->lock);
+        memcpy(m->tty[x].cmd, u->cmd, sizeof(u->cmd));
+        m->tty[x].head = u->head;
+        m->tty[x].tail = u->tail;
+        pthread_mutex_unlock(&u->lock);
+
+        m->tty[x].scheduled = u->scheduled;
+    }
+
+    tty_resume(m, parent->tty[TTY_OUT].ready, tty_pending(parent));
+
+    atomic_store(&m->disk.done, atomic_load(&parent->disk.done));
+    atomic_store(&m->disk.error, atomic_load(&parent->disk.error));
+    m->disk.scheduled = parent->disk.scheduled;
+    m->replay.latch = parent->replay.latch;
+
+    int armed;
+    unsigned long long left = timer_pending(parent, &armed);
+
+    m->timer.scheduled = parent->timer.scheduled;
+    m->timer.mode = parent->timer.mode;
+    m->timer.count_mode = parent->timer.count_mode;
+    m->timer.period = parent->timer.period;
+    atomic_store(&m->timer.flag, atomic_load(&parent->timer.flag));
+
+    if (timer_resume(m, armed, left)) {
+        free_machine(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+/*
+ * Save a snapshot of a stopped machine.
+ *
+ * return int: 0 on success, EBUSY if a disk transfer is in flight, errno value
+ * if the file can't be written
+ */
+
+int save_snapshot(machine *m, const char *path) {
+    struct snapshot_header header;
+    struct snapshot_state state;
+    int armed;
+
+    if (disk_busy(m)) return EBUSY;
+
+    memset(&header, 0, sizeof(header));
+    memset(&state, 0, sizeof(state));
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.page_size = PAGE_SIZE;
+    header.state_size = sizeof(state);
+
+    for (size_t pgn = 0; pgn < MAX_PAGES; pgn++)
+        if (ram_ptr(&m->bus, pgn * PAGE_SIZE) != NULL) header.pages++;
+
+    state.cycles = m->cycles;
+    memcpy(state.zpage, m->zpage, sizeof(state.zpage));
+    state.switches = m->switches;
+    state.mbr = m->mbr;
+    state.mar = m->mar;
+    state.df = m->df;
+    state.ib = m->ib;
+    state.if_ = m->if_;
+    state.zp = m->zp;
+    state.int_enable = m->int_enable;
+    state.int_waiting = m->int_waiting;
+    state.jump_int_lockout = m->jump_int_lockout;
+    state.irq_mask = m->irq_mask;
+    state.irq_pending = atomic_load(&m->irq_pending);
+
+    for (int x = 0; x <= TTY_IN; x++) {
+        struct tty_unit *u = &m->tty[x];
+
+        pthread_mutex_lock(&u->lock);
+        memcpy(state.tty_cmd[x], u->cmd, sizeof(u->cmd));
+        state.tty_head[x] = u->head;
+        state.tty_tail[x] = u->tail;
+        pthread_mutex_unlock(&u->lock);
+
+        state.tty_scheduled[x] = u->scheduled;
+    }
+
+    state.tty_ready = m->tty[TTY_OUT].ready;
+    state.tty_left = tty_pending(m);
+
+    state.timer_left = timer_pending(m, &armed);
+    state.timer_armed = armed;
+    state.timer_period = m->timer.period;
+    state.timer_mode = m->timer.mode;
+    state.timer_count_mode = m->timer.count_mode;
+    state.timer_flag = atomic_load(&m->timer.flag);
+
+    state.disk_done = atomic_load(&m->disk.done);
+    state.disk_error = atomic_load(&m->disk.error);
+    state.replay_latch = m->replay.latch;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) return errno;
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(&state, sizeof(state), 1, f);
+
+    for (uint32_t pgn = 0; pgn < MAX_PAGES; pgn++) {
+        data_width_t *page = ram_ptr(&m->bus, pgn * PAGE_SIZE);
+        if (page == NULL) continue;
+
+        fwrite(&pgn, sizeof(pgn), 1, f);
+        fwrite(page, sizeof(data_width_t), PAGE_SIZE, f);
+    }
+
+    int result = ferror(f) ? EIO : 0;
+    if (fclose(f) && !result) result = errno;
+
+    return result;
+}
+
+/*
+ * A page record read from a snapshot, and where it is to go
+ */
+
+struct page_record {
+    uint32_t pgn;
+    data_width_t *ram; // private page to copy into, zero_page if all zeroes
+    data_width_t words[PAGE_SIZE];
+};
+
+/*
+ * Read every page record of a snapshot, checking that each fits the bus
+ *
+ * return int: 0 on success, EINVAL if a page is outside memory or belongs to
+ * a unit, EIO if the file is cut short
+ */
+
+int read_pages(machine *m, FILE *f, struct page_record *records,
+    uint32_t pages) {
+
+    for (uint32_t x = 0; x < pages; x++) {
+        struct page_record *rec = &records[x];
+
+        if (fread(&rec->pgn, sizeof(rec->pgn), 1, f) != 1
+            || fread(rec->words, sizeof(data_width_t), PAGE_SIZE, f)
+            != PAGE_SIZE) return EIO;
+
+        if (rec->pgn >= MAX_PAGES) return EINVAL;
+
+        struct bus_page *entry = bus_page(&m->bus, rec->pgn);
+
+        if (entry != NULL && entry->ram == NULL
+            && (entry->read != NULL || entry->write != NULL))
+            return EINVAL; // belongs to a unit
+    }
+
+    return 0;
+}
+
+/*
+ * Find or allocate the memory each record is to go to, so that nothing can
+ * fail once the machine starts being overwritten. Pages that are private RAM
+ * are overwritten in place; shared or missing ones get a new private page, or
+ * the zero page if the record is all zeroes. Pages taken for a load that then
+ * fails stay with the machine, unused.
+ *
+ * return int: 0 on success, ENOMEM if out of memory
+ */
+
+int place_pages(machine *m, struct page_record *records, uint32_t pages) {
+    for (uint32_t x = 0; x < pages; x++) {
+        struct page_record *rec = &records[x];
+        struct bus_page *entry;
+        data_width_t any = 0;
+
+        int result = make_page(m, rec->pgn, &entry);
+        if (result) return result;
+
+        for (size_t y = 0; y < PAGE_SIZE; y++) any |= rec->words[y];
+
+        if (entry->ram != NULL && !entry->shared) rec->ram = entry->ram;
+        else if (!any) rec->ram = zero_page;
+        else if ((rec->ram = new_page(m)) == NULL) return ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Restore a snapshot into a stopped machine. RAM pages the machine has that
+ * the snapshot doesn't are left alone. The whole file is read and checked,
+ * and the memory for it found, before anything is changed, so on failure the
+ * machine is as it was.
+ *
+ * return int: 0 on success, ENOEXEC if the file isn't a snapshot, EINVAL if it
+ * was saved by a different build or doesn't fit the bus, EBUSY if a disk
+ * transfer is in flight, ENOMEM if out of memory, or errno value if it can't
+ * be read or the timer can't be started
+ */
+
+int load_snapshot(machine *m, const char *path) {
+    if (disk_busy(m)) return EBUSY;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return errno;
+
+    struct snapshot_header header;
+    struct snapshot_state state;
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, SNAPSHOT_MAGIC, 4)) {
+        fclose(f);
+        return ENOEXEC;
+    }
+
+    if (header.version != SNAPSHOT_VERSION || header.page_size != PAGE_SIZE
+        || header.state_size != sizeof(state) || header.pages > MAX_PAGES) {
+        fclose(f);
+        return EINVAL;
+    }
+
+    struct page_record *records = malloc(header.pages
+        * sizeof(struct page_record));
+    int result = records == NULL && header.pages ? ENOMEM : 0;
+
+    if (!result && fread(&state, sizeof(state), 1, f) != 1) result = EIO;
+    if (!result) result = read_pages(m, f, records, header.pages);
+
+    fclose(f);
+
+    if (!result) result = place_pages(m, records, header.pages);
+
+    /*
+     * The timer is the one part that can still fail, so it goes first, and
+     * is put back as it was if it can't be started
+     */
+
+    struct timer *t = &m->timer;
+    data_width_t old_mode = t->mode;
+    data_width_t old_count_mode = t->count_mode;
+    unsigned long long old_period = t->period;
+    int old_flag = atomic_load(&t->flag);
+    int old_armed;
+    unsigned long long old_left = timer_pending(m, &old_armed);
+    unsigned long long old_cycles = m->cycles;
+
+    if (!result) {
+        m->cycles = state.cycles; // the count's ticks left are from here
+        t->mode = state.timer_mode;
+        t->count_mode = state.timer_count_mode;
+        t->period = state.timer_period;
+        atomic_store(&t->flag, state.timer_flag);
+
+        result = timer_resume(m, state.timer_armed, state.timer_left);
+
+        if (result) {
+            m->cycles = old_cycles;
+            t->mode = old_mode;
+            t->count_mode = old_count_mode;
+            t->period = old_period;
+            atomic_store(&t->flag, old_flag);
+            timer_resume(m, old_armed, old_left);
+        }
+    }
+
+    if (result) {
+        free(records);
+        return result;
+    }
+
+    for (uint32_t x = 0; x < header.pages; x++) {
+        struct page_record *rec = &records[x];
+
+        if (rec->ram == zero_page) alloc_page(m, rec->pgn);
+        else {
+            memcpy(rec->ram, rec->words, sizeof(rec->words));
+            install_ram(m, rec->pgn, rec->ram);
+        }
+    }
+
+    free(records);
+
+    predecode_flush(m);
+    xlat_flush(m);
+
+    memcpy(m->zpage, state.zpage, sizeof(m->zpage));
+    m->switches = state.switches;
+    m->mbr = state.mbr;
+    m->mar = state.mar;
+    m->df = state.df;
+    m->ib = state.ib;
+    m->if_ = state.if_;
+    m->zp = state.zp;
+    m->int_enable = state.int_enable;
+    m->int_waiting = state.int_waiting;
+    m->jump_int_lockout = state.jump_int_lockout;
+    m->irq_mask = state.irq_mask;
+    atomic_store(&m->irq_pending, state.irq_pending);
+
+    for (int x = 0; x <= TTY_IN; x++) {
+        struct tty_unit *u = &m->tty[x];
+
+        pthread_mutex_lock(&u->lock);
+        memcpy(u->cmd, state.tty_cmd[x], sizeof(u->cmd));
+        u->head = state.tty_head[x];
+        u->tail = state.tty_tail[x];
+        pthread_mutex_unlock(&u->lock);
+
+        u->scheduled = state.tty_scheduled[x];
+    }
+
+    tty_resume(m, state.tty_ready, state.tty_left);
+
+    atomic_store(&m->disk.done, state.disk_done);
+    atomic_store(&m->disk.error, state.disk_error);
+    m->replay.latch = state.replay_latch;
+
+    return 0;
+}
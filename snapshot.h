@@ -0,0 +1,34 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "bus.h"
+
+/*
+ * Snapshot file format. A header is followed by a struct snapshot_state, then
+ * by one record per RAM page: a uint32_t page number and PAGE_SIZE words, in
+ * host byte order. state_size guards against a snapshot from a build with a
+ * different layout.
+ */
+
+#define SNAPSHOT_MAGIC "P17S"
+#define SNAPSHOT_VERSION 3
+
+struct store;
+
+struct snapshot_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t page_size;
+    uint32_t state_size;
+    uint32_t pages; // number of page records
+};
+
+extern int save_snapshot(machine *m, const char *path);
+extern int load_snapshot(machine *m, const char *path);
+extern int share_machine(machine *m);
+extern machine *fork_machine(machine *parent, int in_fd, int out_fd);
+extern void release_store(struct store *store);
+
+#endif
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "sched.h"
+#include "timer.h"
+#include "machine.h"
+
+/*
+ * Interval timer
+ *
+ * Unit 5 counts down from a count the guest loads, sets its flag and raises
+ * its interrupt when the count runs out, and then either stops (one-shot) or
+ * starts the same count again (periodic). The IOTs are:
+ * 1 CSF - skip if the flag is set
+ * 2 CCF - clear the flag
+ * 3 CMO - set the mode from accumulator, for the next CST: TIMER_PERIODIC,
+ *         and the tick in TIMER_SCALE (0 for 1, 1 for 16, 2 for 256, 3 for
+ *         4096)
+ * 4 CST - clear the flag and start counting accumulator ticks, 0 for 65536
+ * 5 CSP - stop
+ * 6 CRD - read the ticks left into accumulator, 0 if stopped
+ *
+ * and all of them complete at once.
+ *
+ * On the scheduled model (see sched.c) a tick is a micro-cycle, and the count
+ * is an event, so a guest waiting for it with WAI or a skip loop goes straight
+ * to the cycle it runs out on rather than executing anything meanwhile (see
+ * run_loop and idle). On the threaded model a tick is TIMER_TICK_NS of host
+ * time, counted by a thread of the timer's own, started the first time it is
+ * needed; the guest sleeps in WAI or the idle loop detector until then.
+ */
+
+/*
+ * Returns nonzero if the timer runs on the scheduled model
+ */
+
+int timer_scheduled(machine *m) {
+    return m->timer.scheduled || m->options & OPT_DETERMINISTIC;
+}
+
+/*
+ * Scheduled model's event, when the count runs out
+ */
+
+void timer_tick(machine *m, unsigned long long now) {
+    struct timer *t = &m->timer;
+
+    atomic_store(&t->flag, 1);
+
+    // from when it was due rather than now, so the period doesn't drift
+    if (t->count_mode & TIMER_PERIODIC)
+        schedule(m, &t->tick, t->tick.at + t->period);
+
+    raise_irq(m, TIMER);
+}
+
+void init_timer(machine *m) {
+    struct timer *t = &m->timer;
+    pthread_condattr_t attr;
+
+    atomic_init(&t->flag, 0);
+    t->tick.fire = timer_tick;
+    t->tick.device = 1;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wake, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void free_timer(machine *m) {
+    struct timer *t = &m->timer;
+
+    if (t->started) {
+        pthread_mutex_lock(&t->lock);
+        t->run = 0;
+        pthread_cond_broadcast(&t->wake);
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_join(t->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->wake);
+}
+
+/*
+ * Move a time on by ticks of TIMER_TICK_NS
+ */
+
+void timer_add(struct timespec *ts, unsigned long long ticks) {
+    unsigned long long ns = ts->tv_nsec + ticks * TIMER_TICK_NS;
+
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+/*
+ * Returns nonzero if a is before b
+ */
+
+int timer_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec
+        || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Threaded model's thread, vargp is the machine
+ */
+
+void *timer_thread(void *vargp) {
+    machine *m = (machine *) vargp;
+    struct timer *t = &m->timer;
+
+    pthread_mutex_lock(&t->lock);
+
+    while (t->run) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (!t->armed) pthread_cond_wait(&t->wake, &t->lock);
+        else if (timer_before(&now, &t->deadline))
+            pthread_cond_timedwait(&t->wake, &t->lock, &t->deadline);
+        else {
+            atomic_store(&t->flag, 1);
+
+            if (t->count_mode & TIMER_PERIODIC) {
+                timer_add(&t->deadline, t->period);
+
+                // fallen more than a period behind, e.g. the host was busy
+                if (timer_before(&t->deadline, &now)) {
+                    t->deadline = now;
+                    timer_add(&t->deadline, t->period);
+                }
+            }
+            else t->armed = 0;
+
+            raise_irq(m, TIMER);
+        }
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+/*
+ * Stop the count on either model
+ */
+
+void timer_stop(machine *m) {
+    struct timer *t = &m->timer;
+
+    cancel(m, &t->tick);
+
+    pthread_mutex_lock(&t->lock);
+    t->armed = 0;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Shift from a count to ticks, for the scale in a mode
+ */
+
+int timer_scale(data_width_t mode) {
+    return ((mode & TIMER_SCALE) >> 1) * 4;
+}
+
+/*
+ * Arm a stopped timer to run out ticks after now, on the model the timer is
+ * running on now
+ *
+ * return int: 0 on success, ENOSPC if the scheduler's queue is full, errno
+ * value if the thread can't be started
+ */
+
+int timer_arm(machine *m, unsigned long long ticks, unsigned long long now) {
+    struct timer *t = &m->timer;
+
+    if (timer_scheduled(m)) return schedule(m, &t->tick, now + ticks);
+
+    if (!t->started) {
+        t->run = 1;
+
+        int result = pthread_create(&t->thread, NULL, timer_thread, (void *) m);
+        if (result) return result;
+
+        t->started = 1;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t->deadline);
+    timer_add(&t->deadline, ticks);
+    t->armed = 1;
+    pthread_cond_broadcast(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+
+    return 0;
+}
+
+/*
+ * Start a count in the mode set by CMO. The mode is latched here, as the
+ * thread reads it while counting and CMO may change it meanwhile; the thread
+ * doesn't look at it until armed is set under the lock in timer_arm.
+ *
+ * return int: as timer_arm
+ */
+
+int timer_start(machine *m, unsigned long long count) {
+    struct timer *t = &m->timer;
+
+    timer_stop(m);
+    atomic_store(&t->flag, 0);
+    t->count_mode = t->mode;
+    t->period = count << timer_scale(t->count_mode);
+
+    return timer_arm(m, t->period, m->sched.now);
+}
+
+/*
+ * Ticks left before the count runs out, 0 if stopped
+ */
+
+unsigned long long timer_left(machine *m) {
+    struct timer *t = &m->timer;
+    unsigned long long left = 0;
+
+    if (t->tick.slot)
+        return t->tick.at > m->sched.now ? t->tick.at - m->sched.now : 0;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->armed) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (timer_before(&now, &t->deadline))
+            left = ((t->deadline.tv_sec - now.tv_sec) * 1000000000ULL
+                + t->deadline.tv_nsec - now.tv_nsec) / TIMER_TICK_NS;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return left;
+}
+
+/*
+ * Ticks a stopped machine's count has left, counted from m->cycles, for
+ * snapshots and forks. Sets armed to whether a count is running at all, as
+ * one that is due but not yet fired has none left.
+ */
+
+unsigned long long timer_pending(machine *m, int *armed) {
+    struct timer *t = &m->timer;
+
+    if (t->tick.slot) {
+        *armed = 1;
+        return t->tick.at > m->cycles ? t->tick.at - m->cycles : 0;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    *armed = t->armed;
+    pthread_mutex_unlock(&t->lock);
+
+    return *armed ? timer_left(m) : 0;
+}
+
+/*
+ * Carry on the count in count_mode and period of a stopped machine, with left
+ * ticks to go before it next runs out, or leave it stopped if not armed
+ *
+ * return int: as timer_arm
+ */
+
+int timer_resume(machine *m, int armed, unsigned long long left) {
+    timer_stop(m);
+
+    return armed ? timer_arm(m, left, m->cycles) : 0;
+}
+
+int timer_attn(machine *m, size_t unit, data_width_t cmd) {
+    struct timer *t = &m->timer;
+    int acc = get_flag_acc(m);
+    unsigned long long left;
+    int result = 0;
+
+    switch (cmd) {
+        case 0x1: // CSF
+            if (atomic_load(&t->flag)) m->zpage[PC]++;
+            break;
+        case 0x2: // CCF
+            atomic_store(&t->flag, 0);
+            break;
+        case 0x3: // CMO
+            t->mode = m->zpage[acc] & (TIMER_PERIODIC | TIMER_SCALE);
+            break;
+        case 0x4: // CST
+            result = timer_start(m, m->zpage[acc] ? m->zpage[acc] : 65536ULL);
+            break;
+        case 0x5: // CSP
+            timer_stop(m);
+            break;
+        case 0x6: // CRD
+            left = timer_left(m) >> timer_scale(t->count_mode);
+            m->zpage[acc] = left > 0xFFFF ? 0xFFFF : left;
+            break;
+    }
+
+    if (!result) io_complete(m);
+
+    return result;
+}
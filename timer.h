@@ -0,0 +1,55 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bus.h"
+#include "sched.h"
+
+#define TIMER 5
+
+#define TIMER_TICK_NS 1000 // length of a tick on the threaded model
+
+/*
+ * Mode bits, see CMO
+ */
+
+#define TIMER_PERIODIC 0x1
+#define TIMER_SCALE 0x6 // count in ticks of 16^n, n in these bits
+
+/*
+ * Per-machine timer state
+ */
+
+struct timer {
+    int scheduled; // count micro-cycles rather than host time
+    data_width_t mode; // for the next CST
+    data_width_t count_mode; // latched by CST, for the count last started
+    unsigned long long period; // in ticks, of the count last started
+    atomic_int flag;
+
+    struct event tick; // scheduled model: the count runs out
+
+    /*
+     * Threaded model, counting down to deadline on CLOCK_MONOTONIC
+     */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // started, stopped, or the thread is to exit
+    pthread_t thread;
+    int started;
+    int run;
+    int armed;
+    struct timespec deadline;
+};
+
+extern int timer_scheduled(machine *m);
+extern void init_timer(machine *m);
+extern void free_timer(machine *m);
+extern unsigned long long timer_pending(machine *m, int *armed);
+extern int timer_resume(machine *m, int armed, unsigned long long left);
+extern int timer_attn(machine *m, size_t unit, data_width_t cmd);
+
+#endif
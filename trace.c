@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "trace.h"
+#include "machine.h"
+
+/*
+ * Execution trace
+ *
+ * While tracing is on, IFETCH retires the instruction before it into a ring of
+ * the last size entries: its address and word, noted when it was fetched, and
+ * the accumulator it used, the link and MAR as it left them. The ring is only
+ * written by the machine's own thread, so an entry costs a few stores and no
+ * locking, and while tracing is off IFETCH pays one test of the ring pointer.
+ * Translated blocks are not run while tracing, so that every instruction goes
+ * through IFETCH. The last instruction before the machine stops is retired by
+ * whatever reads the ring next.
+ *
+ * A streaming thread can follow the ring and write it to a file as it fills,
+ * coded as in trace.h. The machine never waits for it: if it falls more than
+ * a ring behind, the entries overwritten meanwhile are recorded as a gap.
+ */
+
+#define TRACE_CHUNK 4096 // entries streamed at a time
+#define TRACE_POLL_NS 1000000 // streaming thread's sleep when it has caught up
+
+/*
+ * Retire the instruction in flight, if any. Called by IFETCH, and by anything
+ * reading the ring while the machine is stopped.
+ */
+
+void trace_retire(machine *m) {
+    struct trace *t = &m->trace;
+    if (!t->pending) return;
+
+    unsigned long long head = atomic_load_explicit(&t->head,
+        memory_order_relaxed);
+    struct trace_entry *e = &t->ring[head & (t->size - 1)];
+
+    *e = t->next;
+    e->reg = get_flag_acc(m);
+    e->acc = m->zpage[e->reg];
+    e->link = m->zpage[FLAG] & (1 << LK);
+    e->ea = m->mar;
+
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+    t->pending = 0;
+}
+
+/*
+ * Start tracing into a new ring of at least size entries, discarding any
+ * entries traced so far. The machine must be stopped.
+ *
+ * return int: 0 on success, EBUSY if streaming, ENOMEM if out of memory
+ */
+
+int trace_start(machine *m, size_t size) {
+    struct trace *t = &m->trace;
+
+    if (atomic_load(&t->streaming)) return EBUSY;
+
+    size_t pow = 1;
+    while (pow < size) pow <<= 1;
+
+    struct trace_entry *ring = calloc(pow, sizeof(struct trace_entry));
+    if (ring == NULL) return ENOMEM;
+
+    free(t->ring);
+    t->ring = ring;
+    t->size = pow;
+    t->pending = 0;
+    atomic_store(&t->head, 0);
+
+    return 0;
+}
+
+/*
+ * Stop tracing and streaming, and free the ring
+ */
+
+void trace_stop(machine *m) {
+    trace_unstream(m);
+
+    free(m->trace.ring);
+    m->trace.ring = NULL;
+    m->trace.pending = 0;
+}
+
+/*
+ * Save the ring to a trace file, oldest entry first, preceded by a gap for
+ * the entries it no longer holds.
+ *
+ * return int: 0 on success, EINVAL if not tracing, ENOMEM if out of memory,
+ * errno value if the file can't be written
+ */
+
+int trace_save(machine *m, const char *path) {
+    struct trace *t = &m->trace;
+    if (t->ring == NULL) return EINVAL;
+
+    struct trace_codec *c = calloc(1, sizeof(struct trace_codec));
+    if (c == NULL) return ENOMEM;
+
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) {
+        free(c);
+        return errno;
+    }
+
+    trace_retire(m);
+
+    unsigned long long head = atomic_load(&t->head);
+    unsigned long long first = head > t->size ? head - t->size : 0;
+    struct trace_header header = {TRACE_MAGIC, TRACE_VERSION};
+    uint8_t rec[TRACE_RECORD_MAX];
+
+    fwrite(&header, sizeof(header), 1, f);
+
+    if (first) fwrite(rec, 1, trace_encode_gap(first, rec) - rec, f);
+
+    for (unsigned long long x = first; x < head; x++)
+        fwrite(rec, 1, trace_encode(c, &t->ring[x & (t->size - 1)], rec) - rec,
+            f);
+
+    free(c);
+
+    int result = ferror(f) ? EIO : 0;
+    if (fclose(f) && !result) result = errno;
+
+    return result;
+}
+
+/*
+ * Print the last count entries in the ring, oldest first
+ */
+
+void trace_show(machine *m, FILE *f, size_t count) {
+    struct trace *t = &m->trace;
+    if (t->ring == NULL) return;
+
+    trace_retire(m);
+
+    unsigned long long head = atomic_load(&t->head);
+    if (count > t->size) count = t->size;
+    if (count > head) count = head;
+
+    for (unsigned long long x = head - count; x < head; x++)
+        trace_print(f, &t->ring[x & (t->size - 1)]);
+}
+
+/*
+ * Streaming thread, see trace_stream
+ */
+
+void *streamer(void *vm) {
+    machine *m = (machine *) vm;
+    struct trace *t = &m->trace;
+
+    struct trace_codec *c = calloc(1, sizeof(struct trace_codec));
+    struct trace_entry *buf = malloc(TRACE_CHUNK * sizeof(struct trace_entry));
+    uint8_t *out = malloc(TRACE_CHUNK * TRACE_RECORD_MAX + TRACE_RECORD_MAX);
+
+    if (c == NULL || buf == NULL || out == NULL) {
+        t->error = ENOMEM;
+        free(c);
+        free(buf);
+        free(out);
+        return NULL;
+    }
+
+    while (1) {
+        int more = atomic_load(&t->streaming);
+        unsigned long long head = atomic_load_explicit(&t->head,
+            memory_order_acquire);
+
+        if (head == t->tail) {
+            if (!more) break;
+
+            struct timespec poll = {0, TRACE_POLL_NS};
+            nanosleep(&poll, NULL);
+            continue;
+        }
+
+        uint8_t *end = out;
+
+        if (head - t->tail > t->size) { // overwritten before we got to them
+            end = trace_encode_gap(head - t->size - t->tail, end);
+            t->lost += head - t->size - t->tail;
+            t->tail = head - t->size;
+        }
+
+        size_t n = head - t->tail < TRACE_CHUNK ? head - t->tail : TRACE_CHUNK;
+
+        for (size_t x = 0; x < n; x++)
+            buf[x] = t->ring[(t->tail + x) & (t->size - 1)];
+
+        // entries the machine may have started overwriting while we copied
+        atomic_thread_fence(memory_order_acquire);
+        head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+        size_t torn = 0;
+
+        if (head + 1 > t->size && head + 1 - t->size > t->tail)
+            torn = head + 1 - t->size - t->tail < n
+                ? head + 1 - t->size - t->tail : n;
+
+        if (torn) {
+            end = trace_encode_gap(torn, end);
+            t->lost += torn;
+        }
+
+        for (size_t x = torn; x < n; x++)
+            end = trace_encode(c, &buf[x], end);
+
+        t->tail += n;
+
+        if (fwrite(out, 1, end - out, t->file) != (size_t) (end - out)) {
+            t->error = EIO;
+            break;
+        }
+    }
+
+    free(c);
+    free(buf);
+    free(out);
+
+    return NULL;
+}
+
+/*
+ * Stream the trace to a file from the oldest entry in the ring on, starting
+ * tracing into a TRACE_DEFAULT entry ring if it isn't already.
+ *
+ * return int: 0 on success, EBUSY if already streaming, ENOMEM if out of
+ * memory, errno value if the file can't be written
+ */
+
+int trace_stream(machine *m, const char *path) {
+    struct trace *t = &m->trace;
+    int result;
+
+    if (atomic_load(&t->streaming)) return EBUSY;
+    if (t->ring == NULL && (result = trace_start(m, TRACE_DEFAULT)))
+        return result;
+
+    if ((t->file = fopen(path, "wb")) == NULL) return errno;
+
+    struct trace_header header = {TRACE_MAGIC, TRACE_VERSION};
+    fwrite(&header, sizeof(header), 1, t->file);
+
+    trace_retire(m);
+
+    unsigned long long head = atomic_load(&t->head);
+    uint8_t rec[TRACE_RECORD_MAX];
+
+    t->tail = head > t->size ? head - t->size : 0;
+    t->lost = 0;
+    t->error = 0;
+
+    if (t->tail) fwrite(rec, 1, trace_encode_gap(t->tail, rec) - rec, t->file);
+
+    atomic_store(&t->streaming, 1);
+
+    if ((result = pthread_create(&t->thread, NULL, streamer, (void *) m))) {
+        atomic_store(&t->streaming, 0);
+        fclose(t->file);
+        t->file = NULL;
+        return result;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop streaming once the file has caught up with the ring. The machine must
+ * be stopped.
+ *
+ * return int: 0 on success or if not streaming, errno value if the file
+ * couldn't be written
+ */
+
+int trace_unstream(machine *m) {
+    struct trace *t = &m->trace;
+    if (!atomic_load(&t->streaming)) return 0;
+
+    trace_retire(m);
+
+    atomic_store(&t->streaming, 0);
+    pthread_join(t->thread, NULL);
+
+    int result = t->error;
+    if (!result && ferror(t->file)) result = EIO;
+    if (fclose(t->file) && !result) result = errno;
+    t->file = NULL;
+
+    return result;
+}
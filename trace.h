@@ -0,0 +1,263 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bus.h"
+
+/*
+ * Execution trace, see trace.c. One entry per instruction retired.
+ */
+
+struct trace_entry {
+    uint32_t pc; // if_ << 16 | PC of the instruction
+    uint32_t ea; // MAR when it retired: effective address, register or unit
+    data_width_t word; // the instruction
+    data_width_t acc; // its accumulator when it retired
+    uint8_t reg; // which accumulator, 0-7
+    uint8_t link;
+};
+
+/*
+ * Trace file format, written by the emulator and read by trace17. A header
+ * is followed by one record per entry, each coded against the entries before
+ * it: a byte holding the accumulator number (bits 0-2), the link (bit 3) and
+ * a flag for each field that isn't what was predicted, followed by those
+ * fields. The PC is predicted to follow on from the last one, the effective
+ * address to be the last one, the word to be the last one seen at the same
+ * address (modulo TRACE_WORDS) and the accumulator to hold what it last did.
+ * PC and effective address differences are zigzag LEB128 varints, words and
+ * accumulators two bytes, low first. A PC difference of 0 can't be coded
+ * otherwise, so a record with one marks a gap, followed by a varint count of
+ * the entries lost there.
+ */
+
+#define TRACE_MAGIC "P17T"
+#define TRACE_VERSION 1
+
+#define TRACE_JUMP 0x10 // PC doesn't follow on
+#define TRACE_EA 0x20
+#define TRACE_WORD 0x40
+#define TRACE_ACC 0x80
+
+#define TRACE_DEFAULT (1 << 20) // entries in the ring if not given
+#define TRACE_WORDS 4096 // THIS MUST BE A POWER OF TWO
+#define TRACE_RECORD_MAX 16 // longest record in bytes
+
+struct trace_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct trace_codec {
+    uint32_t pc;
+    uint32_t ea;
+    data_width_t acc[8];
+    data_width_t words[TRACE_WORDS];
+};
+
+static inline uint8_t *trace_varint(uint8_t *out, uint32_t x) {
+    while (x >= 0x80) {
+        *out++ = (x & 0x7F) | 0x80;
+        x >>= 7;
+    }
+
+    *out++ = x;
+
+    return out;
+}
+
+static inline uint32_t trace_zigzag(uint32_t delta) {
+    return (delta << 1) ^ (uint32_t) -(int32_t) (delta >> 31);
+}
+
+/*
+ * Code an entry into out, which must have room for TRACE_RECORD_MAX bytes.
+ *
+ * return uint8_t *: the end of the record
+ */
+
+static inline uint8_t *trace_encode(struct trace_codec *c,
+    const struct trace_entry *e, uint8_t *out) {
+
+    uint8_t *hdr = out++;
+    data_width_t *word = &c->words[e->pc & (TRACE_WORDS - 1)];
+
+    *hdr = (e->reg & 7) | (e->link & 1) << 3;
+
+    if (e->pc != c->pc + 1) {
+        *hdr |= TRACE_JUMP;
+        out = trace_varint(out, trace_zigzag(e->pc - c->pc - 1));
+    }
+
+    if (e->ea != c->ea) {
+        *hdr |= TRACE_EA;
+        out = trace_varint(out, trace_zigzag(e->ea - c->ea));
+    }
+
+    if (e->word != *word) {
+        *hdr |= TRACE_WORD;
+        *out++ = e->word & 0xFF;
+        *out++ = e->word >> 8;
+    }
+
+    if (e->acc != c->acc[e->reg & 7]) {
+        *hdr |= TRACE_ACC;
+        *out++ = e->acc & 0xFF;
+        *out++ = e->acc >> 8;
+    }
+
+    c->pc = e->pc;
+    c->ea = e->ea;
+    *word = e->word;
+    c->acc[e->reg & 7] = e->acc;
+
+    return out;
+}
+
+/*
+ * Code a gap of lost entries into out, which must have room for
+ * TRACE_RECORD_MAX bytes.
+ *
+ * return uint8_t *: the end of the record
+ */
+
+static inline uint8_t *trace_encode_gap(unsigned long long lost,
+    uint8_t *out) {
+
+    *out++ = TRACE_JUMP;
+    *out++ = 0;
+
+    while (lost >= 0x80) {
+        *out++ = (lost & 0x7F) | 0x80;
+        lost >>= 7;
+    }
+
+    *out++ = lost;
+
+    return out;
+}
+
+static inline int trace_read_varint(FILE *f, unsigned long long *x) {
+    int c;
+    int shift = 0;
+
+    *x = 0;
+
+    do {
+        if ((c = getc(f)) == EOF || shift > 63) return -1;
+        *x |= (unsigned long long) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return 0;
+}
+
+/*
+ * Decode the next record from f.
+ *
+ * return int: 1 for an entry, 0 for a gap of *lost entries, -1 at the end of
+ * the file or a truncated record
+ */
+
+static inline int trace_decode(struct trace_codec *c, FILE *f,
+    struct trace_entry *e, unsigned long long *lost) {
+
+    int hdr = getc(f);
+    unsigned long long x;
+
+    if (hdr == EOF) return -1;
+
+    memset(e, 0, sizeof(struct trace_entry));
+    e->reg = hdr & 7;
+    e->link = (hdr >> 3) & 1;
+    e->pc = c->pc + 1;
+    e->ea = c->ea;
+
+    if (hdr & TRACE_JUMP) {
+        if (trace_read_varint(f, &x)) return -1;
+
+        if (x == 0) {
+            if (trace_read_varint(f, lost)) return -1;
+            return 0;
+        }
+
+        // undo the zigzag
+        e->pc += (uint32_t) (x >> 1) ^ (uint32_t) -(int32_t) (x & 1);
+    }
+
+    if (hdr & TRACE_EA) {
+        if (trace_read_varint(f, &x)) return -1;
+        e->ea += (uint32_t) (x >> 1) ^ (uint32_t) -(int32_t) (x & 1);
+    }
+
+    data_width_t *word = &c->words[e->pc & (TRACE_WORDS - 1)];
+    e->word = *word;
+    e->acc = c->acc[e->reg];
+
+    if (hdr & TRACE_WORD) {
+        int lo = getc(f);
+        int hi = getc(f);
+
+        if (hi == EOF) return -1;
+        e->word = lo | hi << 8;
+    }
+
+    if (hdr & TRACE_ACC) {
+        int lo = getc(f);
+        int hi = getc(f);
+
+        if (hi == EOF) return -1;
+        e->acc = lo | hi << 8;
+    }
+
+    c->pc = e->pc;
+    c->ea = e->ea;
+    *word = e->word;
+    c->acc[e->reg] = e->acc;
+
+    return 1;
+}
+
+static inline void trace_print(FILE *f, const struct trace_entry *e) {
+    fprintf(f, "%06X %04hX A%d=%04hX L%d %06X\n", e->pc, e->word, e->reg,
+        e->acc, e->link, e->ea);
+}
+
+/*
+ * Per-machine trace state
+ */
+
+struct trace {
+    struct trace_entry *ring; // NULL while tracing is off
+    size_t size; // THIS MUST BE A POWER OF TWO
+    atomic_ullong head; // entries written so far
+
+    int pending; // an instruction is in flight
+    struct trace_entry next; // its PC and word
+
+    /*
+     * Streaming to a file, see trace_stream
+     */
+
+    FILE *file;
+    pthread_t thread;
+    atomic_int streaming;
+    unsigned long long tail; // entries streamed or lost so far
+    unsigned long long lost;
+    int error;
+};
+
+extern void trace_retire(machine *m);
+extern int trace_start(machine *m, size_t size);
+extern void trace_stop(machine *m);
+extern int trace_save(machine *m, const char *path);
+extern void trace_show(machine *m, FILE *f, size_t count);
+extern int trace_stream(machine *m, const char *path);
+extern int trace_unstream(machine *m);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "bus.h"
+#include "trace.h"
+
+/*
+ * PDP-17 trace decoder
+ *
+ * Prints a trace file saved or streamed by the emulator (see trace.h), one
+ * instruction per line:
+ *
+ *   address word Areg=accumulator Llink MAR
+ *
+ * with lost entries shown as "... n lost". -n prints only the last n lines,
+ * as for the instructions leading up to a fault.
+ */
+
+struct line {
+    int gap;
+    unsigned long long lost;
+    struct trace_entry entry;
+};
+
+void print_line(const struct line *l) {
+    if (l->gap) printf("... %llu lost\n", l->lost);
+    else trace_print(stdout, &l->entry);
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n lines] trace\n", name);
+}
+
+int main(int argc, char **argv) {
+    static struct trace_codec codec;
+    size_t last = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': // last lines only
+                last = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct trace_header header;
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, TRACE_MAGIC, 4)
+        || header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(ENOEXEC));
+        return 1;
+    }
+
+    struct line *ring = NULL;
+
+    if (last && (ring = malloc(last * sizeof(struct line))) == NULL) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    unsigned long long lines = 0;
+    int result;
+    struct line l;
+
+    while ((result = trace_decode(&codec, f, &l.entry, &l.lost)) >= 0) {
+        l.gap = !result;
+
+        if (ring != NULL) ring[lines % last] = l;
+        else print_line(&l);
+
+        lines++;
+    }
+
+    for (unsigned long long x = lines > last ? lines - last : 0;
+        ring != NULL && x < lines; x++) print_line(&ring[x % last]);
+
+    if (ferror(f)) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    fclose(f);
+    free(ring);
+
+    return 0;
+}
@@ -3,124 +3,255 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
-#include <unistd.h>
 #include <pthread.h>
-#include <poll.h>
 
 #include "bus.h"
 #include "cpu.h"
 #include "tty.h"
+#include "console.h"
+#include "sched.h"
+#include "machine.h"
 
-pthread_mutex_t reg_mutex;
-size_t unit_reg = 0;
-data_width_t cmd_reg = 0xFFFF;
+/*
+ * Per-unit command queues. tty_attn queues commands that have to wait for the
+ * console and wakes the unit's thread, which sleeps on its condition variable
+ * while there is nothing to do. The CPU only ever has one IOT outstanding, so
+ * the queues are shallow.
+ *
+ * Either unit can instead be scheduled, and is then a state machine driven
+ * from the run engine on virtual time (see sched.c), with no thread at all.
+ * Its IOTs complete at the IOT. A scheduled printer takes TTY_OUT_CYCLES to
+ * print each character, during which TSF doesn't skip, and raises its
+ * interrupt when done; a scheduled keyboard is fed by input events (see
+ * replay.c). The threaded units suit live use of the console, the scheduled
+ * ones keep IOTs cheap and timing repeatable. OPT_DETERMINISTIC schedules both.
+ */
 
-int tty_attn(size_t unit, data_width_t cmd) {
-    pthread_mutex_lock(&reg_mutex);
-    
-    unit_reg = unit;
-    cmd_reg = cmd;
-    
-    pthread_mutex_unlock(&reg_mutex);
+void init_tty(machine *m) {
+    for (size_t x = 0; x <= TTY_IN; x++) {
+        pthread_mutex_init(&m->tty[x].lock, NULL);
+        pthread_cond_init(&m->tty[x].wake, NULL);
+        m->tty[x].head = 0;
+        m->tty[x].tail = 0;
+        m->tty[x].scheduled = 0;
+        m->tty[x].ready = 1;
+        m->tty[x].done.fire = tty_done;
+        m->tty[x].done.device = 1;
+    }
 
-    return 0;
+    m->run_tty = 0;
 }
 
-int run_tty = 0;
+void free_tty(machine *m) {
+    for (size_t x = 0; x <= TTY_IN; x++) {
+        pthread_mutex_destroy(&m->tty[x].lock);
+        pthread_cond_destroy(&m->tty[x].wake);
+    }
+}
 
-extern int get_flag_acc();
+/*
+ * Returns nonzero if the unit runs on the scheduled model
+ */
 
-void *tty(void *vargp) {
-    size_t *unit_no_ptr = (size_t *) vargp;
-    size_t unit_no = *unit_no_ptr;
-
-    int cycles = 0;
-
-    while (run_tty) {
-        data_width_t my_cmd = 0xFFFF;
-        
-        if (unit_reg == unit_no && cmd_reg != 0xFFFF) {
-            pthread_mutex_lock(&reg_mutex);
-            my_cmd = cmd_reg;
-            unit_reg = 0;
-            cmd_reg = 0xFFFF;
-            pthread_mutex_unlock(&reg_mutex);
-        }
-        
-        int did_something = my_cmd != 0xFFFF;
-        
-        if (did_something) {
-            data_width_t acc_val = zpage[get_flag_acc()];
-            
-            switch (my_cmd) {
-                case 0x4:
-                    zpage[FLAG] &= ~(1 << IO);
-                    printf("%c", (char) (acc_val & 0xFF));
-                    fflush(stdout);
-                    break;
-                case 0x1:
-                    zpage[PC]++;
-                    zpage[FLAG] &= ~(1 << IO);
-                    break;
-                default:
-                    zpage[FLAG] &= ~(1 << IO);
-            }
-            
+int tty_scheduled(machine *m, size_t unit) {
+    return m->tty[unit].scheduled || m->options & OPT_DETERMINISTIC;
+}
+
+/*
+ * Scheduled printer's event, at the end of a character
+ */
+
+void tty_done(machine *m, unsigned long long now) {
+    m->tty[TTY_OUT].ready = 1;
+    raise_irq(m, TTY_OUT);
+}
+
+/*
+ * Cycles a stopped machine's scheduled printer has left before it is ready,
+ * counted from m->cycles, for snapshots and forks
+ */
+
+unsigned long long tty_pending(machine *m) {
+    struct tty_unit *u = &m->tty[TTY_OUT];
+
+    if (!u->done.slot) return 0;
+
+    return u->done.at > m->cycles ? u->done.at - m->cycles : 0;
+}
+
+/*
+ * Make a stopped machine's scheduled printer ready, or busy for left more
+ * cycles
+ */
+
+void tty_resume(machine *m, int ready, unsigned long long left) {
+    struct tty_unit *u = &m->tty[TTY_OUT];
+
+    cancel(m, &u->done);
+    u->ready = ready;
+
+    if (!ready && schedule(m, &u->done, m->cycles + left))
+        u->ready = 1; // no room in the queue, done already
+}
+
+/*
+ * Carry out a command on the scheduled model, on the calling thread. The
+ * console is only waited for if its output ring is full. Never returns EAGAIN.
+ */
+
+int tty_cmd_sched(machine *m, size_t unit, data_width_t cmd) {
+    struct tty_unit *u = &m->tty[unit];
+    struct replay *r = &m->replay;
+
+    if (unit == TTY_OUT) {
+        switch (cmd) {
+            case 0x4: // TPC
+                while (console_putc(m, m->zpage[get_flag_acc(m)] & 0xFF)
+                    == EAGAIN && m->console.run) console_wait_space(m);
+                u->ready = 0;
+                if (schedule(m, &u->done, m->sched.now + TTY_OUT_CYCLES))
+                    u->ready = 1; // no room in the queue, done already
+                break;
+            case 0x1: // TSF
+                if (u->ready) m->zpage[PC]++;
+                break;
         }
+    }
 
+    else if (unit == TTY_IN) {
+        replay_want(m);
+
+        switch (cmd) {
+            case 0x1: // KSF
+                if (r->latch >= 0) m->zpage[PC]++;
+                break;
+            case 0x6: // KRB
+                m->zpage[get_flag_acc(m)] = r->latch >= 0 ? r->latch : 0;
+                r->latch = -1;
+                break;
+        }
     }
-    
-    return NULL;
+
+    return 0;
 }
 
-void *ttyin(void *vargp) {
-    size_t *unit_no_ptr = (size_t *) vargp;
-    size_t unit_no = *unit_no_ptr;
-
-    while (run_tty) {
-        data_width_t my_cmd = 0xFFFF;
-        
-        if (unit_reg == unit_no && cmd_reg != 0xFFFF) {
-            pthread_mutex_lock(&reg_mutex);
-            my_cmd = cmd_reg;
-            unit_reg = 0;
-            cmd_reg = 0xFFFF;
-            pthread_mutex_unlock(&reg_mutex);
+/*
+ * Carry out a command. Returns EAGAIN if it can't be done without waiting for
+ * the console, 0 once it is done.
+ */
+
+int tty_cmd(machine *m, size_t unit, data_width_t cmd) {
+    if (tty_scheduled(m, unit)) return tty_cmd_sched(m, unit, cmd);
+
+    if (unit == TTY_OUT) {
+        switch (cmd) {
+            case 0x4: // TPC
+                return console_putc(m, m->zpage[get_flag_acc(m)] & 0xFF);
+            case 0x1: // TSF
+                if (ring_used(&m->console.out) < RING_SIZE) m->zpage[PC]++;
+                break;
         }
-        
-        int did_something = my_cmd != 0xFFFF;
-        
-        if (did_something) {
-            data_width_t acc = get_flag_acc();
-            
-            struct pollfd pfd;
-            pfd.fd = 0;
-            pfd.events = POLLIN;
-            
-            switch (my_cmd) {
-                case 0x1:
-                    poll(&pfd, 1, 0);
-                    if (pfd.revents & POLLIN)
-                        zpage[PC]++;
-                    
-                    zpage[FLAG] &= ~(1 << IO);
-                    break;
-                case 0x6:
-                    poll(&pfd, 1, 0);
-                    if (pfd.revents & POLLIN)
-                        zpage[acc] = getchar();
-                    else
-                        zpage[acc] = 0;
-                    
-                    zpage[FLAG] &= ~(1 << IO);
-                    break;
-                default:
-                    zpage[FLAG] &= ~(1 << IO);
-            }
-            
+    }
+
+    else if (unit == TTY_IN) {
+        uint8_t byte;
+
+        switch (cmd) {
+            case 0x1: // KSF
+                if (console_ready(m)) m->zpage[PC]++;
+                break;
+            case 0x6: // KRB
+                if (console_getc(m, &byte)) m->zpage[get_flag_acc(m)] = 0;
+                else m->zpage[get_flag_acc(m)] = byte;
+                break;
         }
+    }
+
+    return 0;
+}
+
+/*
+ * Commands that can be carried out straight away are done on the calling
+ * thread; anything else is queued for the unit's thread.
+ */
+
+int tty_attn(machine *m, size_t unit, data_width_t cmd) {
+    if (unit > TTY_IN) return EINVAL;
+
+    struct tty_unit *u = &m->tty[unit];
+
+    if (tty_cmd(m, unit, cmd) != EAGAIN) {
+        io_complete(m);
+        if (unit == TTY_OUT && cmd == 0x4 && !tty_scheduled(m, unit))
+            raise_irq(m, TTY_OUT);
+        return 0;
+    }
+
+    pthread_mutex_lock(&u->lock);
+
+    if (u->tail - u->head == QUEUE_SIZE) {
+        pthread_mutex_unlock(&u->lock);
+        return EBUSY;
+    }
+
+    u->cmd[u->tail++ & (QUEUE_SIZE - 1)] = cmd;
+    pthread_cond_signal(&u->wake);
+
+    pthread_mutex_unlock(&u->lock);
+
+    return 0;
+}
 
+/*
+ * Block until a command is queued for the unit or the TTYs are stopped.
+ * Returns 0xFFFF in the latter case.
+ */
+
+data_width_t tty_next(machine *m, size_t unit) {
+    struct tty_unit *u = &m->tty[unit];
+    data_width_t cmd = 0xFFFF;
+
+    pthread_mutex_lock(&u->lock);
+
+    while (m->run_tty && u->head == u->tail)
+        pthread_cond_wait(&u->wake, &u->lock);
+
+    if (m->run_tty) cmd = u->cmd[u->head++ & (QUEUE_SIZE - 1)];
+
+    pthread_mutex_unlock(&u->lock);
+
+    return cmd;
+}
+
+/*
+ * Stop the TTY threads, waking them so they notice. Queued commands are kept
+ * for the next run.
+ */
+
+void stop_tty(machine *m) {
+    for (size_t x = 0; x <= TTY_IN; x++) {
+        pthread_mutex_lock(&m->tty[x].lock);
+        m->run_tty = 0;
+        pthread_cond_broadcast(&m->tty[x].wake);
+        pthread_mutex_unlock(&m->tty[x].lock);
     }
-    
+}
+
+/*
+ * Output unit thread, vargp is the machine
+ */
+
+void *tty(void *vargp) {
+    machine *m = (machine *) vargp;
+    data_width_t my_cmd;
+
+    while ((my_cmd = tty_next(m, TTY_OUT)) != 0xFFFF) {
+        while (tty_cmd(m, TTY_OUT, my_cmd) == EAGAIN && m->console.run)
+            console_wait_space(m);
+
+        io_complete(m);
+        if (my_cmd == 0x4) raise_irq(m, TTY_OUT);
+    }
+
     return NULL;
 }
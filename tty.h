@@ -1,9 +1,41 @@
 #ifndef __TTY_H__
 #define __TTY_H__
 
-extern int tty_attn(size_t unit, data_width_t cmd);
-extern int run_tty;
+#include <pthread.h>
+
+#include "bus.h"
+#include "sched.h"
+
+#define TTY_OUT 2
+#define TTY_IN 3
+
+/*
+ * Per-unit command queue, see tty.c
+ */
+
+#define QUEUE_SIZE 4 // THIS MUST BE A POWER OF TWO
+#define TTY_OUT_CYCLES 100 // to print a character on the scheduled model
+
+struct tty_unit {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    data_width_t cmd[QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+
+    int scheduled; // run on the CPU's thread in virtual time, see tty.c
+    int ready; // scheduled printer has finished the last character
+    struct event done; // when it does
+};
+
+extern void init_tty(machine *m);
+extern void free_tty(machine *m);
+extern int tty_scheduled(machine *m, size_t unit);
+extern void tty_done(machine *m, unsigned long long now);
+extern unsigned long long tty_pending(machine *m);
+extern void tty_resume(machine *m, int ready, unsigned long long left);
+extern int tty_attn(machine *m, size_t unit, data_width_t cmd);
+extern void stop_tty(machine *m);
 extern void *tty(void *vargp);
-extern void *ttyin(void *vargp);
 
 #endif
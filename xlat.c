@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "bus.h"
+#include "cpu.h"
+#include "xlat.h"
+#include "perf.h"
+#include "machine.h"
+
+/*
+ * Threaded-code block cache
+ *
+ * Straight-line runs of instructions that complete within IFETCH and touch
+ * nothing but the registers (ANDR, TADR, ISZR, DCAR, MOV, OPR1, OPR2 and the
+ * reg_op group) are translated once into arrays of pre-resolved operations,
+ * which are then run back to back without fetching or decoding. Each
+ * operation is a call through a pointer to one of the handlers below; no host
+ * code is generated, so what a block saves is IFETCH's fetch, decode and
+ * dispatch, and blocks of one or two operations may cost more than they save
+ * (bench.c compares runs with and without them). A block ends
+ * before any instruction that needs the interpreter (memory references,
+ * JMP/JMS, IOT, HLT) and after any that may change the PC (skips and register
+ * writes to PC), and never crosses a page boundary.
+ *
+ * Blocks remember the write generation of their page when translated; bus
+ * writes into the page bump the generation, so self-modified code is always
+ * retranslated. Page 0 is never translated, and blocks end before
+ * breakpoints (see debug.c).
+ */
+
+extern void opr1(machine *m, int acc, int ucode);
+extern int opr2(machine *m, int acc, int ucode);
+extern void reg_op(machine *m, int acc);
+
+#define BLOCK_LEN 16
+#define BLOCKS 1024 // THIS MUST BE A POWER OF TWO
+#define GENS ((1 << 24) / PAGE_SIZE)
+
+struct op {
+    void (*fn)(machine *m, struct op *op);
+    addr_width_t mar;
+    data_width_t word;
+    uint8_t acc;
+    uint8_t tmp; // as IFETCH leaves it, see struct ucycle
+    uint8_t reg;
+    uint8_t class; // see perf.h
+};
+
+struct block {
+    addr_width_t tag;
+    uint32_t gen;
+    uint8_t valid;
+    uint8_t len;
+    struct op ops[BLOCK_LEN];
+};
+
+struct xlat {
+    struct block blocks[BLOCKS];
+    uint32_t page_gen[GENS];
+};
+
+struct xlat *new_xlat(void) {
+    return calloc(1, sizeof(struct xlat));
+}
+
+/*
+ * Operation handlers. By the time these run the PC, mar and mbr have been set
+ * up exactly as cycle_IFETCH would have left them.
+ */
+
+void op_andr(machine *m, struct op *op) {
+    m->zpage[op->acc] &= m->zpage[op->reg];
+}
+
+void op_tadr(machine *m, struct op *op) {
+    int result = (int) m->zpage[op->acc] + (int) m->zpage[op->reg];
+    if (result & ~(0xFFFF)) m->zpage[FLAG] ^= 1 << LK; // carry complement
+    m->zpage[op->acc] = (data_width_t) (result & 0xFFFF);
+}
+
+void op_iszr(machine *m, struct op *op) {
+    int result = ++m->zpage[op->reg];
+    data_width_t cmp_val = 0;
+
+    if (op->acc) cmp_val = m->zpage[op->acc]; // ISE
+
+    if (result == cmp_val) m->zpage[PC]++;
+}
+
+void op_dcar(machine *m, struct op *op) {
+    m->zpage[op->reg] = m->zpage[op->acc];
+    m->zpage[op->acc] = 0;
+}
+
+void op_mov(machine *m, struct op *op) {
+    m->zpage[op->acc] = m->zpage[op->reg];
+}
+
+void op_opr1(machine *m, struct op *op) {
+    opr1(m, op->acc, op->word & offset_mask);
+}
+
+void op_opr2(machine *m, struct op *op) {
+    opr2(m, op->acc, op->word & offset_mask);
+}
+
+void op_regop(machine *m, struct op *op) {
+    reg_op(m, op->acc);
+}
+
+/*
+ * Translate a single instruction. Returns 0 if it must be left to the
+ * interpreter, 1 if the block may continue after it, 2 if it must end the
+ * block.
+ */
+
+int translate_op(struct op *op, addr_width_t src, data_width_t word) {
+    int opcode = (word & 0xE000) >> 13;
+    int acc = (word & 0x1C00) >> 10;
+    int i = (word & 0x0200) >> 9;
+    int z = (word & 0x0100) >> 8;
+    int offset = word & offset_mask;
+
+    op->mar = src;
+    op->word = word;
+    op->acc = acc;
+    op->tmp = 0;
+    op->reg = offset;
+
+    if (opcode <= 3 && z && !i && offset <= PC) {
+        op->mar = offset;
+        op->tmp = opcode;
+        op->class = PERF_REGFORM;
+
+        switch (opcode) {
+            case 0: // ANDR
+                op->fn = op_andr;
+                return 1;
+            case 1: // TADR
+                op->fn = op_tadr;
+                return 1;
+            case 2: // ISZR
+                op->fn = op_iszr;
+                return 2;
+            case 3: // DCAR
+                op->fn = op_dcar;
+                return offset == PC ? 2 : 1;
+        }
+    }
+
+    else if (opcode == 5 && z && !i && offset <= PC && acc) { // MOV
+        op->mar = offset;
+        op->tmp = opcode;
+        op->class = PERF_REGFORM;
+        op->fn = op_mov;
+        return 1;
+    }
+
+    else if (opcode == 7 && i && z) { // Reg-reg operation
+        op->fn = op_regop;
+        op->class = PERF_REGOP;
+        return ((word & 0x00F0) == 0 && acc + 010 == PC) ? 2 : 1; // SIR PC
+    }
+
+    else if (opcode == 7 && !z) { // OPR1
+        op->fn = op_opr1;
+        op->class = PERF_OPR1;
+        return 1;
+    }
+
+    else if (opcode == 7 && !(word & 0x02)) { // OPR2 other than HLT
+        op->fn = op_opr2;
+        op->class = PERF_OPR2;
+        return 2;
+    }
+
+    return 0;
+}
+
+void translate(machine *m, struct block *blk, addr_width_t start) {
+    size_t pgn = start >> offset_width;
+    addr_width_t src = start;
+
+    blk->tag = start;
+    blk->gen = m->xlat->page_gen[pgn & (GENS - 1)];
+    blk->valid = 1;
+    blk->len = 0;
+
+    while (blk->len < BLOCK_LEN && src >> offset_width == pgn) {
+        data_width_t word;
+        if (m->debug.n_breaks && debug_break(m, src)) break;
+        if (bus_read(m, src, &word)) break;
+
+        int result = translate_op(&blk->ops[blk->len], src, word);
+        if (!result) break;
+
+        blk->len++;
+        src++;
+
+        if (result == 2) break;
+    }
+
+    return;
+}
+
+/*
+ * Run the block starting at the current PC, translating it first if needed,
+ * and leave u as single-stepping would have. Each operation takes one
+ * micro-cycle, and no more than limit are run, so that the run stops exactly
+ * where single-stepping would have stopped at the end of the budget, and
+ * events fire on the cycle they are due on. Must only be called at an
+ * instruction boundary.
+ *
+ * return unsigned int: number of micro-cycles executed, 0 if the instruction
+ * at PC has to go through the interpreter
+ */
+
+unsigned int run_block(machine *m, struct ucycle *u, unsigned int limit) {
+    addr_width_t start = m->zpage[PC] | ((addr_width_t) m->if_) << 16;
+    size_t pgn = start >> offset_width;
+
+    if (!pgn) return 0;
+
+    struct block *blk = &m->xlat->blocks[start & (BLOCKS - 1)];
+
+    if (!blk->valid || blk->tag != start
+        || blk->gen != m->xlat->page_gen[pgn & (GENS - 1)])
+        translate(m, blk, start);
+
+    unsigned int len = blk->len < limit ? blk->len : limit;
+
+    for (unsigned int x = 0; x < len; x++) {
+        struct op *op = &blk->ops[x];
+
+        m->zpage[PC]++;
+        m->mar = op->mar;
+        m->mbr = op->word;
+        PERF(m->perf.insns[op->class]++);
+
+        (*op->fn)(m, op);
+    }
+
+    if (len) {
+        u->cycle = 0;
+        u->acc = blk->ops[len - 1].acc;
+        u->tmp = blk->ops[len - 1].tmp;
+        u->id = 0;
+        u->ex = 0;
+    }
+
+    return len;
+}
+
+void xlat_snoop(machine *m, addr_width_t dst) {
+    m->xlat->page_gen[(dst >> offset_width) & (GENS - 1)]++;
+}
+
+void xlat_flush(machine *m) {
+    for (size_t x = 0; x < BLOCKS; x++) m->xlat->blocks[x].valid = 0;
+}
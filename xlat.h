@@ -0,0 +1,13 @@
+#ifndef __XLAT_H__
+#define __XLAT_H__
+
+#include "bus.h"
+#include "cpu.h"
+
+extern struct xlat *new_xlat(void);
+extern unsigned int run_block(machine *m, struct ucycle *u,
+    unsigned int limit);
+extern void xlat_snoop(machine *m, addr_width_t dst);
+extern void xlat_flush(machine *m);
+
+#endif